@@ -0,0 +1,436 @@
+// Micro-benchmarks of the hot paths, for catching performance regressions.
+//
+// Usage: prophecy_bench [--quick] [--json] [--baseline file.csv [--tolerance t]]
+//
+// Prints one CSV line (or JSON object) per benchmark with its throughput:
+// GFLOP/s for products, GB/s for elementwise operations, samples/s for
+// training, elements/s for activations. Save a run as a baseline with
+//   ./prophecy_bench > baseline.csv
+// then later runs given --baseline flag every throughput which dropped by
+// more than the tolerance (default 0.10) and exit with status 1.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "../src/model/model.hh"
+#include "../src/layer_implem/dense_layer.hh"
+#include "../src/layer_implem/conv2d_layer.hh"
+#include "../src/layer_implem/max_pool2d_layer.hh"
+
+using clock_type = std::chrono::steady_clock;
+
+struct Result
+{
+    std::string benchmark;
+    std::string params;
+    std::string metric;
+    double value;   // higher is better
+    double seconds; // per run
+};
+
+// Seconds per call of f: calls are batched to last at least 50 ms, and the
+// best of three batches is kept
+template <typename F>
+static double time_best(F f)
+{
+    f();
+    int calls = 1;
+    double best = 1e30;
+    for (int run = 0; run < 3; run++)
+    {
+        while (true)
+        {
+            auto start = clock_type::now();
+            for (int i = 0; i < calls; i++)
+                f();
+            std::chrono::duration<double> elapsed = clock_type::now() - start;
+            if (elapsed.count() >= 0.05)
+            {
+                best = std::min(best, elapsed.count() / calls);
+                break;
+            }
+            calls *= 2;
+        }
+    }
+    return best;
+}
+
+static std::string shape(int m, int n, int k)
+{
+    return std::to_string(m) + "x" + std::to_string(n) + "x" + std::to_string(k);
+}
+
+static void bench_dot(std::vector<Result>& results, const std::vector<int>& sizes)
+{
+    const char* names[] = { "dot_no_implicit", "dot_left", "dot_right" };
+    const transpose orders[] = { transpose::NO_IMPLICIT, transpose::LEFT, transpose::RIGHT };
+    for (int n : sizes)
+    {
+        Matrix<float> a(n, n);
+        Matrix<float> b(n, n);
+        Matrix<float> c(n, n);
+        a.fill(fill_type::RANDOM_FLOAT);
+        b.fill(fill_type::RANDOM_FLOAT);
+        for (int mode = 0; mode < 3; mode++)
+        {
+            double seconds = time_best([&]() {
+                Matrix<float>::dot_into(c, a, b, orders[mode]);
+            });
+            results.push_back({ names[mode], shape(n, n, n), "gflops",
+                                2.0 * n * n * n / seconds * 1e-9, seconds });
+        }
+    }
+}
+
+static void bench_elementwise(std::vector<Result>& results, const std::vector<int>& sizes)
+{
+    for (int n : sizes)
+    {
+        Matrix<float> a(1, n);
+        Matrix<float> b(1, n);
+        a.fill(fill_type::RANDOM_FLOAT);
+        b.fill(fill_type::RANDOM_FLOAT);
+        const std::string params = std::to_string(n);
+        const double bytes = sizeof(float) * static_cast<double>(n);
+
+        double seconds = time_best([&]() { a += b; });
+        results.push_back({ "add_inplace", params, "gbps", 3 * bytes / seconds * 1e-9, seconds });
+
+        // By ones, so that repeated runs do not end up on denormals
+        Matrix<float> ones(1, n);
+        ones.fill(1.0f);
+        seconds = time_best([&]() { a.multiply_inplace(ones); });
+        results.push_back({ "multiply_inplace", params, "gbps", 3 * bytes / seconds * 1e-9, seconds });
+
+        seconds = time_best([&]() { a.fill(0.5f); });
+        results.push_back({ "fill", params, "gbps", bytes / seconds * 1e-9, seconds });
+
+        // Fused expression: one pass, two reads and a write
+        seconds = time_best([&]() { a.assign(a - 0.01f * b); });
+        results.push_back({ "axpy_expr", params, "gbps", 3 * bytes / seconds * 1e-9, seconds });
+    }
+}
+
+static void bench_transpose(std::vector<Result>& results, const std::vector<int>& sizes)
+{
+    for (int n : sizes)
+    {
+        Matrix<float> a(n, n + 3);
+        a.fill(fill_type::RANDOM_FLOAT);
+        double seconds = time_best([&]() { a.transpose(); });
+        results.push_back({ "transpose", std::to_string(n) + "x" + std::to_string(n + 3), "gbps",
+                            2.0 * sizeof(float) * n * (n + 3) / seconds * 1e-9, seconds });
+    }
+}
+
+// Parameter initialization of a large layer, on every thread of the pool
+static void bench_init(std::vector<Result>& results, int rows, int cols)
+{
+    Matrix<float> weights(rows, cols);
+    const double values = static_cast<double>(rows) * cols;
+    const fill_type types[] = { fill_type::XAVIER_UNIFORM, fill_type::HE_NORMAL };
+    const char* names[] = { "init_xavier_uniform", "init_he_normal" };
+    for (int t = 0; t < 2; t++)
+    {
+        uint64_t seed = 0;
+        double seconds = time_best([&]() { weights.fill(types[t], seed++); });
+        results.push_back({ names[t], std::to_string(rows) + "x" + std::to_string(cols),
+                            "gbps", sizeof(float) * values / seconds * 1e-9, seconds });
+    }
+}
+
+// Activation loop of a layer epilogue, on z in [-8, 8]
+template <typename Activation>
+static void bench_activation(std::vector<Result>& results, const char* name, int n)
+{
+    Matrix<float> z(1, n);
+    Matrix<float> a(1, n);
+    z.fill(fill_type::RANDOM_FLOAT);
+    z.assign(8.0f * z);
+    const Activation activation;
+    double seconds = time_best([&]() {
+        const float* in = z.get_data();
+        float* out = a.get_data();
+        for (int i = 0; i < n; i++)
+            out[i] = activation.f(in[i]);
+    });
+    results.push_back({ name, std::string(math_mode_name(Activation::mode)) + "/" + std::to_string(n),
+                        "elements_per_s", n / seconds, seconds });
+}
+
+static void bench_activations(std::vector<Result>& results, int n)
+{
+    bench_activation<Sigmoid<float, math_mode::EXACT>>(results, "sigmoid", n);
+    bench_activation<Sigmoid<float, math_mode::FAST>>(results, "sigmoid", n);
+    bench_activation<Sigmoid<float, math_mode::TABLE>>(results, "sigmoid", n);
+    bench_activation<Tanh<float, math_mode::EXACT>>(results, "tanh", n);
+    bench_activation<Tanh<float, math_mode::FAST>>(results, "tanh", n);
+    bench_activation<Tanh<float, math_mode::TABLE>>(results, "tanh", n);
+    bench_activation<Softplus<float, math_mode::EXACT>>(results, "softplus", n);
+    bench_activation<Softplus<float, math_mode::FAST>>(results, "softplus", n);
+    bench_activation<Softplus<float, math_mode::TABLE>>(results, "softplus", n);
+}
+
+// Forward and backward of one output DenseLayer on a batch
+static void bench_dense_step(std::vector<Result>& results, int inputs, int neurons, int batch)
+{
+    auto input = std::make_shared<InputLayer<float>>(inputs);
+    DenseLayer<float, Sigmoid<float>> dense(neurons);
+    dense.compile(input, nullptr);
+
+    Workspace<float> workspace;
+    LayerContext<float> input_ctx;
+    LayerContext<float> ctx;
+    dense.reserve(workspace, ctx, batch);
+    workspace.allocate();
+    dense.bind(workspace, ctx);
+
+    Matrix<float> x(inputs, batch);
+    Matrix<float> y(neurons, batch);
+    x.fill(fill_type::RANDOM_FLOAT);
+    y.fill(fill_type::ZERO);
+
+    double seconds = time_best([&]() {
+        input->forward(x, input_ctx, true);
+        dense.forward(x, ctx, true);
+        dense.backward(ctx, input_ctx, nullptr, nullptr, &y, Loss<float>::mse());
+    });
+    const std::string params = shape(neurons, batch, inputs);
+    results.push_back({ "dense_step", params, "samples_per_s", batch / seconds, seconds });
+    results.push_back({ "dense_step", params, "gflops",
+                        4.0 * inputs * neurons * batch / seconds * 1e-9, seconds });
+}
+
+// One epoch of Model::train on random data
+static void bench_train(std::vector<Result>& results, int nb_samples, int batch,
+                        const Optimizer<float>& optimizer = Optimizer<float>::sgd(0.01))
+{
+    set_random_seed(0);
+    std::vector<Matrix<float>> x;
+    std::vector<Matrix<float>> y;
+    for (int s = 0; s < nb_samples; s++)
+    {
+        x.emplace_back(784, 1);
+        y.emplace_back(10, 1);
+        x.back().fill(fill_type::RANDOM_FLOAT);
+        y.back().fill(fill_type::ZERO);
+        y.back()(s % 10, 0) = 1;
+    }
+
+    Model<float> model;
+    model.add(new InputLayer<float>(784));
+    model.add(new DenseLayer<float, ReLU<float>>(128));
+    model.add(new DenseLayer<float, Sigmoid<float>>(10));
+    model.compile(optimizer, batch);
+
+    double seconds = time_best([&]() { model.train(x, y, 1, batch); });
+    const std::string suffix = optimizer.id == optimizer_id::SGD
+                             ? "" : std::string("_") + optimizer_name(optimizer.id);
+    results.push_back({ "train_epoch" + suffix, "784-128-10/" + std::to_string(nb_samples)
+                        + "/" + std::to_string(batch),
+                        "samples_per_s", nb_samples / seconds, seconds });
+}
+
+// Batched inference in float and through the int8 path
+static void bench_inference(std::vector<Result>& results, int batch)
+{
+    set_random_seed(0);
+    Model<float> model;
+    model.add(new InputLayer<float>(784));
+    model.add(new DenseLayer<float, ReLU<float>>(1024));
+    model.add(new DenseLayer<float, ReLU<float>>(1024));
+    model.add(new DenseLayer<float, Sigmoid<float>>(10));
+    model.compile(0.01);
+
+    Matrix<float> x(784, batch);
+    x.fill(fill_type::RANDOM_FLOAT);
+    std::vector<LayerContext<float>> contexts;
+    const std::string params = "784-1024-1024-10/" + std::to_string(batch);
+
+    double seconds = time_best([&]() { model.predict_batch(x, contexts); });
+    results.push_back({ "predict_float", params, "samples_per_s", batch / seconds, seconds });
+
+    model.quantize(x);
+    seconds = time_best([&]() { model.predict_batch(x, contexts); });
+    results.push_back({ "predict_int8", params, "samples_per_s", batch / seconds, seconds });
+}
+
+// Batched inference of the same model pruned to the given sparsity
+static void bench_sparse(std::vector<Result>& results, int batch, double sparsity)
+{
+    set_random_seed(0);
+    Model<float> model;
+    model.add(new InputLayer<float>(784));
+    model.add(new DenseLayer<float, ReLU<float>>(1024));
+    model.add(new DenseLayer<float, ReLU<float>>(1024));
+    model.add(new DenseLayer<float, Sigmoid<float>>(10));
+    model.compile(0.01);
+    model.prune(sparsity);
+
+    Matrix<float> x(784, batch);
+    x.fill(fill_type::RANDOM_FLOAT);
+    std::vector<LayerContext<float>> contexts;
+    double seconds = time_best([&]() { model.predict_batch(x, contexts); });
+    results.push_back({ "predict_sparse", "784-1024-1024-10/" + std::to_string(batch) + "/"
+                        + std::to_string(static_cast<int>(sparsity * 100)),
+                        "samples_per_s", batch / seconds, seconds });
+}
+
+// Batched inference of a small convolutional network on 28x28 images
+static void bench_conv(std::vector<Result>& results, int batch)
+{
+    set_random_seed(0);
+    Model<float> model;
+    const ImageShape image = { 1, 28, 28 };
+    auto conv1 = new Conv2DLayer<float, ReLU<float>>(image, 16, 3, 1, 1);
+    auto pool1 = new MaxPool2DLayer<float>(conv1->get_output_shape());
+    auto conv2 = new Conv2DLayer<float, ReLU<float>>(pool1->get_output_shape(), 32, 3, 1, 1);
+    auto pool2 = new MaxPool2DLayer<float>(conv2->get_output_shape());
+    model.add(new InputLayer<float>(image.size()));
+    model.add(conv1);
+    model.add(pool1);
+    model.add(conv2);
+    model.add(pool2);
+    model.add(new DenseLayer<float, Sigmoid<float>>(10));
+    model.compile(0.01);
+
+    Matrix<float> x(image.size(), batch);
+    x.fill(fill_type::RANDOM_FLOAT);
+    std::vector<LayerContext<float>> contexts;
+    double seconds = time_best([&]() { model.predict_batch(x, contexts); });
+    results.push_back({ "predict_conv", "c16-p2-c32-p2-10/" + std::to_string(batch),
+                        "samples_per_s", batch / seconds, seconds });
+}
+
+static std::string key(const std::string& benchmark, const std::string& params,
+                       const std::string& metric)
+{
+    return benchmark + "/" + params + "/" + metric;
+}
+
+// Throughputs of a CSV written by a previous run
+static std::map<std::string, double> read_baseline(const std::string& path)
+{
+    std::ifstream in(path);
+    if (!in)
+        throw std::runtime_error("Cannot open " + path);
+
+    std::map<std::string, double> baseline;
+    std::string line;
+    while (std::getline(in, line))
+    {
+        std::stringstream fields(line);
+        std::string benchmark, params, metric, value;
+        if (std::getline(fields, benchmark, ',') && std::getline(fields, params, ',')
+            && std::getline(fields, metric, ',') && std::getline(fields, value, ',')
+            && benchmark != "benchmark") // header
+            baseline[key(benchmark, params, metric)] = std::atof(value.c_str());
+    }
+    return baseline;
+}
+
+int main(int argc, char* argv[])
+{
+    bool quick = false;
+    bool json = false;
+    std::string baseline_path;
+    double tolerance = 0.10;
+    for (int i = 1; i < argc; i++)
+    {
+        if (std::strcmp(argv[i], "--quick") == 0)
+            quick = true;
+        else if (std::strcmp(argv[i], "--json") == 0)
+            json = true;
+        else if (std::strcmp(argv[i], "--baseline") == 0 && i + 1 < argc)
+            baseline_path = argv[++i];
+        else if (std::strcmp(argv[i], "--tolerance") == 0 && i + 1 < argc)
+            tolerance = std::atof(argv[++i]);
+        else
+        {
+            std::cerr << "Usage: " << argv[0]
+                      << " [--quick] [--json] [--baseline file.csv [--tolerance t]]" << std::endl;
+            return 2;
+        }
+    }
+
+    std::vector<Result> results;
+    bench_dot(results, quick ? std::vector<int>{ 64, 256 }
+                             : std::vector<int>{ 64, 128, 256, 512, 1024 });
+    bench_elementwise(results, quick ? std::vector<int>{ 1 << 12, 1 << 20 }
+                                     : std::vector<int>{ 1 << 10, 1 << 14, 1 << 18, 1 << 22 });
+    bench_transpose(results, quick ? std::vector<int>{ 256, 1024 }
+                                   : std::vector<int>{ 64, 256, 1024, 2048 });
+    bench_init(results, quick ? 1024 : 4096, 4096);
+    bench_activations(results, 1 << 16);
+    bench_dense_step(results, 784, 128, 64);
+    bench_dense_step(results, 1024, 1024, 256);
+    bench_train(results, quick ? 512 : 4096, 64);
+    bench_train(results, quick ? 512 : 4096, 64, Optimizer<float>::adam(0.001));
+    bench_inference(results, 256);
+    bench_sparse(results, 256, 0.8);
+    bench_sparse(results, 256, 0.95);
+    bench_conv(results, 64);
+
+    std::map<std::string, double> baseline;
+    if (!baseline_path.empty())
+        baseline = read_baseline(baseline_path);
+
+    int regressions = 0;
+    if (json)
+        std::cout << "[" << std::endl;
+    else
+        std::cout << "benchmark,params,metric,value,seconds"
+                  << (baseline.empty() ? "" : ",baseline,ratio,status") << std::endl;
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        const Result& r = results[i];
+        std::string status;
+        double base = 0;
+        double ratio = 0;
+        auto it = baseline.find(key(r.benchmark, r.params, r.metric));
+        if (it != baseline.end() && it->second > 0)
+        {
+            base = it->second;
+            ratio = r.value / base;
+            status = ratio < 1 - tolerance ? "REGRESSION" : ratio > 1 + tolerance ? "faster" : "ok";
+            regressions += status == "REGRESSION";
+        }
+        else if (!baseline.empty())
+            status = "new";
+
+        if (json)
+        {
+            std::cout << "  {\"benchmark\": \"" << r.benchmark << "\", \"params\": \""
+                      << r.params << "\", \"metric\": \"" << r.metric << "\", \"value\": "
+                      << r.value << ", \"seconds\": " << r.seconds;
+            if (!status.empty())
+                std::cout << ", \"baseline\": " << base << ", \"ratio\": " << ratio
+                          << ", \"status\": \"" << status << "\"";
+            std::cout << "}" << (i + 1 < results.size() ? "," : "") << std::endl;
+        }
+        else
+        {
+            std::cout << r.benchmark << "," << r.params << "," << r.metric << ","
+                      << r.value << "," << r.seconds;
+            if (!baseline.empty())
+                std::cout << "," << base << "," << ratio << "," << status;
+            std::cout << std::endl;
+        }
+    }
+    if (json)
+        std::cout << "]" << std::endl;
+
+    if (regressions > 0)
+        std::cerr << regressions << " regression(s) beyond " << tolerance * 100
+                  << "% against " << baseline_path << std::endl;
+    return regressions > 0 ? 1 : 0;
+}
@@ -0,0 +1,70 @@
+// Strong scaling of Matrix::dot over the shared thread pool.
+//
+// Usage: gemm_scaling [max_threads [m n k]]
+// Defaults: all hardware threads, a 4096 x 4096 weight matrix times a
+// 4096 x 256 batch. Prints one CSV line per (transpose mode, threads).
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+#include "../src/matrix/matrix.hh"
+#include "../src/matrix/thread_pool.hh"
+
+using clock_type = std::chrono::steady_clock;
+
+static double time_dot(const Matrix<float>& left, const Matrix<float>& right,
+                       transpose order)
+{
+    // One warm-up run, then the best of three
+    Matrix<float>::dot(left, right, order);
+    double best = 1e30;
+    for (int run = 0; run < 3; run++)
+    {
+        auto start = clock_type::now();
+        Matrix<float>::dot(left, right, order);
+        std::chrono::duration<double> elapsed = clock_type::now() - start;
+        best = std::min(best, elapsed.count());
+    }
+    return best;
+}
+
+int main(int argc, char* argv[])
+{
+    int max_threads = argc > 1 ? std::atoi(argv[1]) : ThreadPool::default_nb_threads();
+    int m = argc > 4 ? std::atoi(argv[2]) : 4096;
+    int n = argc > 4 ? std::atoi(argv[3]) : 256;
+    int k = argc > 4 ? std::atoi(argv[4]) : 4096;
+
+    // op(left) is m x k, op(right) is k x n in every mode
+    Matrix<float> a(m, k);
+    Matrix<float> b(k, n);
+    a.fill(fill_type::RANDOM_FLOAT);
+    b.fill(fill_type::RANDOM_FLOAT);
+    Matrix<float> a_t = a.transpose();
+    Matrix<float> b_t = b.transpose();
+
+    const double flop = 2.0 * m * n * k;
+    const std::string names[] = { "no_implicit", "left", "right" };
+
+    std::cout << "mode,m,n,k,threads,seconds,gflops,speedup,efficiency" << std::endl;
+    for (int mode = 0; mode < 3; mode++)
+    {
+        double base = 0;
+        for (int threads = 1; threads <= max_threads; threads++)
+        {
+            ThreadPool::set_global_threads(threads);
+            double seconds = mode == 0 ? time_dot(a, b, transpose::NO_IMPLICIT)
+                           : mode == 1 ? time_dot(a_t, b, transpose::LEFT)
+                           : time_dot(a, b_t, transpose::RIGHT);
+            if (threads == 1)
+                base = seconds;
+            std::cout << names[mode] << "," << m << "," << n << "," << k << ","
+                      << threads << "," << seconds << "," << flop / seconds * 1e-9 << ","
+                      << base / seconds << "," << base / seconds / threads << std::endl;
+        }
+    }
+
+    return 0;
+}
@@ -1,15 +1,63 @@
 #pragma once
 
+#include <algorithm>
+#include <cstdint>
 #include <functional>
 #include <cmath>
 #include <ctgmath>
+#include <type_traits>
+#include <vector>
 
+#include "fast_math.hh"
+
+// An activation provides f(z) and its derivative fd(z, a) where a = f(z).
+// Layers take the activation as a template parameter, so the functors
+// below are inlined in the element loops. fd receives the cached a so that
+// most derivatives cost no transcendental call at all. Sigmoid, Tanh and
+// Softplus take a math_mode: EXACT calls libm, FAST and TABLE use the
+// approximations of fast_math.hh, whose errors are listed there.
+
+// Identifies an activation in saved models. Values are part of the file
+// format, append only.
+enum class activation_id : uint32_t
+{
+    CUSTOM,
+    SIGMOID,
+    TANH,
+    RELU,
+    LEAKY_RELU,
+    SOFTPLUS,
+    SOFTMAX
+};
+
+inline const char* activation_name(activation_id id)
+{
+    switch (id)
+    {
+        case activation_id::SIGMOID: return "sigmoid";
+        case activation_id::TANH: return "tanh";
+        case activation_id::RELU: return "relu";
+        case activation_id::LEAKY_RELU: return "leaky_relu";
+        case activation_id::SOFTPLUS: return "softplus";
+        case activation_id::SOFTMAX: return "softmax";
+        default: return "custom";
+    }
+}
+
+// Type-erased activation, for custom lambdas. fd_ is evaluated on z, or
+// fda_ on a = f(z) when it is set, which is cheaper for most activations.
+// Models using a CUSTOM one cannot be saved.
 template <typename T>
 class ActivationFunction
 {
 public:
+    T f(T z) const { return f_(z); }
+    T fd(T z, T a) const { return fda_ ? fda_(a) : fd_(z); }
+
     std::function<T(T)> f_;
     std::function<T(T)> fd_;
+    std::function<T(T)> fda_;
+    activation_id id = activation_id::CUSTOM;
 };
 
 template <typename T>
@@ -18,12 +66,189 @@ class SigmoidActivationFunction : public ActivationFunction<T>
 public:
     SigmoidActivationFunction()
     {
+        this->id = activation_id::SIGMOID;
         this->f_ = [](T x) {
             return 1 / (1 + exp(-x));
         };
 
-        this->fd_ = [this](T x) {
-            return this->f_(x) * (1 - this->f_(x));
+        this->fd_ = [](T x) {
+            T s = 1 / (1 + exp(-x));
+            return s * (1 - s);
+        };
+
+        this->fda_ = [](T a) {
+            return a * (1 - a);
         };
     }
 };
+
+template <typename T, math_mode Mode = math_mode::EXACT>
+struct Sigmoid
+{
+    static constexpr activation_id id = activation_id::SIGMOID;
+    static constexpr math_mode mode = Mode;
+
+    T f(T z) const
+    {
+        if constexpr (Mode == math_mode::FAST)
+            return fast_sigmoid(z);
+        else if constexpr (Mode == math_mode::TABLE)
+            return activation_tables<T>.sigmoid(z);
+        else
+            return 1 / (1 + std::exp(-z));
+    }
+
+    T fd(T, T a) const { return a * (1 - a); }
+};
+
+template <typename T, math_mode Mode = math_mode::EXACT>
+struct Tanh
+{
+    static constexpr activation_id id = activation_id::TANH;
+    static constexpr math_mode mode = Mode;
+
+    T f(T z) const
+    {
+        if constexpr (Mode == math_mode::FAST)
+            return fast_tanh(z);
+        else if constexpr (Mode == math_mode::TABLE)
+            return activation_tables<T>.tanh(z);
+        else
+            return std::tanh(z);
+    }
+
+    T fd(T, T a) const { return 1 - a * a; }
+};
+
+template <typename T>
+struct ReLU
+{
+    static constexpr activation_id id = activation_id::RELU;
+
+    T f(T z) const { return z > 0 ? z : static_cast<T>(0); }
+    T fd(T, T a) const { return a > 0 ? static_cast<T>(1) : static_cast<T>(0); }
+};
+
+template <typename T>
+struct LeakyReLU
+{
+    static constexpr activation_id id = activation_id::LEAKY_RELU;
+
+    LeakyReLU(T alpha = static_cast<T>(0.01)) : alpha_(alpha) {}
+
+    T f(T z) const { return z > 0 ? z : alpha_ * z; }
+    // alpha > 0 keeps the sign of z in a
+    T fd(T, T a) const { return a > 0 ? static_cast<T>(1) : alpha_; }
+
+    T alpha_;
+};
+
+template <typename T, math_mode Mode = math_mode::EXACT>
+struct Softplus
+{
+    static constexpr activation_id id = activation_id::SOFTPLUS;
+    static constexpr math_mode mode = Mode;
+
+    // log(1 + e^z), written so that e^z never overflows
+    T f(T z) const
+    {
+        if constexpr (Mode == math_mode::FAST)
+            return fast_softplus(z);
+        else if constexpr (Mode == math_mode::TABLE)
+            return activation_tables<T>.softplus(z);
+        else
+            return z > 0 ? z + std::log1p(std::exp(-z)) : std::log1p(std::exp(z));
+    }
+
+    // sigmoid(z) = 1 - e^-a, through expm1 so that small a, for negative
+    // z, do not cancel to 0; FAST and TABLE take the sigmoid of z
+    T fd(T z, T a) const
+    {
+        if constexpr (Mode == math_mode::FAST)
+            return fast_sigmoid(z);
+        else if constexpr (Mode == math_mode::TABLE)
+            return activation_tables<T>.sigmoid(z);
+        else
+            return -std::expm1(-a);
+    }
+};
+
+// Softmax over the outputs of each sample, for the output layer of
+// classifiers. It is not elementwise: f() lets z through the GEMM epilogue,
+// then normalize() turns every column of the layer's output into a
+// distribution. Its derivative only exists through the loss, see
+// Loss::output_delta.
+template <typename T>
+struct Softmax
+{
+    static constexpr activation_id id = activation_id::SOFTMAX;
+    static constexpr bool per_sample = true;
+
+    T f(T z) const { return z; }
+
+    // a (rows x cols) holds z on entry. Shifted by the largest z of each
+    // column, so exp never overflows; row by row, so the loops run along
+    // the batch.
+    void normalize(T* a, int rows, int cols) const
+    {
+        thread_local std::vector<T> column;
+        column.assign(2 * static_cast<size_t>(cols), 0);
+        T* max = column.data();
+        T* sum = max + cols;
+        std::copy(a, a + cols, max);
+        for (int i = 1; i < rows; ++i)
+            for (int j = 0; j < cols; ++j)
+                max[j] = std::max(max[j], a[static_cast<long>(i) * cols + j]);
+        for (int i = 0; i < rows; ++i)
+        {
+            T* row = a + static_cast<long>(i) * cols;
+            for (int j = 0; j < cols; ++j)
+            {
+                row[j] = std::exp(row[j] - max[j]);
+                sum[j] += row[j];
+            }
+        }
+        for (int j = 0; j < cols; ++j)
+            sum[j] = 1 / sum[j];
+        for (int i = 0; i < rows; ++i)
+        {
+            T* row = a + static_cast<long>(i) * cols;
+            for (int j = 0; j < cols; ++j)
+                row[j] *= sum[j];
+        }
+    }
+};
+
+// No activation, for layers that only move values around, such as pooling
+template <typename T>
+struct Identity
+{
+    static constexpr activation_id id = activation_id::CUSTOM;
+
+    T f(T z) const { return z; }
+    T fd(T, T) const { return 1; }
+};
+
+// Whether an activation works on whole samples (columns) rather than on
+// each value, like Softmax
+template <typename A, typename = void>
+struct is_per_sample : std::false_type {};
+
+template <typename A>
+struct is_per_sample<A, std::void_t<decltype(A::per_sample)>>
+    : std::integral_constant<bool, A::per_sample> {};
+
+// Math mode of an activation, EXACT for those without one
+template <typename A, typename = void>
+struct activation_mode : std::integral_constant<math_mode, math_mode::EXACT> {};
+
+template <typename A>
+struct activation_mode<A, std::void_t<decltype(A::mode)>>
+    : std::integral_constant<math_mode, A::mode> {};
+
+// Parameter of an activation, as saved in model files
+template <typename A>
+double activation_parameter(const A&) { return 0; }
+
+template <typename T>
+double activation_parameter(const LeakyReLU<T>& a) { return a.alpha_; }
@@ -0,0 +1,281 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <utility>
+#include <vector>
+
+// Branch-free exp, log, sigmoid, tanh and softplus for float and double,
+// inlined in the layer loops, which the compiler then vectorizes: no libm
+// call, only multiply-adds and integer ops on the bits. Loops in double
+// need 64-bit integer vectors (AVX2, -march=x86-64-v3) to vectorize.
+// Activations pick them with their math_mode:
+//
+//   EXACT  libm
+//   FAST   the polynomials below
+//   TABLE  linear interpolation in tables of 2^7 points per unit
+//
+// Maximum errors against libm, checked over the whole range by
+// tests/test_fast_math.cc (relative unless noted):
+//
+//                 float                       double
+//   fast_exp      1.5e-7 on [-86.9, 88.3]     3e-16 on [-708, 709.4]
+//   fast_log      2.5e-7, x normal            5e-16, x normal
+//   fast_sigmoid  2e-7 for z > -88.3          5e-16 for z > -709.4
+//   fast_tanh     6e-7                        6e-15
+//   fast_softplus 4e-7 for z > -86.9          1e-15 for z > -708
+//   TABLE         sigmoid 1e-6, tanh 2.5e-6, softplus 2.5e-6, all absolute
+//
+// Out of its range, exp is 0 below and infinity above. Sigmoid and
+// softplus are then 0 for very negative z, within 2e-38 (4e-308) of
+// their value. NaN gives an unspecified value.
+enum class math_mode : uint32_t
+{
+    EXACT,
+    FAST,
+    TABLE
+};
+
+inline const char* math_mode_name(math_mode mode)
+{
+    switch (mode)
+    {
+        case math_mode::FAST: return "fast";
+        case math_mode::TABLE: return "table";
+        default: return "exact";
+    }
+}
+
+// Bit layout and polynomial degrees of each type
+template <typename T>
+struct fast_math_traits;
+
+template <>
+struct fast_math_traits<float>
+{
+    using bits_type = uint32_t;
+    static constexpr int mantissa_bits = 23;
+    static constexpr int exponent_bias = 127;
+    // 1.5 * 2^23: adding it rounds to an integer in the low mantissa bits
+    static constexpr float shifter = 12582912.0f;
+    // Keep e^r * 2^n normal for r in [-ln2/2, ln2/2]
+    static constexpr float exp_min = -86.9f;
+    static constexpr float exp_max = 88.3f;
+    // ln2 split so that n * ln2_hi is exact
+    static constexpr float ln2_hi = 0.693359375f;
+    static constexpr float ln2_lo = -2.12194440e-4f;
+    static constexpr int exp_degree = 7;
+    static constexpr int log_terms = 6;
+    // Below, tanh takes its Taylor series
+    static constexpr float tanh_series = 0.25f;
+};
+
+template <>
+struct fast_math_traits<double>
+{
+    using bits_type = uint64_t;
+    static constexpr int mantissa_bits = 52;
+    static constexpr int exponent_bias = 1023;
+    static constexpr double shifter = 6755399441055744.0;
+    static constexpr double exp_min = -708.0;
+    static constexpr double exp_max = 709.4;
+    static constexpr double ln2_hi = 6.93147180369123816490e-01;
+    static constexpr double ln2_lo = 1.90821492927058770002e-10;
+    static constexpr int exp_degree = 13;
+    static constexpr int log_terms = 12;
+    static constexpr double tanh_series = 0.04;
+};
+
+// Polynomial coefficients, folded at compile time: 1/k! for exp, 1/(2k+1)
+// for log
+constexpr double inverse_factorial(int k)
+{
+    double f = 1;
+    for (int i = 2; i <= k; ++i)
+        f *= i;
+    return 1 / f;
+}
+
+template <int K>
+constexpr double inverse_factorial_v = inverse_factorial(K);
+
+template <int K>
+constexpr double inverse_odd_v = 1.0 / (2 * K + 1);
+
+// Horner's scheme from the coefficient of degree D, for K = 0..D-1
+template <typename T, int... K>
+inline T exp_polynomial(T r, std::integer_sequence<int, K...>)
+{
+    constexpr int d = sizeof...(K);
+    T p = static_cast<T>(inverse_factorial_v<d>);
+    ((p = p * r + static_cast<T>(inverse_factorial_v<d - 1 - K>)), ...);
+    return p;
+}
+
+template <typename T, int... K>
+inline T log_polynomial(T z, std::integer_sequence<int, K...>)
+{
+    constexpr int d = sizeof...(K);
+    T p = static_cast<T>(inverse_odd_v<d>);
+    ((p = p * z + static_cast<T>(inverse_odd_v<d - 1 - K>)), ...);
+    return p;
+}
+
+template <typename T>
+inline typename fast_math_traits<T>::bits_type fast_math_bits(T x)
+{
+    typename fast_math_traits<T>::bits_type bits;
+    std::memcpy(&bits, &x, sizeof(x));
+    return bits;
+}
+
+template <typename T>
+inline T fast_math_value(typename fast_math_traits<T>::bits_type bits)
+{
+    T x;
+    std::memcpy(&x, &bits, sizeof(x));
+    return x;
+}
+
+// c ? a : b on the bits. A select of floats that the compiler can sink
+// into branches would leave control flow in the loop, which then does not
+// vectorize: floating point operations are not moved out of branches.
+template <typename T>
+inline T fast_math_select(bool c, T a, T b)
+{
+    using bits_type = typename fast_math_traits<T>::bits_type;
+    const bits_type mask = bits_type(0) - static_cast<bits_type>(c);
+    return fast_math_value<T>((fast_math_bits(a) & mask) | (fast_math_bits(b) & ~mask));
+}
+
+// e^x = 2^n * e^r with n = round(x / ln2): Taylor polynomial of e^r on
+// |r| <= ln2 / 2, and n added to the exponent bits. Out of range values
+// are computed too, then replaced: clamping x first would have the
+// compiler specialize the loop for the bounds.
+template <typename T>
+inline T fast_exp(T x)
+{
+    using traits = fast_math_traits<T>;
+    using bits_type = typename traits::bits_type;
+
+    const T t = x * static_cast<T>(1.4426950408889634) + traits::shifter;
+    const T n = t - traits::shifter;
+    const T r = (x - n * traits::ln2_hi) - n * traits::ln2_lo;
+
+    // 1 + r + r^2/2! + ... + r^d/d!
+    const T p = exp_polynomial(r, std::make_integer_sequence<int, traits::exp_degree>());
+
+    const bits_type scale = (fast_math_bits(t) - fast_math_bits(traits::shifter))
+                            << traits::mantissa_bits;
+    const T y = fast_math_value<T>(fast_math_bits(p) + scale);
+    const T underflow = fast_math_select<T>(x < traits::exp_min, 0, y);
+    return fast_math_select(x > traits::exp_max, std::numeric_limits<T>::infinity(), underflow);
+}
+
+// x = m * 2^e with m in [sqrt(1/2), sqrt(2)), then log(m) = 2 atanh(s)
+// with s = (m - 1) / (m + 1), |s| <= 0.172, as an odd series. x must be
+// positive and normal.
+template <typename T>
+inline T fast_log(T x)
+{
+    using traits = fast_math_traits<T>;
+    using bits_type = typename traits::bits_type;
+    constexpr bits_type mantissa_mask = (bits_type(1) << traits::mantissa_bits) - 1;
+
+    const bits_type bits = fast_math_bits(x);
+    T m = fast_math_value<T>((bits & mantissa_mask) | fast_math_bits(static_cast<T>(1)));
+    T e = static_cast<T>(static_cast<int>(bits >> traits::mantissa_bits)
+                         - traits::exponent_bias);
+    const bool high = m > static_cast<T>(1.4142135623730951);
+    m = fast_math_select(high, m * static_cast<T>(0.5), m);
+    e = fast_math_select(high, e + 1, e);
+
+    const T s = (m - 1) / (m + 1);
+    const T z = s * s;
+    const T p = log_polynomial(z, std::make_integer_sequence<int, traits::log_terms - 1>());
+    return e * traits::ln2_hi + (2 * s * p + e * traits::ln2_lo);
+}
+
+template <typename T>
+inline T fast_sigmoid(T z)
+{
+    return 1 / (1 + fast_exp(-z));
+}
+
+// 1 - 2 / (e^2z + 1), which loses the relative precision near 0, where
+// the series takes over
+template <typename T>
+inline T fast_tanh(T z)
+{
+    const T z2 = z * z;
+    const T series = z * (1 + z2 * (static_cast<T>(-1.0 / 3) + z2 * (static_cast<T>(2.0 / 15)
+                     + z2 * (static_cast<T>(-17.0 / 315) + z2 * static_cast<T>(62.0 / 2835)))));
+    const T exponential = 1 - 2 / (fast_exp(2 * z) + 1);
+    return fast_math_select(std::abs(z) < fast_math_traits<T>::tanh_series, series, exponential);
+}
+
+// max(z, 0) + log1p(e^-|z|), with log1p(u) = log(w) * u / (w - 1) for
+// w = 1 + u, which cancels the rounding of w
+template <typename T>
+inline T fast_softplus(T z)
+{
+    const T u = fast_exp(-std::abs(z));
+    const T w = 1 + u;
+    const T log1p = fast_math_select(w == 1, u, fast_log(w) * (u / (w - 1)));
+    return std::max(z, static_cast<T>(0)) + log1p;
+}
+
+// Tables of the TABLE mode: sigmoid on [-16, 16], and log1p(e^-u) on
+// [0, 16] for softplus, 2^7 points per unit. Beyond them, both are within
+// 1.2e-7 of their limits. Built once, see activation_tables.
+template <typename T>
+class ActivationTables
+{
+public:
+    static constexpr int points_per_unit = 128;
+    static constexpr T range = 16;
+
+    ActivationTables()
+    {
+        const int n = static_cast<int>(range) * points_per_unit;
+        sigmoid_.resize(2 * n + 1);
+        softplus_.resize(n + 1);
+        for (int i = 0; i <= 2 * n; ++i)
+            sigmoid_[i] = 1 / (1 + std::exp(-(static_cast<double>(i) / points_per_unit - range)));
+        for (int i = 0; i <= n; ++i)
+            softplus_[i] = std::log1p(std::exp(-static_cast<double>(i) / points_per_unit));
+    }
+
+    T sigmoid(T z) const { return interpolate(sigmoid_, z + range); }
+
+    T tanh(T z) const { return 2 * sigmoid(2 * z) - 1; }
+
+    T softplus(T z) const
+    {
+        return std::max(z, static_cast<T>(0)) + interpolate(softplus_, std::abs(z));
+    }
+
+private:
+    // Value at x units from the start of a table, clamped to its ends. NaN
+    // goes through both clamps, so it is returned before indexing.
+    static T interpolate(const std::vector<T>& table, T x)
+    {
+        if (x != x)
+            return x;
+        const T position = std::min(std::max(x * points_per_unit, static_cast<T>(0)),
+                                    static_cast<T>(table.size() - 1));
+        const int i = std::min(static_cast<int>(position), static_cast<int>(table.size()) - 2);
+        const T fraction = position - i;
+        return table[i] + fraction * (table[i + 1] - table[i]);
+    }
+
+    std::vector<T> sigmoid_;
+    std::vector<T> softplus_;
+};
+
+// Built before main, so that lookups need no guard
+template <typename T>
+inline const ActivationTables<T> activation_tables;
@@ -0,0 +1,201 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../matrix/matrix.hh"
+
+// Binary dataset format. All fields are in the byte order of the host that
+// wrote the file:
+//
+//   DatasetFileHeader, padded to dataset_file_data_offset
+//   one record per sample: x_size inputs then y_size targets
+//
+// Records are contiguous, so a sample is read from one place of the file
+// whatever the order in which samples are visited.
+
+struct DatasetFileHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t value_size; // sizeof(T)
+    uint32_t reserved;
+    uint64_t nb_samples;
+    uint64_t x_size;
+    uint64_t y_size;
+};
+
+constexpr char dataset_file_magic[8] = { 'P', 'R', 'O', 'P', 'H', 'S', 'E', 'T' };
+constexpr uint32_t dataset_file_version = 1;
+constexpr uint32_t dataset_file_byte_order = 0x01020304;
+constexpr uint64_t dataset_file_data_offset = 64;
+
+// Read-only dataset over a mapped file. Samples are paged in when used, so
+// datasets may be larger than memory.
+template <typename T>
+class Dataset
+{
+public:
+    explicit Dataset(const std::string& path)
+    {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            throw std::runtime_error("Cannot open " + path);
+
+        struct stat st;
+        if (fstat(fd, &st) != 0 || static_cast<uint64_t>(st.st_size) < dataset_file_data_offset)
+        {
+            close(fd);
+            throw std::runtime_error("Bad dataset file: " + path);
+        }
+
+        const uint64_t size = st.st_size;
+        void* address = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (address == MAP_FAILED)
+            throw std::runtime_error("Cannot map " + path);
+        mapping_ = std::shared_ptr<const char>(static_cast<const char*>(address),
+            [size](const char* p) { munmap(const_cast<char*>(p), size); });
+
+        DatasetFileHeader header;
+        std::memcpy(&header, address, sizeof(header));
+        if (std::memcmp(header.magic, dataset_file_magic, sizeof(header.magic)) != 0
+            || header.version != dataset_file_version
+            || header.byte_order != dataset_file_byte_order
+            || header.value_size != sizeof(T))
+            throw std::runtime_error("Bad dataset file: " + path);
+        // Sizes are kept as int, and a record as their sum
+        const uint64_t max_size = std::numeric_limits<int>::max();
+        if (header.x_size > max_size || header.y_size > max_size
+            || header.x_size + header.y_size > max_size)
+            throw std::runtime_error("Bad dataset file: " + path);
+        if (header.x_size == 0 || header.y_size == 0
+            || (size - dataset_file_data_offset) / sizeof(T) / (header.x_size + header.y_size)
+               < header.nb_samples)
+            throw std::runtime_error("Truncated dataset file: " + path);
+
+        records_ = reinterpret_cast<const T*>(mapping_.get() + dataset_file_data_offset);
+        nb_samples_ = header.nb_samples;
+        x_size_ = header.x_size;
+        y_size_ = header.y_size;
+    }
+
+    size_t size(void) const { return nb_samples_; }
+    int get_x_size(void) const { return x_size_; }
+    int get_y_size(void) const { return y_size_; }
+
+    const T* x(size_t sample) const { return records_ + sample * (x_size_ + y_size_); }
+    const T* y(size_t sample) const { return x(sample) + x_size_; }
+
+    // Stacks the samples indices[0, count) as the columns of x (x_size x
+    // count) and y (y_size x count)
+    void gather(const size_t* indices, int count, Matrix<T>& x_batch, Matrix<T>& y_batch) const
+    {
+        if (x_batch.get_rows() != x_size_ || y_batch.get_rows() != y_size_
+            || x_batch.get_cols() != count || y_batch.get_cols() != count)
+            throw std::invalid_argument("Bad batch shape");
+
+        T* xs = x_batch.get_data();
+        T* ys = y_batch.get_data();
+        for (int j = 0; j < count; ++j)
+        {
+            const T* sample = x(indices[j]);
+            for (int i = 0; i < x_size_; ++i)
+                xs[i * count + j] = sample[i];
+            for (int i = 0; i < y_size_; ++i)
+                ys[i * count + j] = sample[x_size_ + i];
+        }
+    }
+
+private:
+    std::shared_ptr<const char> mapping_;
+    const T* records_ = nullptr;
+    size_t nb_samples_ = 0;
+    int x_size_ = 0;
+    int y_size_ = 0;
+};
+
+// Streams samples into a dataset file. The file is written next to path
+// and renamed over it by close(), so readers never see a partial dataset.
+template <typename T>
+class DatasetWriter
+{
+public:
+    DatasetWriter(const std::string& path, int x_size, int y_size)
+        : path_(path), tmp_path_(path + ".tmp"), x_size_(x_size), y_size_(y_size)
+    {
+        if (x_size <= 0 || y_size <= 0)
+            throw std::invalid_argument("Bad sample size");
+        out_.open(tmp_path_, std::ios::binary | std::ios::trunc);
+        if (!out_)
+            throw std::runtime_error("Cannot open " + tmp_path_);
+
+        // Header is written by close(), once the number of samples is known
+        const char padding[dataset_file_data_offset] = {};
+        out_.write(padding, sizeof(padding));
+    }
+
+    DatasetWriter(const DatasetWriter&) = delete;
+    DatasetWriter& operator=(const DatasetWriter&) = delete;
+
+    ~DatasetWriter()
+    {
+        if (out_.is_open())
+        {
+            out_.close();
+            std::remove(tmp_path_.c_str());
+        }
+    }
+
+    // x holds x_size values, y holds y_size values
+    void append(const T* x, const T* y)
+    {
+        out_.write(reinterpret_cast<const char*>(x), sizeof(T) * x_size_);
+        out_.write(reinterpret_cast<const char*>(y), sizeof(T) * y_size_);
+        nb_samples_++;
+    }
+
+    size_t size(void) const { return nb_samples_; }
+
+    void close(void)
+    {
+        DatasetFileHeader header;
+        std::memset(&header, 0, sizeof(header));
+        std::memcpy(header.magic, dataset_file_magic, sizeof(header.magic));
+        header.version = dataset_file_version;
+        header.byte_order = dataset_file_byte_order;
+        header.value_size = sizeof(T);
+        header.nb_samples = nb_samples_;
+        header.x_size = x_size_;
+        header.y_size = y_size_;
+
+        out_.seekp(0);
+        out_.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        out_.close();
+        if (!out_ || std::rename(tmp_path_.c_str(), path_.c_str()) != 0)
+        {
+            std::remove(tmp_path_.c_str());
+            throw std::runtime_error("Cannot write " + path_);
+        }
+    }
+
+private:
+    std::string path_;
+    std::string tmp_path_;
+    std::ofstream out_;
+    int x_size_;
+    int y_size_;
+    size_t nb_samples_ = 0;
+};
@@ -0,0 +1,155 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "dataset.hh"
+
+// Converters from common formats to dataset files. They stream their input,
+// so they work on files larger than memory.
+
+// Reads the big-endian header of an IDX file of unsigned bytes and returns
+// its dimensions
+inline std::vector<uint32_t> read_idx_header(std::ifstream& in, const std::string& path)
+{
+    unsigned char magic[4];
+    if (!in.read(reinterpret_cast<char*>(magic), 4) || magic[0] != 0 || magic[1] != 0)
+        throw std::runtime_error("Bad IDX file: " + path);
+    if (magic[2] != 0x08)
+        throw std::runtime_error("Only IDX files of unsigned bytes are supported: " + path);
+
+    std::vector<uint32_t> dims(magic[3]);
+    for (auto& dim : dims)
+    {
+        unsigned char b[4];
+        if (!in.read(reinterpret_cast<char*>(b), 4))
+            throw std::runtime_error("Bad IDX file: " + path);
+        dim = (uint32_t(b[0]) << 24) | (uint32_t(b[1]) << 16) | (uint32_t(b[2]) << 8) | b[3];
+    }
+    return dims;
+}
+
+// MNIST-style IDX pair: images (n x ... bytes) become inputs scaled to
+// [0, 1], labels (n bytes) become one-hot targets of nb_classes values.
+// Returns the number of samples.
+template <typename T>
+size_t import_idx(const std::string& images_path,
+                  const std::string& labels_path,
+                  const std::string& out_path,
+                  int nb_classes = 10)
+{
+    std::ifstream images(images_path, std::ios::binary);
+    std::ifstream labels(labels_path, std::ios::binary);
+    if (!images)
+        throw std::runtime_error("Cannot open " + images_path);
+    if (!labels)
+        throw std::runtime_error("Cannot open " + labels_path);
+
+    std::vector<uint32_t> image_dims = read_idx_header(images, images_path);
+    std::vector<uint32_t> label_dims = read_idx_header(labels, labels_path);
+    if (image_dims.empty() || label_dims.size() != 1 || label_dims[0] != image_dims[0])
+        throw std::runtime_error("IDX images and labels do not match");
+
+    int x_size = 1;
+    for (size_t d = 1; d < image_dims.size(); ++d)
+        x_size *= image_dims[d];
+
+    DatasetWriter<T> writer(out_path, x_size, nb_classes);
+    std::vector<unsigned char> pixels(x_size);
+    std::vector<T> x(x_size);
+    std::vector<T> y(nb_classes);
+    for (uint32_t s = 0; s < image_dims[0]; ++s)
+    {
+        char label;
+        if (!images.read(reinterpret_cast<char*>(pixels.data()), x_size) || !labels.get(label))
+            throw std::runtime_error("Truncated IDX file");
+        const int cls = static_cast<unsigned char>(label);
+        if (cls >= nb_classes)
+            throw std::runtime_error("IDX label out of range");
+
+        for (int i = 0; i < x_size; ++i)
+            x[i] = static_cast<T>(pixels[i]) / 255;
+        std::fill(y.begin(), y.end(), static_cast<T>(0));
+        y[cls] = 1;
+        writer.append(x.data(), y.data());
+    }
+
+    writer.close();
+    return writer.size();
+}
+
+// Comma-separated numbers, one sample per line: the last nb_outputs columns
+// are the targets, the others the inputs. Returns the number of samples.
+template <typename T>
+size_t import_csv(const std::string& csv_path,
+                  const std::string& out_path,
+                  int nb_outputs,
+                  bool skip_header = false)
+{
+    std::ifstream in(csv_path);
+    if (!in)
+        throw std::runtime_error("Cannot open " + csv_path);
+
+    std::unique_ptr<DatasetWriter<T>> writer;
+    int nb_columns = 0;
+    std::vector<T> values;
+    std::string line;
+    size_t line_number = 0;
+    if (skip_header)
+    {
+        std::getline(in, line);
+        line_number++;
+    }
+
+    while (std::getline(in, line))
+    {
+        line_number++;
+        if (line.find_first_not_of(" \t\r") == std::string::npos)
+            continue;
+
+        values.clear();
+        const char* p = line.c_str();
+        while (true)
+        {
+            char* end;
+            const double v = std::strtod(p, &end);
+            if (end == p)
+                throw std::runtime_error("Bad number in " + csv_path + " line "
+                                         + std::to_string(line_number));
+            values.push_back(static_cast<T>(v));
+            while (*end == ' ' || *end == '\t' || *end == '\r')
+                end++;
+            if (*end == '\0')
+                break;
+            if (*end != ',')
+                throw std::runtime_error("Bad separator in " + csv_path + " line "
+                                         + std::to_string(line_number));
+            p = end + 1;
+        }
+
+        // The first sample fixes the number of columns
+        if (writer == nullptr)
+        {
+            nb_columns = values.size();
+            if (nb_outputs <= 0 || nb_columns <= nb_outputs)
+                throw std::invalid_argument("Bad number of outputs for " + csv_path);
+            writer.reset(new DatasetWriter<T>(out_path, nb_columns - nb_outputs, nb_outputs));
+        }
+        else if (static_cast<int>(values.size()) != nb_columns)
+            throw std::runtime_error("Bad number of columns in " + csv_path + " line "
+                                     + std::to_string(line_number));
+
+        writer->append(values.data(), values.data() + nb_columns - nb_outputs);
+    }
+
+    if (writer == nullptr)
+        throw std::runtime_error("No sample in " + csv_path);
+    writer->close();
+    return writer->size();
+}
@@ -0,0 +1,156 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <numeric>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "dataset.hh"
+
+// Input pipeline over a Dataset: a background thread shuffles the samples
+// at every epoch and stacks the next batches while the current one trains.
+//
+//   BatchPipeline<T> pipeline(data, 64, epochs, seed);
+//   while (pipeline.next(x, y))
+//       ...; // x and y stay valid until the next call
+//
+// Batches are assembled in depth preallocated slots, so the pipeline does
+// not allocate once started. The order of the samples only depends on seed:
+// a pipeline started at first_batch yields the same batches as one started
+// at 0, once the ones before it are skipped.
+template <typename T>
+class BatchPipeline
+{
+public:
+    BatchPipeline(const Dataset<T>& data, int batch_size, int epochs,
+                  uint64_t seed = 0, int depth = 2, size_t first_batch = 0)
+        : data_(data), batch_size_(batch_size), epochs_(epochs), seed_(seed),
+          first_batch_(first_batch)
+    {
+        if (batch_size <= 0 || depth < 2)
+            throw std::invalid_argument("Bad batch size or pipeline depth");
+
+        const size_t n = data.size();
+        batches_per_epoch_ = (n + batch_size - 1) / batch_size;
+        slots_.resize(depth);
+        for (auto& slot : slots_)
+        {
+            slot.x = Matrix<T>(data.get_x_size(), batch_size);
+            slot.y = Matrix<T>(data.get_y_size(), batch_size);
+        }
+        indices_.resize(n);
+
+        producer_ = std::thread([this]() { produce(); });
+    }
+
+    BatchPipeline(const BatchPipeline&) = delete;
+    BatchPipeline& operator=(const BatchPipeline&) = delete;
+
+    ~BatchPipeline()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        cv_.notify_all();
+        producer_.join();
+    }
+
+    // Points x and y at the next batch (features x samples), and hands the
+    // previous one back to the producer. Returns false after the last one.
+    bool next(Matrix<T>& x, Matrix<T>& y)
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (consumed_ > released_)
+        {
+            released_++;
+            cv_.notify_all();
+        }
+        if (consumed_ == total())
+            return false;
+
+        cv_.wait(lock, [this]() { return produced_ > consumed_; });
+        const Slot& slot = slots_[consumed_ % slots_.size()];
+        x = slot.x.prefix(slot.x.get_rows(), slot.count);
+        y = slot.y.prefix(slot.y.get_rows(), slot.count);
+        consumed_++;
+        return true;
+    }
+
+private:
+    struct Slot
+    {
+        Matrix<T> x;
+        Matrix<T> y;
+        int count = 0;
+    };
+
+    size_t total(void) const
+    {
+        return batches_per_epoch_ * epochs_ - std::min(first_batch_, batches_per_epoch_ * epochs_);
+    }
+
+    void produce(void)
+    {
+        std::mt19937_64 rng(seed_);
+        for (int epoch = 0; epoch < epochs_; ++epoch)
+        {
+            std::iota(indices_.begin(), indices_.end(), 0);
+            std::shuffle(indices_.begin(), indices_.end(), rng);
+
+            // Batches before first_batch are only shuffled
+            const size_t first = epoch * batches_per_epoch_;
+            for (size_t batch = first_batch_ > first ? first_batch_ - first : 0;
+                 batch < batches_per_epoch_; ++batch)
+            {
+                size_t id;
+                {
+                    // Wait for a slot the consumer is done with
+                    std::unique_lock<std::mutex> lock(mutex_);
+                    cv_.wait(lock, [this]() {
+                        return stop_ || produced_ - released_ < slots_.size();
+                    });
+                    if (stop_)
+                        return;
+                    id = produced_;
+                }
+
+                Slot& slot = slots_[id % slots_.size()];
+                const size_t begin = batch * batch_size_;
+                slot.count = std::min(indices_.size() - begin, static_cast<size_t>(batch_size_));
+                Matrix<T> x = slot.x.prefix(slot.x.get_rows(), slot.count);
+                Matrix<T> y = slot.y.prefix(slot.y.get_rows(), slot.count);
+                data_.gather(indices_.data() + begin, slot.count, x, y);
+
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    produced_++;
+                }
+                cv_.notify_all();
+            }
+        }
+    }
+
+    const Dataset<T>& data_;
+    int batch_size_;
+    int epochs_;
+    uint64_t seed_;
+    size_t first_batch_;
+    size_t batches_per_epoch_;
+
+    std::vector<Slot> slots_;
+    std::vector<size_t> indices_;
+
+    // Batches stacked, handed to the consumer, and given back by it
+    size_t produced_ = 0;
+    size_t consumed_ = 0;
+    size_t released_ = 0;
+    bool stop_ = false;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::thread producer_;
+};
@@ -1,32 +1,141 @@
 #pragma once
 
 #include <memory>
-#include <functional>
 
 #include "layer.hh"
 #include "../matrix/matrix.hh"
+#include "../matrix/sparse.hh"
 #include "../activation_function/activation_function.hh"
+#include "../optimizer/optimizer.hh"
 
 template <typename T>
 class HiddenLayer : public Layer<T>
 {
 public:
-    HiddenLayer(int nb_neurons, const ActivationFunction<T>& activation) : Layer<T>(nb_neurons)
-    , activation_(activation)
+    HiddenLayer(int nb_neurons) : Layer<T>(nb_neurons)
     {}
 
     virtual ~HiddenLayer() = default;
 
-    virtual void update(T learning_rate) = 0;
+    // Applies and resets the gradients accumulated in ctx. The layer keeps
+    // the optimizer's moments from one call to the next.
+    virtual void update(const Optimizer<T>& optimizer, LayerContext<T>& ctx) = 0;
 
+    void update(T learning_rate) { update(Optimizer<T>::sgd(learning_rate), this->ctx_); }
+
+    // Error with respect to the input of the layer, from ctx.delta of its
+    // last backward pass: the previous layer multiplies it by the derivative
+    // of its activation. out is reallocated only if its shape does not match.
+    virtual void input_error(Matrix<T>& out, const LayerContext<T>& ctx) const = 0;
+
+    // Post-training int8 quantization for forward_int8, given the scale of
+    // the layer's inputs (max |input| / 127 over calibration data). Layers
+    // without an int8 path ignore it.
+    virtual void quantize(T) {}
+
+    // Magnitude pruning: zeroes the fraction sparsity of the weights with
+    // the smallest magnitudes, and keeps the others in sparse storage, see
+    // get_sparse_weights(). Layers without sparse storage ignore it.
+    virtual void prune(double) {}
+
+    // Weights in CSR form once pruned, nullptr while dense
+    virtual const CsrMatrix<T>* get_sparse_weights(void) const { return nullptr; }
+
+    // Weights as a dense matrix, expanded from the sparse form if needed
+    virtual Matrix<T> get_dense_weights(void) const { return weights_; }
+
+    // Gradient accumulators live in the contexts, in the workspace
+    void reserve(Workspace<T>& workspace, LayerContext<T>& ctx, int)
+    {
+        ctx.slots.push_back(workspace.reserve(weights_.get_rows(), weights_.get_cols()));
+        ctx.slots.push_back(workspace.reserve(biases_.get_rows(), biases_.get_cols()));
+    }
+
+    void bind(const Workspace<T>& workspace, LayerContext<T>& ctx)
+    {
+        ctx.delta_weights = workspace.slot(ctx.slots[0]);
+        ctx.delta_biases = workspace.slot(ctx.slots[1]);
+        ctx.delta_weights.fill(fill_type::ZERO);
+        ctx.delta_biases.fill(fill_type::ZERO);
+    }
+
+    virtual size_t get_nb_parameters(void) const
+    {
+        return static_cast<size_t>(weights_.get_rows()) * weights_.get_cols()
+               + biases_.get_rows();
+    }
+
+    // Activation of the layer, as saved in model files
+    virtual activation_id get_activation(void) const = 0;
+    virtual double get_activation_parameter(void) const = 0;
+    virtual math_mode get_math_mode(void) const = 0;
+
+    // Uses weights and biases as they are, without copying them (e.g. views
+    // over a loaded model file). compile() keeps parameters of the right
+    // shape.
+    virtual void set_parameters(const Matrix<T>& weights, const Matrix<T>& biases)
+    {
+        if (weights.get_rows() != this->nb_neurons_ || biases.get_rows() != this->nb_neurons_
+            || biases.get_cols() != 1)
+            throw std::invalid_argument("Parameters do not match the layer");
+        weights_ = weights;
+        biases_ = biases;
+    }
+
+    // Parameters and optimizer moments, for checkpoints. restore_state()
+    // reads them back, in the order save_state() put them, into a compiled
+    // layer of the same shape.
+    virtual void save_state(TrainingState<T>& state) const
+    {
+        state.put_array(weights_.get_data(),
+                        static_cast<size_t>(weights_.get_rows()) * weights_.get_cols());
+        state.put_array(biases_.get_data(), biases_.get_rows());
+    }
+
+    virtual void restore_state(TrainingState<T>& state)
+    {
+        state.get_array(weights_.get_data(),
+                        static_cast<size_t>(weights_.get_rows()) * weights_.get_cols());
+        state.get_array(biases_.get_data(), biases_.get_rows());
+    }
+
+    // Distribution of the initial weights, see fill_type. Biases start
+    // uniform in [-1, 1] with RANDOM_FLOAT (the default), at 0 otherwise.
+    void set_initializer(fill_type initializer) { initializer_ = initializer; }
+    fill_type get_initializer(void) const { return initializer_; }
+
+    // Seed of the initial parameters, set by Model::compile from its own.
+    // Without one, they are drawn from random_engine().
+    void set_seed(uint64_t seed)
+    {
+        seed_ = seed;
+        has_seed_ = true;
+    }
+
+    // Dense weights; once pruned, they keep their shape but have no storage
     Matrix<T>& get_weights(void) { return weights_; };
+    const Matrix<T>& get_weights(void) const { return weights_; };
+    const Matrix<T>& get_biases(void) const { return biases_; };
 
 protected:
-    Matrix<T> weights_;
-    Matrix<T> biases_;
+    // Number of slots reserved by HiddenLayer::reserve, before the ones of
+    // derived layers
+    static constexpr int hidden_slots = 2;
 
-    Matrix<T> delta_weights_;
-    Matrix<T> delta_biases_;
+    // Fills weights_ and biases_, allocated with their shape, for compile()
+    void initialize_parameters(void)
+    {
+        const uint64_t seed = has_seed_ ? seed_ : random_engine()();
+        weights_.fill(initializer_, seed);
+        if (initializer_ == fill_type::RANDOM_FLOAT)
+            biases_.fill(fill_type::RANDOM_FLOAT, derive_seed(seed, 0));
+        else
+            biases_.fill(fill_type::ZERO);
+    }
 
-    ActivationFunction<T> activation_;
+    Matrix<T> weights_;
+    Matrix<T> biases_;
+    fill_type initializer_ = fill_type::RANDOM_FLOAT;
+    uint64_t seed_ = 0;
+    bool has_seed_ = false;
 };
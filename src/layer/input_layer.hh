@@ -13,13 +13,17 @@ public:
 
     virtual ~InputLayer() = default;
 
-    virtual Matrix<T> feedforward(const Matrix<T>& input, bool training)
+    layer_kind get_kind(void) const { return layer_kind::INPUT; }
+
+    Matrix<T> forward(const Matrix<T>& input, LayerContext<T>& ctx, bool) const
     {
-        this->last_a_ = input;
-        return this->next_->feedforward(input, training);
+        ctx.last_a = input;
+        return input;
     }
 
-    void backpropagation(const Matrix<T>* const)
+    void backward(LayerContext<T>&, const LayerContext<T>&,
+                  const HiddenLayer<T>*, const LayerContext<T>*,
+                  const Matrix<T>*, const Loss<T>&) const
     {
         return;
     }
@@ -1,8 +1,25 @@
 #pragma once
 
+#include <cstdint>
 #include <memory>
 
+#include "layer_context.hh"
+#include "../loss/loss.hh"
 #include "../matrix/matrix.hh"
+#include "../matrix/workspace.hh"
+
+template <typename T>
+class HiddenLayer;
+
+// Identifies a layer type in saved models. Values are part of the file
+// format, append only.
+enum class layer_kind : uint32_t
+{
+    INPUT,
+    DENSE,
+    CONV2D,
+    MAX_POOL2D
+};
 
 template <typename T>
 class Layer
@@ -14,9 +31,29 @@ public:
 
     virtual ~Layer() = default;
 
-    virtual Matrix<T> feedforward(const Matrix<T>& input, bool training) = 0;
+    // Runs input (prev_neurons x batch) through this layer only and returns
+    // its activation. All state goes to ctx, so several contexts can run
+    // at once over the same layer.
+    virtual Matrix<T> forward(const Matrix<T>& input,
+                              LayerContext<T>& ctx,
+                              bool training) const = 0;
+
+    // Inference through the int8 path of quantized layers; others run
+    // forward() in float
+    virtual Matrix<T> forward_int8(const Matrix<T>& input, LayerContext<T>& ctx) const
+    {
+        return forward(input, ctx, false);
+    }
 
-    virtual void backpropagation(const Matrix<T>* const y) = 0;
+    // Computes ctx.delta and accumulates the gradients of this layer in ctx,
+    // from the targets y under loss (last layer, which also sets ctx.loss)
+    // or from the next layer and its context (hidden layers).
+    virtual void backward(LayerContext<T>& ctx,
+                          const LayerContext<T>& prev_ctx,
+                          const HiddenLayer<T>* next,
+                          const LayerContext<T>* next_ctx,
+                          const Matrix<T>* y,
+                          const Loss<T>& loss) const = 0;
 
     virtual void compile(std::weak_ptr<Layer<T>> prev,
                             std::shared_ptr<Layer<T>> next)
@@ -26,17 +63,42 @@ public:
         next_ = next;
     }
 
+    // Workspace planning: reserve() the buffers a context needs for batches
+    // of up to batch_size samples, then bind() them once the workspace is
+    // allocated
+    virtual void reserve(Workspace<T>&, LayerContext<T>&, int) {}
+    virtual void bind(const Workspace<T>&, LayerContext<T>&) {}
+
+    virtual layer_kind get_kind(void) const = 0;
+
+    // Size and cost of the layer, for Model::summary and the profiler
+    virtual size_t get_nb_parameters(void) const { return 0; }
+    virtual size_t get_parameters_bytes(void) const { return get_nb_parameters() * sizeof(T); }
+    virtual double forward_flops(int) const { return 0; }
+    virtual double backward_flops(int) const { return 0; }
+
     int get_nb_neurons(void) const { return nb_neurons_; }
-    Matrix<T>& get_delta(void) { return delta_; }
-    Matrix<T>& get_last_a(void) { return last_a_; }
+    LayerContext<T>& get_context(void) { return ctx_; }
+    const LayerContext<T>& get_context(void) const { return ctx_; }
+    Matrix<T>& get_delta(void) { return ctx_.delta; }
+    Matrix<T>& get_last_a(void) { return ctx_.last_a; }
 
 protected:
+    // rows x cols view of a planned buffer, or a fresh matrix if the buffer
+    // is missing or too small
+    static Matrix<T> scratch(const Matrix<T>& buffer, int rows, int cols)
+    {
+        if (buffer.get_data() != nullptr
+            && buffer.get_rows() * buffer.get_cols() >= rows * cols)
+            return buffer.prefix(rows, cols);
+        return Matrix<T>(rows, cols);
+    }
+
     bool compiled_;
     int nb_neurons_;
 
-    Matrix<T> last_a_;
-    Matrix<T> last_z_;
-    Matrix<T> delta_;
+    // Context of the first training replica, see Model
+    LayerContext<T> ctx_;
 
     std::weak_ptr<Layer<T>> prev_;
     std::shared_ptr<Layer<T>> next_;
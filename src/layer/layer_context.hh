@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "../matrix/matrix.hh"
+
+// Mutable state of one layer for one stream of batches. Layers themselves
+// only hold parameters; every training replica (thread) owns one context per
+// layer, so replicas can run forward and backward at the same time.
+template <typename T>
+struct LayerContext
+{
+    // Outputs of the last forward pass, error of the last backward pass
+    Matrix<T> last_a;
+    Matrix<T> last_z;
+    Matrix<T> delta;
+    // Loss of the last backward pass of the output layer, summed over its
+    // batch
+    double loss = 0;
+
+    // Output of inference passes, reused from one batch to the next
+    Matrix<T> output;
+    // Input of int8 inference passes, quantized and sample-major
+    std::vector<int8_t> quantized_input;
+    // Input of the last pass of a convolution, lowered by im2col
+    Matrix<T> lowered_input;
+
+    // Gradients accumulated since the last update
+    Matrix<T> delta_weights;
+    Matrix<T> delta_biases;
+
+    // Workspace slots reserved by the layer, and the buffers bound to them,
+    // in an order of the layer's choosing
+    std::vector<int> slots;
+    std::vector<Matrix<T>> buffers;
+};
@@ -0,0 +1,255 @@
+#pragma once
+
+#include <stdexcept>
+
+#include "../layer/hidden_layer.hh"
+#include "../matrix/matrix.hh"
+#include "../matrix/im2col.hh"
+#include "../activation_function/activation_function.hh"
+#include "../optimizer/optimizer.hh"
+
+// 2D convolution over image batches (see im2col.hh for their layout):
+// filters kernels of channels x kernel_size x kernel_size, one bias each.
+// Both passes lower to the shared GEMM:
+//   forward:  z = W * im2col(x), bias and activation in the epilogue
+//   backward: dW += delta * im2col(x)^T, input error = col2im(W^T * delta)
+// The output is filters x out_height x out_width, see get_output_shape().
+template <typename T, typename Activation = ActivationFunction<T>>
+class Conv2DLayer : public HiddenLayer<T>
+{
+    static_assert(!is_per_sample<Activation>::value,
+                  "Softmax only applies to the output of dense layers");
+
+public:
+    Conv2DLayer(const ImageShape& input, int filters, int kernel_size, int stride = 1,
+                int padding = 0, const Activation& activation = Activation())
+    : HiddenLayer<T>(filters * ImageWindow(input, kernel_size, stride, padding).positions())
+    , window_(input, kernel_size, stride, padding)
+    , filters_(filters)
+    , activation_(activation)
+    {
+        if (filters <= 0)
+            throw std::invalid_argument("Bad number of filters");
+    }
+
+    virtual ~Conv2DLayer() = default;
+
+    using HiddenLayer<T>::update;
+
+    layer_kind get_kind(void) const { return layer_kind::CONV2D; }
+    activation_id get_activation(void) const { return activation_.id; }
+    double get_activation_parameter(void) const { return activation_parameter(activation_); }
+    math_mode get_math_mode(void) const { return activation_mode<Activation>::value; }
+
+    ImageShape get_output_shape(void) const { return window_.output(filters_); }
+    const ImageWindow& get_window(void) const { return window_; }
+
+    // Lowering, GEMM, bias and activation
+    double forward_flops(int batch) const
+    {
+        return (2.0 * lowered_rows() + 2) * this->nb_neurons_ * batch;
+    }
+
+    // Derivative, gradients of the biases and weights
+    double backward_flops(int batch) const
+    {
+        return (2.0 * lowered_rows() + 2) * this->nb_neurons_ * batch;
+    }
+
+    Matrix<T> forward(const Matrix<T>& input, LayerContext<T>& ctx, bool training) const
+    {
+        const int batch = input.get_cols();
+        const int columns = window_.positions() * batch;
+        Matrix<T> cols = this->scratch(training ? buffer(ctx, COLUMNS) : ctx.lowered_input,
+                                       lowered_rows(), columns);
+        im2col(input.get_data(), batch, window_, cols.get_data());
+        ctx.lowered_input = cols;
+
+        // The filters x (positions * batch) product is the output itself,
+        // (filters * positions) x batch
+        const T* biases = this->biases_.get_data();
+        Matrix<T> a;
+        if (training)
+        {
+            Matrix<T> z = this->scratch(buffer(ctx, Z), this->nb_neurons_, batch);
+            a = this->scratch(buffer(ctx, A), this->nb_neurons_, batch);
+            Matrix<T> z_filters = z.prefix(filters_, columns);
+            T* a_data = a.get_data();
+            Matrix<T>::dot_into(z_filters, this->weights_, cols, transpose::NO_IMPLICIT, false,
+                [this, biases, a_data, columns](int row, int col, T* z_row, int n) {
+                    const T bias = biases[row];
+                    T* a_row = a_data + static_cast<long>(row) * columns + col;
+                    for (int j = 0; j < n; ++j)
+                    {
+                        const T v = z_row[j] + bias;
+                        z_row[j] = v;
+                        a_row[j] = activation_.f(v);
+                    }
+                });
+            ctx.last_a = a;
+            ctx.last_z = z;
+        }
+        else
+        {
+            a = ctx.output;
+            if (a.get_data() == nullptr || a.get_rows() != this->nb_neurons_
+                || a.get_cols() != batch)
+                a = Matrix<T>(this->nb_neurons_, batch);
+            Matrix<T> a_filters = a.prefix(filters_, columns);
+            Matrix<T>::dot_into(a_filters, this->weights_, cols, transpose::NO_IMPLICIT, false,
+                [this, biases](int row, int, T* a_row, int n) {
+                    const T bias = biases[row];
+                    for (int j = 0; j < n; ++j)
+                        a_row[j] = activation_.f(a_row[j] + bias);
+                });
+            ctx.output = a;
+        }
+        return a;
+    }
+
+    void backward(LayerContext<T>& ctx,
+                  const LayerContext<T>&,
+                  const HiddenLayer<T>* next,
+                  const LayerContext<T>* next_ctx,
+                  const Matrix<T>* y,
+                  const Loss<T>& loss) const
+    {
+        const int batch = ctx.last_z.get_cols();
+        T* z = ctx.last_z.get_data();
+        const T* a = ctx.last_a.get_data();
+
+        if (y != nullptr)
+        {
+            // delta = dL/da * f'(z), in place of z
+            ctx.loss = loss.output_delta(activation_, z, a, y->get_data(),
+                                         this->nb_neurons_, batch);
+            ctx.delta = ctx.last_z;
+        }
+        else
+        {
+            ctx.delta = this->scratch(buffer(ctx, DELTA), this->nb_neurons_, batch);
+            next->input_error(ctx.delta, *next_ctx);
+            T* delta = ctx.delta.get_data();
+            for (int i = 0; i < this->nb_neurons_ * batch; ++i)
+                delta[i] *= activation_.fd(z[i], a[i]);
+        }
+
+        // Sums over the positions and the batch, both in the columns of the
+        // filters x (positions * batch) view
+        const Matrix<T> delta = ctx.delta.prefix(filters_, window_.positions() * batch);
+        ctx.delta_biases.add_column_sums(delta);
+        Matrix<T>::dot_into(ctx.delta_weights, delta, ctx.lowered_input,
+                            transpose::RIGHT, true);
+    }
+
+    void input_error(Matrix<T>& out, const LayerContext<T>& ctx) const
+    {
+        const int batch = ctx.delta.get_cols();
+        const Matrix<T> delta = ctx.delta.prefix(filters_, window_.positions() * batch);
+
+        // The lowered input is not needed anymore once backward() has
+        // accumulated the gradients: the lowered error takes its place
+        Matrix<T> cols = ctx.lowered_input;
+        Matrix<T>::dot_into(cols, this->weights_, delta, transpose::LEFT);
+
+        const int inputs = window_.input.size();
+        if (out.get_data() == nullptr || out.get_rows() != inputs || out.get_cols() != batch)
+            out = Matrix<T>(inputs, batch);
+        col2im(cols.get_data(), batch, window_, out.get_data());
+    }
+
+    void update(const Optimizer<T>& optimizer, LayerContext<T>& ctx)
+    {
+        weights_state_.step(optimizer, this->weights_.get_data(), ctx.delta_weights.get_data(),
+                            this->weights_.get_rows() * this->weights_.get_cols());
+        biases_state_.step(optimizer, this->biases_.get_data(), ctx.delta_biases.get_data(),
+                           this->biases_.get_rows());
+    }
+
+    void save_state(TrainingState<T>& state) const
+    {
+        HiddenLayer<T>::save_state(state);
+        weights_state_.save(state);
+        biases_state_.save(state);
+    }
+
+    void restore_state(TrainingState<T>& state)
+    {
+        HiddenLayer<T>::restore_state(state);
+        weights_state_.restore(state, this->weights_.get_rows() * this->weights_.get_cols());
+        biases_state_.restore(state, this->biases_.get_rows());
+    }
+
+    // filters x (channels * kernel_size^2) weights, one bias per filter
+    void set_parameters(const Matrix<T>& weights, const Matrix<T>& biases)
+    {
+        if (weights.get_rows() != filters_ || weights.get_cols() != lowered_rows()
+            || biases.get_rows() != filters_ || biases.get_cols() != 1)
+            throw std::invalid_argument("Parameters do not match the layer");
+        this->weights_ = weights;
+        this->biases_ = biases;
+        weights_state_.reset();
+        biases_state_.reset();
+    }
+
+    void compile(std::weak_ptr<Layer<T>> prev,
+                 std::shared_ptr<Layer<T>> next)
+    {
+        if (prev.lock()->get_nb_neurons() != window_.input.size())
+            throw std::invalid_argument("Input does not match the convolution");
+        if (this->weights_.get_data() == nullptr || this->biases_.get_data() == nullptr)
+        {
+            weights_state_.reset();
+            biases_state_.reset();
+            this->weights_ = Matrix<T>(filters_, lowered_rows());
+            this->biases_ = Matrix<T>(filters_, 1);
+            this->initialize_parameters();
+        }
+
+        this->compiled_ = true;
+        this->prev_ = prev;
+        this->next_ = next;
+    }
+
+    void reserve(Workspace<T>& workspace, LayerContext<T>& ctx, int batch_size)
+    {
+        HiddenLayer<T>::reserve(workspace, ctx, batch_size);
+        ctx.slots.push_back(workspace.reserve(this->nb_neurons_, batch_size));
+        ctx.slots.push_back(workspace.reserve(this->nb_neurons_, batch_size));
+        ctx.slots.push_back(workspace.reserve(this->nb_neurons_, batch_size));
+        ctx.slots.push_back(workspace.reserve(lowered_rows(),
+                                              window_.positions() * batch_size));
+    }
+
+    void bind(const Workspace<T>& workspace, LayerContext<T>& ctx)
+    {
+        HiddenLayer<T>::bind(workspace, ctx);
+        ctx.buffers.clear();
+        for (size_t i = this->hidden_slots; i < ctx.slots.size(); ++i)
+            ctx.buffers.push_back(workspace.slot(ctx.slots[i]));
+    }
+
+private:
+    // Rows of the lowered input, columns of the weights
+    int lowered_rows(void) const
+    {
+        return window_.input.channels * window_.size * window_.size;
+    }
+
+    // Planned buffers of a context
+    enum buffer_id { Z, A, DELTA, COLUMNS };
+
+    static const Matrix<T>& buffer(const LayerContext<T>& ctx, buffer_id id)
+    {
+        static const Matrix<T> none;
+        return static_cast<size_t>(id) < ctx.buffers.size() ? ctx.buffers[id] : none;
+    }
+
+    ImageWindow window_;
+    int filters_;
+    Activation activation_;
+
+    // Moments of the optimizer
+    OptimizerState<T> weights_state_;
+    OptimizerState<T> biases_state_;
+};
@@ -1,95 +1,475 @@
 #pragma once
 
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <numeric>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+
 #include "../layer/hidden_layer.hh"
 #include "../matrix/matrix.hh"
+#include "../matrix/gemm_int8.hh"
+#include "../matrix/sparse.hh"
 #include "../activation_function/activation_function.hh"
+#include "../optimizer/optimizer.hh"
 
-template <typename T>
+// Activation is any type with f(z) and fd(z, a), see activation_function.hh.
+// Use a functor such as Sigmoid<T> to have it inlined, or the default
+// type-erased ActivationFunction<T> for custom lambdas, which must then be
+// given. Softmax<T> is only supported on the output layer.
+template <typename T, typename Activation = ActivationFunction<T>>
 class DenseLayer : public HiddenLayer<T>
 {
 public:
     DenseLayer(int nb_neurons,
-               const ActivationFunction<T>& activation)
-    : HiddenLayer<T>(nb_neurons, activation)
-    {}
+               const Activation& activation = Activation())
+    : HiddenLayer<T>(nb_neurons)
+    , activation_(activation)
+    {
+        // A default-constructed one has nothing to call
+        if constexpr (std::is_base_of<ActivationFunction<T>, Activation>::value)
+            if (!activation_.f_ || (!activation_.fd_ && !activation_.fda_))
+                throw std::invalid_argument("Activation function is not set");
+    }
 
     virtual ~DenseLayer() = default;
 
-    Matrix<T> feedforward(const Matrix<T>& input, bool training)
+    using HiddenLayer<T>::update;
+
+    layer_kind get_kind(void) const { return layer_kind::DENSE; }
+    activation_id get_activation(void) const { return activation_.id; }
+    double get_activation_parameter(void) const { return activation_parameter(activation_); }
+    math_mode get_math_mode(void) const { return activation_mode<Activation>::value; }
+
+    // GEMM with bias and activation
+    double forward_flops(int batch) const
+    {
+        const double products = sparse_ ? 2.0 * sparse_weights_.nnz()
+                                        : 2.0 * this->weights_.get_cols() * this->nb_neurons_;
+        return (products + 2.0 * this->nb_neurons_) * batch;
+    }
+
+    // delta (from the next layer's weights below the output), then the
+    // gradients of the biases and weights
+    double backward_flops(int batch) const
+    {
+        const double delta = this->next_ == nullptr
+            ? 3.0 * this->nb_neurons_ * batch
+            : (2.0 * this->next_->get_nb_neurons() + 1) * this->nb_neurons_ * batch;
+        return delta + (2.0 * this->weights_.get_cols() + 1) * this->nb_neurons_ * batch;
+    }
+
+    Matrix<T> forward(const Matrix<T>& input, LayerContext<T>& ctx, bool training) const
     {
-        auto z = Matrix<T>::dot(this->weights_, input);
-        z += this->biases_;
-        auto a = z.map(this->activation_.f_);
+        // input is prev_neurons x batch, z and a are neurons x batch.
+        // Bias and activation are applied by the GEMM epilogue, on each
+        // output row segment while it is still in L1.
+        const T* biases = this->biases_.get_data();
+        const int batch = input.get_cols();
+        Matrix<T> a;
 
         if (training)
         {
-            this->last_a_ = a;
-            this->last_z_ = z;
+            // Keep both z and a for backpropagation, in planned buffers
+            Matrix<T> z = this->scratch(buffer(ctx, Z), this->nb_neurons_, batch);
+            a = this->scratch(buffer(ctx, A), this->nb_neurons_, batch);
+            T* a_data = a.get_data();
+            const int ld = a.get_cols();
+            product(z, input,
+                [this, biases, a_data, ld](int row, int col, T* z_row, int n) {
+                    const T bias = biases[row];
+                    T* a_row = a_data + row * ld + col;
+                    for (int j = 0; j < n; ++j)
+                    {
+                        const T v = z_row[j] + bias;
+                        z_row[j] = v;
+                        a_row[j] = activation_.f(v);
+                    }
+                });
+            normalize(a);
+            ctx.last_a = a;
+            ctx.last_z = z;
+        }
+        else
+        {
+            // Only a is needed, computed in place of z, in the context's
+            // output buffer when it already has the right shape
+            a = ctx.output;
+            product(a, input,
+                [this, biases](int row, int, T* a_row, int n) {
+                    const T bias = biases[row];
+                    for (int j = 0; j < n; ++j)
+                        a_row[j] = activation_.f(a_row[j] + bias);
+                });
+            normalize(a);
+            ctx.output = a;
         }
 
-        if (this->next_ == nullptr)
-            return a;
-        return this->next_->feedforward(a, training);
+        return a;
     }
 
-    virtual void backpropagation(const Matrix<T>* const y)
+    // Symmetric int8 weights with one scale per output row, and one scale
+    // for the inputs. Training the layer again drops them.
+    void quantize(T input_scale)
     {
-        if (this->prev_.expired()) // If we reach InputLayer
-            return;
+        const Matrix<T> weights = get_dense_weights();
+        const int rows = weights.get_rows();
+        const int cols = weights.get_cols();
+        const T* w = weights.get_data();
+        qweights_.resize(static_cast<size_t>(rows) * cols);
+        row_scales_.resize(rows);
+        for (int r = 0; r < rows; ++r)
+        {
+            T max = 0;
+            for (int c = 0; c < cols; ++c)
+                max = std::max(max, std::abs(w[r * cols + c]));
+            row_scales_[r] = max > 0 ? max / 127 : 1;
+            for (int c = 0; c < cols; ++c)
+                qweights_[r * cols + c] = to_int8(w[r * cols + c] / row_scales_[r]);
+        }
+        input_scale_ = input_scale > 0 ? input_scale : 1;
+    }
 
-        auto next = std::dynamic_pointer_cast<HiddenLayer<T>>(this->next_);
+    bool is_quantized(void) const { return !qweights_.empty(); }
+
+    // The dense weights are released: from then on only the CSR values are
+    // trained, pruned ones staying zero. Called again with a larger
+    // sparsity, e.g. by a gradual schedule, it prunes further.
+    void prune(double sparsity)
+    {
+        if (sparsity < 0 || sparsity >= 1)
+            throw std::invalid_argument("Sparsity must be in [0, 1)");
+        if (this->weights_.get_rows() == 0)
+            throw std::invalid_argument("Layer has not been compiled");
+
+        // Zeroes the k weights of smallest magnitude, picked by index: on
+        // ties, e.g. after quantization, comparing with the k-th magnitude
+        // would keep more than asked
+        Matrix<T> weights = get_dense_weights().clone();
+        const size_t size = static_cast<size_t>(weights.get_rows()) * weights.get_cols();
+        const size_t k = static_cast<size_t>(sparsity * size);
+        T* w = weights.get_data();
+        if (k > 0)
+        {
+            std::vector<size_t> order(size);
+            std::iota(order.begin(), order.end(), 0);
+            std::nth_element(order.begin(), order.begin() + k, order.end(),
+                             [w](size_t a, size_t b) {
+                                 const T ma = std::abs(w[a]);
+                                 const T mb = std::abs(w[b]);
+                                 return ma < mb || (ma == mb && a < b);
+                             });
+            for (size_t i = 0; i < k; ++i)
+                w[order[i]] = 0;
+        }
+
+        sparse_weights_ = CsrMatrix<T>::from_dense(weights);
+        sparse_ = true;
+        this->weights_ = Matrix<T>(std::shared_ptr<T[]>(), nullptr,
+                                   weights.get_rows(), weights.get_cols());
+        qweights_.clear();
+        weights_state_.reset();
+    }
+
+    bool is_sparse(void) const { return sparse_; }
+
+    const CsrMatrix<T>* get_sparse_weights(void) const
+    {
+        return sparse_ ? &sparse_weights_ : nullptr;
+    }
+
+    Matrix<T> get_dense_weights(void) const
+    {
+        return sparse_ ? sparse_weights_.to_dense() : this->weights_;
+    }
+
+    size_t get_nb_parameters(void) const
+    {
+        return sparse_ ? sparse_weights_.nnz() + this->biases_.get_rows()
+                       : HiddenLayer<T>::get_nb_parameters();
+    }
+
+    size_t get_parameters_bytes(void) const
+    {
+        return sparse_ ? sparse_weights_.bytes() + sizeof(T) * this->biases_.get_rows()
+                       : HiddenLayer<T>::get_parameters_bytes();
+    }
+
+    void set_parameters(const Matrix<T>& weights, const Matrix<T>& biases)
+    {
+        HiddenLayer<T>::set_parameters(weights, biases);
+        sparse_ = false;
+        sparse_weights_ = CsrMatrix<T>();
+        qweights_.clear();
+        weights_state_.reset();
+        biases_state_.reset();
+    }
+
+    // Pruned weights are saved dense, and pruned again on restore: the
+    // stored ones are the non-zero ones
+    void save_state(TrainingState<T>& state) const
+    {
+        state.put_counter(sparse_);
+        if (sparse_)
+        {
+            const Matrix<T> weights = sparse_weights_.to_dense();
+            state.put_array(weights.get_data(),
+                            static_cast<size_t>(weights.get_rows()) * weights.get_cols());
+            state.put_array(this->biases_.get_data(), this->biases_.get_rows());
+        }
+        else
+            HiddenLayer<T>::save_state(state);
+        weights_state_.save(state);
+        biases_state_.save(state);
+    }
+
+    void restore_state(TrainingState<T>& state)
+    {
+        const bool sparse = state.get_counter() != 0;
+        if (sparse || sparse_)
+        {
+            const int rows = this->weights_.get_rows();
+            const int cols = this->weights_.get_cols();
+            Matrix<T> weights(rows, cols);
+            state.get_array(weights.get_data(), static_cast<size_t>(rows) * cols);
+            state.get_array(this->biases_.get_data(), this->biases_.get_rows());
+            sparse_ = sparse;
+            if (sparse)
+            {
+                sparse_weights_ = CsrMatrix<T>::from_dense(weights);
+                this->weights_ = Matrix<T>(std::shared_ptr<T[]>(), nullptr, rows, cols);
+            }
+            else
+            {
+                sparse_weights_ = CsrMatrix<T>();
+                this->weights_ = weights;
+            }
+        }
+        else
+            HiddenLayer<T>::restore_state(state);
+        const int nb_weights = sparse_ ? sparse_weights_.nnz()
+                                       : this->weights_.get_rows() * this->weights_.get_cols();
+        weights_state_.restore(state, nb_weights);
+        biases_state_.restore(state, this->biases_.get_rows());
+        qweights_.clear();
+    }
+
+    Matrix<T> forward_int8(const Matrix<T>& input, LayerContext<T>& ctx) const
+    {
+        if (!is_quantized())
+            return forward(input, ctx, false);
+
+        // Quantize the input, transposed so that each sample is contiguous
+        const int k = input.get_rows();
+        const int batch = input.get_cols();
+        const T* x = input.get_data();
+        const T inverse = 1 / input_scale_;
+        ctx.quantized_input.resize(static_cast<size_t>(k) * batch);
+        int8_t* xq = ctx.quantized_input.data();
+        for (int p = 0; p < k; ++p)
+            for (int j = 0; j < batch; ++j)
+                xq[j * k + p] = to_int8(x[p * batch + j] * inverse);
+
+        // Dequantize, add the bias and activate each int32 row segment
+        Matrix<T> a = ctx.output;
+        if (a.get_data() == nullptr || a.get_rows() != this->nb_neurons_ || a.get_cols() != batch)
+            a = Matrix<T>(this->nb_neurons_, batch);
+        T* a_data = a.get_data();
+        const T* biases = this->biases_.get_data();
+        Int8Gemm::compute(this->nb_neurons_, batch, k, qweights_.data(), xq,
+            [this, a_data, biases, batch](int row, int col, const int32_t* acc, int n) {
+                const T scale = row_scales_[row] * input_scale_;
+                const T bias = biases[row];
+                T* a_row = a_data + row * batch + col;
+                for (int j = 0; j < n; ++j)
+                    a_row[j] = activation_.f(acc[j] * scale + bias);
+            });
+        normalize(a);
+        ctx.output = a;
+        return a;
+    }
+
+    void backward(LayerContext<T>& ctx,
+                  const LayerContext<T>& prev_ctx,
+                  const HiddenLayer<T>* next,
+                  const LayerContext<T>* next_ctx,
+                  const Matrix<T>* y,
+                  const Loss<T>& loss) const
+    {
+        T* z = ctx.last_z.get_data();
+        const T* a = ctx.last_a.get_data();
 
-        this->last_z_.map_inplace(this->activation_.fd_); // Avoid creating a new matrix below
         if (y != nullptr)
         {
-            this->last_a_ -= *y; // Same
-            this->last_a_.multiply_inplace(this->last_z_); // Same
-            this->delta_ = this->last_a_;
+            // delta = dL/da * f'(z), or a - y for the fused pairs, in one
+            // pass and in place of z
+            ctx.loss = loss.output_delta(activation_, z, a, y->get_data(),
+                                         this->nb_neurons_, ctx.last_z.get_cols());
+            ctx.delta = ctx.last_z;
         }
+        else if constexpr (is_per_sample<Activation>::value)
+            throw std::logic_error("Softmax is only supported on the output layer");
         else
         {
-            this->last_z_.multiply_inplace(
-                Matrix<T>::dot(next->get_weights(), next->get_delta(), transpose::LEFT)); // Same
-            this->delta_ = this->last_z_;
+            // delta = (W_next^T * delta_next) * f'(z), the product of the
+            // derivative being fused into the GEMM epilogue
+            const int ld = ctx.last_z.get_cols();
+            ctx.delta = this->scratch(buffer(ctx, DELTA), this->nb_neurons_, ld);
+            auto derivative = [this, z, a, ld](int row, int col, T* d_row, int n) {
+                const int offset = row * ld + col;
+                for (int j = 0; j < n; ++j)
+                    d_row[j] *= activation_.fd(z[offset + j], a[offset + j]);
+            };
+            if (next->get_kind() != layer_kind::DENSE)
+            {
+                // Other layers give their input error on their own
+                next->input_error(ctx.delta, *next_ctx);
+                for (int row = 0; row < this->nb_neurons_; ++row)
+                    derivative(row, 0, ctx.delta.get_data() + row * ld, ld);
+            }
+            else if (const CsrMatrix<T>* sparse = next->get_sparse_weights())
+                sparse->multiply_transposed(ctx.delta, next_ctx->delta, derivative);
+            else
+                Matrix<T>::dot_into(ctx.delta, next->get_weights(), next_ctx->delta,
+                                    transpose::LEFT, false, derivative);
         }
 
-        this->delta_biases_ += this->delta_;
-        this->delta_weights_ += Matrix<T>::dot(
-                                    this->delta_, this->prev_.lock()->get_last_a(), transpose::RIGHT);
-        this->prev_.lock()->backpropagation(nullptr);
+        // Summing over the batch columns: biases explicitly, weights through
+        // the inner dimension of the product, accumulated by the GEMM
+        ctx.delta_biases.add_column_sums(ctx.delta);
+        Matrix<T>::dot_into(ctx.delta_weights, ctx.delta, prev_ctx.last_a,
+                            transpose::RIGHT, true);
     }
 
-    void update(T learning_rate)
+    // W^T * delta, the product that backward() fuses when the next layer
+    // is dense too
+    void input_error(Matrix<T>& out, const LayerContext<T>& ctx) const
     {
-        // Update weights_ and biases_
-        for (int i = 0; i < this->weights_.get_rows(); i++)
+        if (sparse_)
+            sparse_weights_.multiply_transposed(out, ctx.delta);
+        else
+            Matrix<T>::dot_into(out, this->weights_, ctx.delta, transpose::LEFT);
+    }
+
+    void update(const Optimizer<T>& optimizer, LayerContext<T>& ctx)
+    {
+        // Update weights_ and biases_ and reset delta_weights and
+        // delta_biases, one fused pass each. Once pruned, only the stored
+        // weights move: the gradients of the others are dropped.
+        if (sparse_)
         {
-            for (int j = 0; j < this->weights_.get_cols(); j++)
-                this->weights_(i, j) -= learning_rate * this->delta_weights_(i, j);
-            this->biases_(i, 0) -= learning_rate * this->delta_biases_(i, 0);
+            const int cols = ctx.delta_weights.get_cols();
+            const T* gradients = ctx.delta_weights.get_data();
+            const int* offsets = sparse_weights_.row_offsets();
+            const int* indices = sparse_weights_.col_indices();
+            sparse_gradients_.resize(sparse_weights_.nnz());
+            for (int i = 0; i < this->nb_neurons_; ++i)
+                for (int p = offsets[i]; p < offsets[i + 1]; ++p)
+                    sparse_gradients_[p] = gradients[i * cols + indices[p]];
+            ctx.delta_weights.fill(fill_type::ZERO);
+            weights_state_.step(optimizer, sparse_weights_.values(), sparse_gradients_.data(),
+                                sparse_gradients_.size());
         }
+        else
+            weights_state_.step(optimizer, this->weights_.get_data(),
+                                ctx.delta_weights.get_data(),
+                                this->weights_.get_rows() * this->weights_.get_cols());
+        biases_state_.step(optimizer, this->biases_.get_data(), ctx.delta_biases.get_data(),
+                           this->biases_.get_rows());
 
-        // Reset delta_weights_ and delta_biases_
-        this->delta_weights_.fill(fill_type::ZERO);
-        this->delta_biases_.fill(fill_type::ZERO);
+        // The int8 weights are stale now
+        qweights_.clear();
     }
 
     void compile(std::weak_ptr<Layer<T>> prev,
                  std::shared_ptr<Layer<T>> next)
     {
-        // Initialize weights and biases
-        this->weights_ = Matrix<T>(this->nb_neurons_, prev.lock()->get_nb_neurons());
-        this->biases_ = Matrix<T>(this->nb_neurons_, 1);
-        this->weights_.fill(fill_type::RANDOM_FLOAT);
-        this->biases_.fill(fill_type::RANDOM_FLOAT);
+        if (is_per_sample<Activation>::value && next != nullptr)
+            throw std::invalid_argument("Softmax is only supported on the output layer");
 
-        // Initialize delta_weights_ and delta_biases_
-        this->delta_weights_ = Matrix<T>(this->nb_neurons_, prev.lock()->get_nb_neurons());
-        this->delta_biases_ = Matrix<T>(this->nb_neurons_, 1);
+        // Initialize weights and biases, unless they are already set (trained
+        // or loaded) with the right shape
+        const int inputs = prev.lock()->get_nb_neurons();
+        if ((!sparse_ && this->weights_.get_data() == nullptr)
+            || this->weights_.get_cols() != inputs || this->biases_.get_data() == nullptr)
+        {
+            sparse_ = false;
+            sparse_weights_ = CsrMatrix<T>();
+            weights_state_.reset();
+            biases_state_.reset();
+            this->weights_ = Matrix<T>(this->nb_neurons_, inputs);
+            this->biases_ = Matrix<T>(this->nb_neurons_, 1);
+            this->initialize_parameters();
+        }
 
         this->compiled_ = true;
         this->prev_ = prev;
         this->next_ = next;
     }
 
-};
\ No newline at end of file
+    void reserve(Workspace<T>& workspace, LayerContext<T>& ctx, int batch_size)
+    {
+        HiddenLayer<T>::reserve(workspace, ctx, batch_size);
+        ctx.slots.push_back(workspace.reserve(this->nb_neurons_, batch_size));
+        ctx.slots.push_back(workspace.reserve(this->nb_neurons_, batch_size));
+        ctx.slots.push_back(workspace.reserve(this->nb_neurons_, batch_size));
+    }
+
+    void bind(const Workspace<T>& workspace, LayerContext<T>& ctx)
+    {
+        HiddenLayer<T>::bind(workspace, ctx);
+        ctx.buffers.clear();
+        for (size_t i = this->hidden_slots; i < ctx.slots.size(); ++i)
+            ctx.buffers.push_back(workspace.slot(ctx.slots[i]));
+    }
+
+private:
+    // Second pass of per-sample activations (softmax), over whole columns
+    void normalize(Matrix<T>& a) const
+    {
+        if constexpr (is_per_sample<Activation>::value)
+            activation_.normalize(a.get_data(), a.get_rows(), a.get_cols());
+    }
+
+    // out = W * input, dense or sparse
+    template <typename Epilogue>
+    void product(Matrix<T>& out, const Matrix<T>& input, const Epilogue& ep) const
+    {
+        if (sparse_)
+            sparse_weights_.multiply(out, input, ep);
+        else
+            Matrix<T>::dot_into(out, this->weights_, input, transpose::NO_IMPLICIT, false, ep);
+    }
+
+    // Planned buffers of a context
+    enum buffer_id { Z, A, DELTA };
+
+    static const Matrix<T>& buffer(const LayerContext<T>& ctx, buffer_id id)
+    {
+        static const Matrix<T> none;
+        return static_cast<size_t>(id) < ctx.buffers.size() ? ctx.buffers[id] : none;
+    }
+
+    static int8_t to_int8(T v)
+    {
+        return static_cast<int8_t>(std::max<T>(-127, std::min<T>(127, std::round(v))));
+    }
+
+    Activation activation_;
+
+    // int8 weights (row-major), their scales, and the scale of the inputs
+    std::vector<int8_t> qweights_;
+    std::vector<T> row_scales_;
+    T input_scale_ = 1;
+
+    // Pruned weights, replacing weights_ when sparse_
+    CsrMatrix<T> sparse_weights_;
+    bool sparse_ = false;
+    std::vector<T> sparse_gradients_;
+
+    // Moments of the optimizer
+    OptimizerState<T> weights_state_;
+    OptimizerState<T> biases_state_;
+};
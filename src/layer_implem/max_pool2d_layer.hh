@@ -0,0 +1,218 @@
+#pragma once
+
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
+#include <vector>
+
+#include "../layer/hidden_layer.hh"
+#include "../matrix/matrix.hh"
+#include "../matrix/im2col.hh"
+
+// Max pooling over image batches (see im2col.hh for their layout), channel
+// by channel. Padding pixels never win: every window keeps at least one
+// pixel of the image. No parameters, so no gradients either; the error goes
+// back to the pixel that won each window, the first one on ties.
+template <typename T>
+class MaxPool2DLayer : public HiddenLayer<T>
+{
+public:
+    // Non-overlapping size x size windows
+    MaxPool2DLayer(const ImageShape& input, int size = 2)
+    : MaxPool2DLayer(input, size, size)
+    {}
+
+    MaxPool2DLayer(const ImageShape& input, int size, int stride, int padding = 0)
+    : HiddenLayer<T>(input.channels * ImageWindow(input, size, stride, padding).positions())
+    , window_(input, size, stride, padding)
+    {
+        // Pixels of every window position in the first channel, so that
+        // passes do not allocate
+        const ImageWindow& w = window_;
+        window_begin_.push_back(0);
+        for (int oh = 0; oh < w.out_height; ++oh)
+        {
+            for (int ow = 0; ow < w.out_width; ++ow)
+            {
+                for (int i = 0; i < w.size; ++i)
+                {
+                    const int ih = oh * w.stride - w.padding + i;
+                    for (int j = 0; j < w.size; ++j)
+                    {
+                        const int iw = ow * w.stride - w.padding + j;
+                        if (ih >= 0 && ih < w.input.height && iw >= 0 && iw < w.input.width)
+                            window_pixels_.push_back(static_cast<long>(ih) * w.input.width + iw);
+                    }
+                }
+                window_begin_.push_back(window_pixels_.size());
+            }
+        }
+    }
+
+    virtual ~MaxPool2DLayer() = default;
+
+    using HiddenLayer<T>::update;
+
+    layer_kind get_kind(void) const { return layer_kind::MAX_POOL2D; }
+    // No activation
+    activation_id get_activation(void) const { return activation_id::CUSTOM; }
+    double get_activation_parameter(void) const { return 0; }
+    math_mode get_math_mode(void) const { return math_mode::EXACT; }
+
+    ImageShape get_output_shape(void) const { return window_.output(window_.input.channels); }
+    const ImageWindow& get_window(void) const { return window_; }
+
+    // One comparison per window pixel
+    double forward_flops(int batch) const
+    {
+        return static_cast<double>(window_.size) * window_.size * this->nb_neurons_ * batch;
+    }
+
+    Matrix<T> forward(const Matrix<T>& input, LayerContext<T>& ctx, bool training) const
+    {
+        const int batch = input.get_cols();
+        Matrix<T> a;
+        if (training)
+            a = this->scratch(buffer(ctx, A), this->nb_neurons_, batch);
+        else
+        {
+            a = ctx.output;
+            if (a.get_data() == nullptr || a.get_rows() != this->nb_neurons_
+                || a.get_cols() != batch)
+                a = Matrix<T>(this->nb_neurons_, batch);
+        }
+
+        const T* x = input.get_data();
+        T* out = a.get_data();
+        for_each_window([&](long o, long channel, const long* pixels, int count) {
+            T* out_row = out + o * batch;
+            std::fill(out_row, out_row + batch, std::numeric_limits<T>::lowest());
+            for (int p = 0; p < count; ++p)
+            {
+                const T* in_row = x + (channel + pixels[p]) * batch;
+                for (int n = 0; n < batch; ++n)
+                    out_row[n] = std::max(out_row[n], in_row[n]);
+            }
+        });
+
+        if (training)
+        {
+            // The input, to find the winners again in input_error()
+            ctx.last_z = input;
+            ctx.last_a = a;
+        }
+        else
+            ctx.output = a;
+        return a;
+    }
+
+    void backward(LayerContext<T>& ctx,
+                  const LayerContext<T>&,
+                  const HiddenLayer<T>* next,
+                  const LayerContext<T>* next_ctx,
+                  const Matrix<T>* y,
+                  const Loss<T>& loss) const
+    {
+        const int batch = ctx.last_a.get_cols();
+        ctx.delta = this->scratch(buffer(ctx, DELTA), this->nb_neurons_, batch);
+        if (y != nullptr)
+            ctx.loss = loss.output_delta(Identity<T>(), ctx.delta.get_data(),
+                                         ctx.last_a.get_data(), y->get_data(),
+                                         this->nb_neurons_, batch);
+        else
+            next->input_error(ctx.delta, *next_ctx);
+    }
+
+    void input_error(Matrix<T>& out, const LayerContext<T>& ctx) const
+    {
+        const int batch = ctx.delta.get_cols();
+        const int inputs = window_.input.size();
+        if (out.get_data() == nullptr || out.get_rows() != inputs || out.get_cols() != batch)
+            out = Matrix<T>(inputs, batch);
+        out.fill(fill_type::ZERO);
+
+        const T* x = ctx.last_z.get_data();
+        const T* a = ctx.last_a.get_data();
+        const T* delta = ctx.delta.get_data();
+        T* error = out.get_data();
+        for_each_window([&](long o, long channel, const long* pixels, int count) {
+            for (int n = 0; n < batch; ++n)
+            {
+                const T max = a[o * batch + n];
+                int p = 0;
+                while (p < count - 1 && x[(channel + pixels[p]) * batch + n] != max)
+                    ++p;
+                error[(channel + pixels[p]) * batch + n] += delta[o * batch + n];
+            }
+        });
+    }
+
+    // Nothing to learn
+    void update(const Optimizer<T>&, LayerContext<T>&) {}
+
+    void set_parameters(const Matrix<T>&, const Matrix<T>&)
+    {
+        throw std::invalid_argument("Pooling layers have no parameters");
+    }
+
+    void compile(std::weak_ptr<Layer<T>> prev,
+                 std::shared_ptr<Layer<T>> next)
+    {
+        if (prev.lock()->get_nb_neurons() != window_.input.size())
+            throw std::invalid_argument("Input does not match the pooling");
+        this->compiled_ = true;
+        this->prev_ = prev;
+        this->next_ = next;
+    }
+
+    void reserve(Workspace<T>& workspace, LayerContext<T>& ctx, int batch_size)
+    {
+        HiddenLayer<T>::reserve(workspace, ctx, batch_size);
+        ctx.slots.push_back(workspace.reserve(this->nb_neurons_, batch_size));
+        ctx.slots.push_back(workspace.reserve(this->nb_neurons_, batch_size));
+    }
+
+    void bind(const Workspace<T>& workspace, LayerContext<T>& ctx)
+    {
+        HiddenLayer<T>::bind(workspace, ctx);
+        ctx.buffers.clear();
+        for (size_t i = this->hidden_slots; i < ctx.slots.size(); ++i)
+            ctx.buffers.push_back(workspace.slot(ctx.slots[i]));
+    }
+
+private:
+    // f(output row, first input row of its channel, input rows of its
+    // window from there, their count), for every window of every channel;
+    // input rows exclude the padding
+    template <typename F>
+    void for_each_window(const F& f) const
+    {
+        const long channel_size = static_cast<long>(window_.input.height) * window_.input.width;
+        const int positions = window_.positions();
+        long o = 0;
+        for (int c = 0; c < window_.input.channels; ++c)
+        {
+            for (int pos = 0; pos < positions; ++pos, ++o)
+            {
+                const long begin = window_begin_[pos];
+                f(o, c * channel_size, window_pixels_.data() + begin,
+                  static_cast<int>(window_begin_[pos + 1] - begin));
+            }
+        }
+    }
+
+    // Planned buffers of a context
+    enum buffer_id { A, DELTA };
+
+    static const Matrix<T>& buffer(const LayerContext<T>& ctx, buffer_id id)
+    {
+        static const Matrix<T> none;
+        return static_cast<size_t>(id) < ctx.buffers.size() ? ctx.buffers[id] : none;
+    }
+
+    ImageWindow window_;
+    // Pixels of window position p, within a channel:
+    // window_pixels_[window_begin_[p]..window_begin_[p + 1])
+    std::vector<long> window_pixels_;
+    std::vector<long> window_begin_;
+};
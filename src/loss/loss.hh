@@ -0,0 +1,174 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+
+#include "../matrix/matrix.hh"
+#include "../activation_function/activation_function.hh"
+
+// Training losses, selected at Model::compile:
+//
+//   model.compile(Optimizer<float>::adam(0.001), Loss<float>::categorical_cross_entropy());
+//
+// For outputs a and targets y (outputs x batch), summed over the batch:
+//   MSE                        1/2 sum (a - y)^2
+//   BINARY_CROSS_ENTROPY       -sum y log a + (1 - y) log(1 - a), a in (0, 1)
+//   CATEGORICAL_CROSS_ENTROPY  -sum y log a, one distribution per column
+// The output layer turns them into its delta with output_delta(), which
+// sums the loss on the way: reporting it costs no extra pass over the batch.
+
+enum class loss_id : uint32_t
+{
+    MSE,
+    BINARY_CROSS_ENTROPY,
+    CATEGORICAL_CROSS_ENTROPY
+};
+
+inline const char* loss_name(loss_id id)
+{
+    switch (id)
+    {
+        case loss_id::MSE:
+            return "mse";
+        case loss_id::BINARY_CROSS_ENTROPY:
+            return "binary_cross_entropy";
+        case loss_id::CATEGORICAL_CROSS_ENTROPY:
+            return "categorical_cross_entropy";
+        default:
+            return "unknown";
+    }
+}
+
+template <typename T>
+struct Loss
+{
+    loss_id id = loss_id::MSE;
+
+    static Loss mse(void) { return { loss_id::MSE }; }
+    static Loss binary_cross_entropy(void) { return { loss_id::BINARY_CROSS_ENTROPY }; }
+    static Loss categorical_cross_entropy(void) { return { loss_id::CATEGORICAL_CROSS_ENTROPY }; }
+
+    // Loss of one output against its target
+    T value(T a, T y) const
+    {
+        switch (id)
+        {
+            case loss_id::MSE:
+                return (a - y) * (a - y) / 2;
+            case loss_id::BINARY_CROSS_ENTROPY:
+                return -(y != 0 ? y * log(a) : 0) - (y != 1 ? (1 - y) * log(1 - a) : 0);
+            default:
+                return y != 0 ? -y * log(a) : 0;
+        }
+    }
+
+    // Summed over a batch
+    double value(const Matrix<T>& a, const Matrix<T>& y) const
+    {
+        if (a.get_rows() != y.get_rows() || a.get_cols() != y.get_cols())
+            throw std::invalid_argument("Outputs and targets do not match");
+        const T* outputs = a.get_data();
+        const T* targets = y.get_data();
+        double sum = 0;
+        for (int i = 0; i < a.get_rows() * a.get_cols(); ++i)
+            sum += value(outputs[i], targets[i]);
+        return sum;
+    }
+
+    // dL/da
+    T gradient(T a, T y) const
+    {
+        switch (id)
+        {
+            case loss_id::MSE:
+                return a - y;
+            case loss_id::BINARY_CROSS_ENTROPY:
+                return (a - y) / std::max(a * (1 - a), std::numeric_limits<T>::min());
+            default:
+                return -y / std::max(a, std::numeric_limits<T>::min());
+        }
+    }
+
+    // delta = dL/dz of an output layer (rows x cols) with activation f, in
+    // place of z, from its outputs a and the targets y. Returns the loss,
+    // summed over the batch. Sigmoid with binary cross-entropy and softmax
+    // with categorical cross-entropy collapse to delta = a - y: no division,
+    // derivative or exp.
+    template <typename Activation>
+    double output_delta(const Activation& f, T* z, const T* a, const T* y,
+                        int rows, int cols) const
+    {
+        const long size = static_cast<long>(rows) * cols;
+        double loss = 0;
+        if (fuses(f))
+        {
+            // The loss is summed in the delta loop. Cross-entropy only takes
+            // logs of non-zero targets, once per sample for one-hot ones.
+            if (id == loss_id::CATEGORICAL_CROSS_ENTROPY)
+            {
+                for (long i = 0; i < size; ++i)
+                {
+                    z[i] = a[i] - y[i];
+                    if (y[i] != 0)
+                        loss -= y[i] * log(a[i]);
+                }
+            }
+            else
+            {
+                for (long i = 0; i < size; ++i)
+                {
+                    z[i] = a[i] - y[i];
+                    loss -= y[i] * log(a[i]) + (1 - y[i]) * log(1 - a[i]);
+                }
+            }
+            return loss;
+        }
+
+        for (long i = 0; i < size; ++i)
+        {
+            loss += value(a[i], y[i]);
+            if constexpr (is_per_sample<Activation>::value)
+                z[i] = gradient(a[i], y[i]);
+            else
+                z[i] = gradient(a[i], y[i]) * f.fd(z[i], a[i]);
+        }
+
+        // Softmax with another loss: delta = J^T g per column, with the
+        // Jacobian J = diag(a) - a a^T
+        if constexpr (is_per_sample<Activation>::value)
+        {
+            for (int j = 0; j < cols; ++j)
+            {
+                T dot = 0;
+                for (int i = 0; i < rows; ++i)
+                {
+                    const long k = static_cast<long>(i) * cols + j;
+                    dot += a[k] * z[k];
+                }
+                for (int i = 0; i < rows; ++i)
+                {
+                    const long k = static_cast<long>(i) * cols + j;
+                    z[k] = a[k] * (z[k] - dot);
+                }
+            }
+        }
+        return loss;
+    }
+
+private:
+    template <typename Activation>
+    bool fuses(const Activation& f) const
+    {
+        return (id == loss_id::BINARY_CROSS_ENTROPY && f.id == activation_id::SIGMOID)
+               || (id == loss_id::CATEGORICAL_CROSS_ENTROPY && f.id == activation_id::SOFTMAX);
+    }
+
+    // Saturated outputs cost a large but finite loss
+    static T log(T v)
+    {
+        return std::log(std::max(v, std::numeric_limits<T>::min()));
+    }
+};
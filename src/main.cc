@@ -58,6 +58,7 @@ int main(void)
     // Train model
     model.compile(0.1);
     model.train(x_train, y_train, 10000, 1);
+    model.summary();
 
     // Test the model
     for (size_t i = 0; i < x_train.size(); i++)
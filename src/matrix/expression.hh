@@ -0,0 +1,288 @@
+#pragma once
+
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+
+#include "simd.hh"
+
+// Lazy elementwise arithmetic over Matrix. Operators on expressions build a
+// small tree of nodes, which is evaluated in a single loop only when
+// assigned to a Matrix:
+//
+//   Matrix<T> delta = (a.lazy() - y).multiply(z.lazy().map(fd)); // one loop
+//   w -= lr * dw;                                                 // one loop, in place
+//
+// Leaves hold a Matrix handle, so an expression keeps its operands alive,
+// but sees later writes to them until it is evaluated. Matrix + Matrix and
+// Matrix - Matrix stay eager (see matrix.hh), as does Matrix * Matrix, the
+// matrix product; use multiply() for the elementwise one.
+
+template <typename T>
+class Matrix;
+
+template <typename E>
+class MatrixExpr
+{
+public:
+    const E& self(void) const { return static_cast<const E&>(*this); }
+
+    int get_rows(void) const { return self().get_rows(); }
+    int get_cols(void) const { return self().get_cols(); }
+
+    template <typename R>
+    auto multiply(const R& right) const;
+
+    template <typename F>
+    auto map(F f) const;
+
+    auto transpose(void) const;
+};
+
+// Leaf over a Matrix
+template <typename T>
+class MatrixLeaf : public MatrixExpr<MatrixLeaf<T>>
+{
+public:
+    using value_type = T;
+    // Element i of the expression is element i of every operand
+    static constexpr bool flat = true;
+
+    explicit MatrixLeaf(const Matrix<T>& m)
+        : m_(m), data_(m.get_data()), rows_(m.get_rows()), cols_(m.get_cols())
+    {}
+
+    T flat_at(int i) const { return data_[i]; }
+    T at(int y, int x) const { return data_[y * cols_ + x]; }
+
+    int get_rows(void) const { return rows_; }
+    int get_cols(void) const { return cols_; }
+    const T* data(void) const { return data_; }
+
+private:
+    Matrix<T> m_;
+    const T* data_;
+    int rows_;
+    int cols_;
+};
+
+// Operand conversion: matrices become leaves, expressions are taken as is
+template <typename X, typename = void>
+struct expr_operand
+{
+    static constexpr bool value = false;
+};
+
+template <typename T>
+struct expr_operand<Matrix<T>>
+{
+    static constexpr bool value = true;
+    using type = MatrixLeaf<T>;
+    static type wrap(const Matrix<T>& m) { return type(m); }
+};
+
+template <typename X>
+struct expr_operand<X, std::enable_if_t<std::is_base_of<MatrixExpr<X>, X>::value>>
+{
+    static constexpr bool value = true;
+    using type = X;
+    static const X& wrap(const X& e) { return e; }
+};
+
+template <typename X>
+using expr_operand_t = typename expr_operand<X>::type;
+
+template <typename Op, typename L, typename R>
+class BinaryExpr : public MatrixExpr<BinaryExpr<Op, L, R>>
+{
+public:
+    using value_type = typename L::value_type;
+    using op_type = Op;
+    static constexpr bool flat = L::flat && R::flat;
+
+    BinaryExpr(const L& left, const R& right) : left_(left), right_(right)
+    {
+        if (left.get_rows() != right.get_rows() || left.get_cols() != right.get_cols())
+            throw std::invalid_argument("Elementwise operation need same width and height");
+    }
+
+    value_type flat_at(int i) const
+    {
+        value_type v;
+        Op::apply(v, left_.flat_at(i), right_.flat_at(i));
+        return v;
+    }
+
+    value_type at(int y, int x) const
+    {
+        value_type v;
+        Op::apply(v, left_.at(y, x), right_.at(y, x));
+        return v;
+    }
+
+    int get_rows(void) const { return left_.get_rows(); }
+    int get_cols(void) const { return left_.get_cols(); }
+    const L& left(void) const { return left_; }
+    const R& right(void) const { return right_; }
+
+private:
+    L left_;
+    R right_;
+};
+
+template <typename E>
+class ScaleExpr : public MatrixExpr<ScaleExpr<E>>
+{
+public:
+    using value_type = typename E::value_type;
+    static constexpr bool flat = E::flat;
+
+    ScaleExpr(value_type scalar, const E& e) : scalar_(scalar), e_(e) {}
+
+    value_type flat_at(int i) const { return scalar_ * e_.flat_at(i); }
+    value_type at(int y, int x) const { return scalar_ * e_.at(y, x); }
+
+    int get_rows(void) const { return e_.get_rows(); }
+    int get_cols(void) const { return e_.get_cols(); }
+
+private:
+    value_type scalar_;
+    E e_;
+};
+
+template <typename F, typename E>
+class MapExpr : public MatrixExpr<MapExpr<F, E>>
+{
+public:
+    using value_type = typename E::value_type;
+    static constexpr bool flat = E::flat;
+
+    MapExpr(F f, const E& e) : f_(f), e_(e) {}
+
+    value_type flat_at(int i) const { return f_(e_.flat_at(i)); }
+    value_type at(int y, int x) const { return f_(e_.at(y, x)); }
+
+    int get_rows(void) const { return e_.get_rows(); }
+    int get_cols(void) const { return e_.get_cols(); }
+
+private:
+    F f_;
+    E e_;
+};
+
+template <typename E>
+class TransposeExpr : public MatrixExpr<TransposeExpr<E>>
+{
+public:
+    using value_type = typename E::value_type;
+    // Element i is not element i of the operand any more
+    static constexpr bool flat = false;
+
+    explicit TransposeExpr(const E& e) : e_(e) {}
+
+    value_type flat_at(int i) const { return at(i / get_cols(), i % get_cols()); }
+    value_type at(int y, int x) const { return e_.at(x, y); }
+
+    int get_rows(void) const { return e_.get_cols(); }
+    int get_cols(void) const { return e_.get_rows(); }
+
+private:
+    E e_;
+};
+
+template <typename E>
+template <typename R>
+auto MatrixExpr<E>::multiply(const R& right) const
+{
+    using RE = expr_operand_t<R>;
+    return BinaryExpr<simd_mul, E, RE>(self(), expr_operand<R>::wrap(right));
+}
+
+template <typename E>
+template <typename F>
+auto MatrixExpr<E>::map(F f) const
+{
+    return MapExpr<F, E>(f, self());
+}
+
+template <typename E>
+auto MatrixExpr<E>::transpose(void) const
+{
+    return TransposeExpr<E>(self());
+}
+
+template <typename L, typename R>
+using enable_if_operands = std::enable_if_t<expr_operand<L>::value
+                                            && expr_operand<R>::value>;
+
+template <typename L, typename R, typename = enable_if_operands<L, R>>
+auto operator+(const L& left, const R& right)
+{
+    return BinaryExpr<simd_add, expr_operand_t<L>, expr_operand_t<R>>(
+        expr_operand<L>::wrap(left), expr_operand<R>::wrap(right));
+}
+
+template <typename L, typename R, typename = enable_if_operands<L, R>>
+auto operator-(const L& left, const R& right)
+{
+    return BinaryExpr<simd_sub, expr_operand_t<L>, expr_operand_t<R>>(
+        expr_operand<L>::wrap(left), expr_operand<R>::wrap(right));
+}
+
+template <typename S, typename R,
+          typename = std::enable_if_t<std::is_arithmetic<S>::value && expr_operand<R>::value>>
+auto operator*(S scalar, const R& right)
+{
+    using RE = expr_operand_t<R>;
+    return ScaleExpr<RE>(static_cast<typename RE::value_type>(scalar),
+                         expr_operand<R>::wrap(right));
+}
+
+template <typename L, typename S,
+          typename = std::enable_if_t<std::is_arithmetic<S>::value && expr_operand<L>::value>>
+auto operator*(const L& left, S scalar)
+{
+    return scalar * left;
+}
+
+// Kernel table entry matching an elementwise operation
+template <typename T>
+auto elementwise_kernel(const ElementwiseKernels<T>& k, simd_add) { return k.add; }
+template <typename T>
+auto elementwise_kernel(const ElementwiseKernels<T>& k, simd_sub) { return k.sub; }
+template <typename T>
+auto elementwise_kernel(const ElementwiseKernels<T>& k, simd_mul) { return k.mul; }
+
+template <typename E>
+struct is_leaf_binary : std::false_type {};
+
+template <typename Op, typename T>
+struct is_leaf_binary<BinaryExpr<Op, MatrixLeaf<T>, MatrixLeaf<T>>> : std::true_type {};
+
+// Writes e into dst (row-major, e's shape). dst may be one of e's leaves
+// as long as e contains no transpose of it.
+template <typename E, typename T>
+void evaluate_expr(const E& e, T* dst)
+{
+    const int rows = e.get_rows();
+    const int cols = e.get_cols();
+
+    if constexpr (is_leaf_binary<E>::value)
+    {
+        // A single operation on two matrices: use the SIMD kernels
+        auto kernel = elementwise_kernel(ElementwiseKernels<T>::get(),
+                                         typename E::op_type());
+        kernel(dst, e.left().data(), e.right().data(), rows * cols);
+    }
+    else if constexpr (E::flat)
+    {
+        for (int i = 0; i < rows * cols; ++i)
+            dst[i] = e.flat_at(i);
+    }
+    else
+    {
+        for (int y = 0; y < rows; ++y)
+            for (int x = 0; x < cols; ++x)
+                dst[y * cols + x] = e.at(y, x);
+    }
+}
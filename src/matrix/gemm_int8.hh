@@ -0,0 +1,208 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include "simd.hh"
+#include "thread_pool.hh"
+
+#if PROPHECY_SIMD_X86
+#include <immintrin.h>
+#endif
+
+// int8 x int8 -> int32 matrix product for quantized inference:
+//
+//   C (m x n) = A (m x k) * B^T, with B given as n x k
+//
+// Both operands are row-major with unit stride along k, so every element of
+// C is a dot product of two contiguous int8 rows. The row kernel is picked
+// from the CPU like the elementwise kernels, see simd.hh. The x86 ones use
+// the widening multiply-add (vpmaddwd) directly, which vector extensions
+// cannot express; the portable loop is the fallback.
+//
+// C is never stored: each finished row segment is passed, as int32, to
+// ep(row, col, acc, n), which typically dequantizes it into the output.
+// Large products are split by rows across the shared ThreadPool.
+
+// Dot products of a with b[0], ..., b[3]. Always inlined into a
+// target-specific entry point below.
+static inline __attribute__((always_inline))
+void int8_dot4(const int8_t* a, const int8_t* b0, const int8_t* b1,
+               const int8_t* b2, const int8_t* b3, int k, int32_t* out)
+{
+    int32_t s0 = 0;
+    int32_t s1 = 0;
+    int32_t s2 = 0;
+    int32_t s3 = 0;
+    for (int p = 0; p < k; ++p)
+    {
+        const int32_t x = a[p];
+        s0 += x * b0[p];
+        s1 += x * b1[p];
+        s2 += x * b2[p];
+        s3 += x * b3[p];
+    }
+    out[0] = s0;
+    out[1] = s1;
+    out[2] = s2;
+    out[3] = s3;
+}
+
+// out[j] = a . b[j] for the n rows of b (k values each, ldb apart)
+static inline __attribute__((always_inline))
+void int8_row_loop(const int8_t* a, const int8_t* b, int ldb, int n, int k, int32_t* out)
+{
+    int j = 0;
+    for (; j + 4 <= n; j += 4)
+        int8_dot4(a, b + j * ldb, b + (j + 1) * ldb, b + (j + 2) * ldb,
+                  b + (j + 3) * ldb, k, out + j);
+    for (; j < n; ++j)
+    {
+        int32_t s = 0;
+        for (int p = 0; p < k; ++p)
+            s += static_cast<int32_t>(a[p]) * b[j * ldb + p];
+        out[j] = s;
+    }
+}
+
+inline void int8_row_default(const int8_t* a, const int8_t* b, int ldb, int n, int k,
+                             int32_t* out)
+{
+    int8_row_loop(a, b, ldb, n, k, out);
+}
+
+#if PROPHECY_SIMD_X86
+// Sign-extends 16 bytes at a time to int16 and sums pairs of products into
+// int32 lanes (vpmaddwd), four rows of b at once
+__attribute__((target("avx2")))
+inline void int8_row_avx2(const int8_t* a, const int8_t* b, int ldb, int n, int k,
+                          int32_t* out)
+{
+    int j = 0;
+    for (; j + 4 <= n; j += 4)
+    {
+        __m256i s[4] = { _mm256_setzero_si256(), _mm256_setzero_si256(),
+                         _mm256_setzero_si256(), _mm256_setzero_si256() };
+        int p = 0;
+        for (; p + 16 <= k; p += 16)
+        {
+            const __m256i va = _mm256_cvtepi8_epi16(
+                _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + p)));
+            for (int q = 0; q < 4; ++q)
+            {
+                const __m256i vb = _mm256_cvtepi8_epi16(
+                    _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + (j + q) * ldb + p)));
+                s[q] = _mm256_add_epi32(s[q], _mm256_madd_epi16(va, vb));
+            }
+        }
+        for (int q = 0; q < 4; ++q)
+        {
+            alignas(32) int32_t lanes[8];
+            _mm256_store_si256(reinterpret_cast<__m256i*>(lanes), s[q]);
+            int32_t sum = 0;
+            for (int l = 0; l < 8; ++l)
+                sum += lanes[l];
+            for (int r = p; r < k; ++r)
+                sum += static_cast<int32_t>(a[r]) * b[(j + q) * ldb + r];
+            out[j + q] = sum;
+        }
+    }
+    int8_row_loop(a, b + j * ldb, ldb, n - j, k, out + j);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+inline void int8_row_avx512(const int8_t* a, const int8_t* b, int ldb, int n, int k,
+                            int32_t* out)
+{
+    int j = 0;
+    for (; j + 4 <= n; j += 4)
+    {
+        __m512i s[4] = { _mm512_setzero_si512(), _mm512_setzero_si512(),
+                         _mm512_setzero_si512(), _mm512_setzero_si512() };
+        int p = 0;
+        for (; p + 32 <= k; p += 32)
+        {
+            const __m512i va = _mm512_cvtepi8_epi16(
+                _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + p)));
+            for (int q = 0; q < 4; ++q)
+            {
+                const __m512i vb = _mm512_cvtepi8_epi16(
+                    _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + (j + q) * ldb + p)));
+                s[q] = _mm512_add_epi32(s[q], _mm512_madd_epi16(va, vb));
+            }
+        }
+        for (int q = 0; q < 4; ++q)
+        {
+            alignas(64) int32_t lanes[16];
+            _mm512_store_si512(lanes, s[q]);
+            int32_t sum = 0;
+            for (int l = 0; l < 16; ++l)
+                sum += lanes[l];
+            for (int r = p; r < k; ++r)
+                sum += static_cast<int32_t>(a[r]) * b[(j + q) * ldb + r];
+            out[j + q] = sum;
+        }
+    }
+    int8_row_loop(a, b + j * ldb, ldb, n - j, k, out + j);
+}
+#endif
+
+using int8_row_kernel = void (*)(const int8_t*, const int8_t*, int, int, int, int32_t*);
+
+// Row kernel selected for this CPU; byte multiplies need AVX-512 BW on top
+// of the AVX-512 level of the elementwise kernels
+inline int8_row_kernel int8_row_for_level(simd_level level)
+{
+#if PROPHECY_SIMD_X86
+    if (level == simd_level::AVX512 && __builtin_cpu_supports("avx512bw"))
+        return int8_row_avx512;
+    if (level >= simd_level::AVX2)
+        return int8_row_avx2;
+#endif
+    (void) level;
+    return int8_row_default;
+}
+
+class Int8Gemm
+{
+public:
+    // Columns of C per block: NB rows of B stay in L1/L2 while every row of
+    // A goes over them
+    static constexpr int NB = 64;
+    static constexpr long parallel_product = 128L * 128 * 128;
+
+    template <typename Epilogue>
+    static void compute(int m, int n, int k, const int8_t* a, const int8_t* b,
+                        const Epilogue& ep)
+    {
+        static const int8_row_kernel kernel = int8_row_for_level(active_simd_level());
+
+        auto rows = [&](int begin, int end) {
+            thread_local std::vector<int32_t> acc;
+            acc.resize(NB);
+            for (int jb = 0; jb < n; jb += NB)
+            {
+                const int nb = std::min(NB, n - jb);
+                for (int i = begin; i < end; ++i)
+                {
+                    kernel(a + static_cast<long>(i) * k, b + static_cast<long>(jb) * k,
+                           k, nb, k, acc.data());
+                    ep(i, jb, acc.data(), nb);
+                }
+            }
+        };
+
+        ThreadPool& pool = ThreadPool::global();
+        if (pool.get_nb_threads() == 1 || static_cast<long>(m) * n * k < parallel_product)
+        {
+            rows(0, m);
+            return;
+        }
+
+        const int nb_tiles = std::min(m, pool.get_nb_threads() * 4);
+        pool.parallel_for(nb_tiles, [&](int t) {
+            rows(static_cast<long>(m) * t / nb_tiles, static_cast<long>(m) * (t + 1) / nb_tiles);
+        });
+    }
+};
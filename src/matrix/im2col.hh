@@ -0,0 +1,130 @@
+#pragma once
+
+#include <algorithm>
+#include <stdexcept>
+
+// Image batches are matrices like any other activation: features x batch,
+// the column of each sample holding its channels x height x width values in
+// NCHW order, so the row of (c, h, w) is (c * height + h) * width + w. Every
+// row being a run of batch values, the lowering below only moves whole runs.
+struct ImageShape
+{
+    int channels;
+    int height;
+    int width;
+
+    int size(void) const { return channels * height * width; }
+};
+
+// Square window sliding over an image with a stride, over a zero padding of
+// padding pixels on every side (for convolutions and pooling)
+struct ImageWindow
+{
+    ImageWindow(const ImageShape& input, int size, int stride, int padding)
+        : input(input), size(size), stride(stride), padding(padding)
+    {
+        if (input.channels <= 0 || input.height <= 0 || input.width <= 0)
+            throw std::invalid_argument("Bad image shape");
+        if (size <= 0 || stride <= 0 || padding < 0 || padding >= size
+            || input.height + 2 * padding < size || input.width + 2 * padding < size)
+            throw std::invalid_argument("Bad window for this image");
+        out_height = (input.height + 2 * padding - size) / stride + 1;
+        out_width = (input.width + 2 * padding - size) / stride + 1;
+    }
+
+    // Number of window positions
+    int positions(void) const { return out_height * out_width; }
+
+    ImageShape output(int channels) const { return { channels, out_height, out_width }; }
+
+    ImageShape input;
+    int size;
+    int stride;
+    int padding;
+    int out_height;
+    int out_width;
+};
+
+// Lowers a batch of images x (input.size() x batch) to the matrix of its
+// windows, cols ((channels * size * size) x (positions * batch)): row
+// (c * size + i) * size + j holds pixel (i, j) of every window of channel c,
+// column p * batch + n being window p of sample n. A filter bank W (filters x
+// rows of cols) then gives W * cols = filters x (positions * batch), which
+// is the (filters * positions) x batch output in the same layout as x.
+template <typename T>
+void im2col(const T* x, int batch, const ImageWindow& w, T* cols)
+{
+    const int height = w.input.height;
+    const int width = w.input.width;
+    const long run = static_cast<long>(w.out_width) * batch;
+    for (int c = 0; c < w.input.channels; ++c)
+    {
+        for (int i = 0; i < w.size; ++i)
+        {
+            for (int j = 0; j < w.size; ++j)
+            {
+                const long r = (c * w.size + i) * w.size + j;
+                T* row = cols + r * w.positions() * batch;
+                for (int oh = 0; oh < w.out_height; ++oh)
+                {
+                    T* dst = row + oh * run;
+                    const int ih = oh * w.stride - w.padding + i;
+                    if (ih < 0 || ih >= height)
+                    {
+                        std::fill(dst, dst + run, static_cast<T>(0));
+                        continue;
+                    }
+                    const T* src = x + static_cast<long>(c * height + ih) * width * batch;
+                    for (int ow = 0; ow < w.out_width; ++ow, dst += batch)
+                    {
+                        const int iw = ow * w.stride - w.padding + j;
+                        if (iw < 0 || iw >= width)
+                            std::fill(dst, dst + batch, static_cast<T>(0));
+                        else
+                            std::copy(src + static_cast<long>(iw) * batch,
+                                      src + static_cast<long>(iw + 1) * batch, dst);
+                    }
+                }
+            }
+        }
+    }
+}
+
+// Adjoint of im2col: sums every window pixel of cols back into the image it
+// was taken from. x is overwritten; padding pixels are dropped.
+template <typename T>
+void col2im(const T* cols, int batch, const ImageWindow& w, T* x)
+{
+    const int height = w.input.height;
+    const int width = w.input.width;
+    const long run = static_cast<long>(w.out_width) * batch;
+    std::fill(x, x + static_cast<long>(w.input.size()) * batch, static_cast<T>(0));
+    for (int c = 0; c < w.input.channels; ++c)
+    {
+        for (int i = 0; i < w.size; ++i)
+        {
+            for (int j = 0; j < w.size; ++j)
+            {
+                const long r = (c * w.size + i) * w.size + j;
+                const T* row = cols + r * w.positions() * batch;
+                for (int oh = 0; oh < w.out_height; ++oh)
+                {
+                    const int ih = oh * w.stride - w.padding + i;
+                    if (ih < 0 || ih >= height)
+                        continue;
+                    const T* src = row + oh * run;
+                    T* dst = x + static_cast<long>(c * height + ih) * width * batch;
+                    for (int ow = 0; ow < w.out_width; ++ow, src += batch)
+                    {
+                        const int iw = ow * w.stride - w.padding + j;
+                        if (iw < 0 || iw >= width)
+                            continue;
+                        T* pixel = dst + static_cast<long>(iw) * batch;
+                        for (int n = 0; n < batch; ++n)
+                            pixel[n] += src[n];
+                    }
+                }
+            }
+        }
+    }
+}
@@ -1,9 +1,23 @@
 #pragma once
 
+#include <algorithm>
 #include <ostream>
 #include <memory>
 #include <functional>
 #include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <limits>
+#include <new>
+#include <type_traits>
+#include <vector>
+#include <stdexcept>
+
+#include "expression.hh"
+#include "gemm.hh"
+#include "random.hh"
+#include "simd.hh"
 
 enum class transpose
 {
@@ -12,13 +26,74 @@ enum class transpose
     NO_IMPLICIT
 };
 
+// Random fills treat the matrix as weights (fan out x fan in) for the
+// Xavier (Glorot) and He initializers:
+//   RANDOM_FLOAT      uniform in [-1, 1]
+//   NORMAL            N(0, 1)
+//   TRUNCATED_NORMAL  N(0, 1), redrawn beyond 2
+//   XAVIER_UNIFORM    uniform in +-sqrt(6 / (fan in + fan out))
+//   XAVIER_NORMAL     N(0, 2 / (fan in + fan out))
+//   HE_UNIFORM        uniform in +-sqrt(6 / fan in)
+//   HE_NORMAL         N(0, 2 / fan in)
 enum class fill_type
 {
     RANDOM_FLOAT,
     SEQUENCE,
-    ZERO
+    ZERO,
+    NORMAL,
+    TRUNCATED_NORMAL,
+    XAVIER_UNIFORM,
+    XAVIER_NORMAL,
+    HE_UNIFORM,
+    HE_NORMAL
 };
 
+// Values drawn from each stream of a random fill
+constexpr long random_fill_block = 4096;
+
+// Buffers start on a cache line, which is also an AVX-512 register
+constexpr size_t matrix_alignment = 64;
+
+// Uninitialized array of n elements on a matrix_alignment boundary
+template <typename T>
+std::shared_ptr<T[]> aligned_array(size_t n)
+{
+    static_assert(std::is_trivially_copyable<T>::value
+                  && std::is_trivially_destructible<T>::value,
+                  "Matrix elements are never constructed nor destroyed");
+
+    size_t bytes = (n * sizeof(T) + matrix_alignment - 1) / matrix_alignment * matrix_alignment;
+    if (bytes == 0)
+        bytes = matrix_alignment;
+    void* memory = std::aligned_alloc(matrix_alignment, bytes);
+    if (memory == nullptr)
+        throw std::bad_alloc();
+    return std::shared_ptr<T[]>(static_cast<T*>(memory), [](T* p) { std::free(p); });
+}
+
+// dst (cols x rows) = src^T (rows x cols), rows being ld_src and ld_dst
+// elements apart. Goes tile by tile, so that the lines read and the lines
+// written both stay in L1 instead of striding over the whole destination.
+template <typename T>
+void transpose_blocked(T* dst, long ld_dst, const T* src, long ld_src, int rows, int cols)
+{
+    constexpr int tile = 32;
+    for (int i0 = 0; i0 < rows; i0 += tile)
+    {
+        const int i1 = std::min(i0 + tile, rows);
+        for (int j0 = 0; j0 < cols; j0 += tile)
+        {
+            const int j1 = std::min(j0 + tile, cols);
+            for (int i = i0; i < i1; ++i)
+                for (int j = j0; j < j1; ++j)
+                    dst[j * ld_dst + i] = src[i * ld_src + j];
+        }
+    }
+}
+
+// Row-major matrix handle. Copies share the data, like the views returned
+// by prefix() and Workspace::slot(); clone() makes a deep copy. See
+// matrix_view.hh for strided views.
 template <typename T>
 class Matrix
 {
@@ -30,9 +105,10 @@ public:
         cols_ = 0;
     }
 
+    // Uninitialized, aligned on matrix_alignment
     Matrix(int rows, int cols) : rows_(rows), cols_(cols)
     {
-        data_ = std::shared_ptr<T[]>(new T[cols_ * rows_]);
+        data_ = aligned_array<T>(static_cast<size_t>(rows) * cols);
     }
 
     Matrix(const Matrix<T>& m)
@@ -50,6 +126,38 @@ public:
         return *this;
     }
 
+    // Takes the data without touching its reference count; m is left empty
+    Matrix(Matrix<T>&& m) noexcept
+        : rows_(m.rows_), cols_(m.cols_), data_(std::move(m.data_))
+    {
+        m.rows_ = 0;
+        m.cols_ = 0;
+    }
+
+    Matrix& operator=(Matrix<T>&& m) noexcept
+    {
+        if (this != &m)
+        {
+            data_ = std::move(m.data_);
+            rows_ = m.rows_;
+            cols_ = m.cols_;
+            m.rows_ = 0;
+            m.cols_ = 0;
+        }
+        return *this;
+    }
+
+    // Deep copy, in a new aligned buffer
+    Matrix<T> clone(void) const
+    {
+        if (data_ == nullptr)
+            return Matrix();
+        Matrix copy(rows_, cols_);
+        std::copy(data_.get(), data_.get() + static_cast<size_t>(rows_) * cols_,
+                  copy.data_.get());
+        return copy;
+    }
+
     // Lazy constructor for performance reason
     // TODO useful ?
     Matrix(T* array, int height, int width) : rows_(height), cols_(width)
@@ -57,6 +165,40 @@ public:
         data_ = std::shared_ptr<T[]>(array);
     }
 
+    // Evaluates a lazy expression in a single loop, see expression.hh
+    template <typename E>
+    Matrix(const MatrixExpr<E>& e) : Matrix(e.get_rows(), e.get_cols())
+    {
+        evaluate_expr(e.self(), data_.get());
+    }
+
+    // Like copy assignment, binds this to a new buffer holding the result
+    template <typename E>
+    Matrix& operator=(const MatrixExpr<E>& e)
+    {
+        Matrix result(e);
+        return *this = result;
+    }
+
+    // Evaluates e into the existing buffer of this. e must not contain a
+    // transpose of this matrix.
+    template <typename E>
+    Matrix& assign(const MatrixExpr<E>& e)
+    {
+        if (e.get_rows() != rows_ || e.get_cols() != cols_)
+            throw std::invalid_argument("Invalid matrix shape");
+        evaluate_expr(e.self(), data_.get());
+        return *this;
+    }
+
+    MatrixLeaf<T> lazy(void) const { return MatrixLeaf<T>(*this); }
+
+    // View over memory kept alive by owner, e.g. a slot of a Workspace.
+    // Shares ownership without allocating.
+    Matrix(const std::shared_ptr<T[]>& owner, T* data, int rows, int cols)
+        : rows_(rows), cols_(cols), data_(owner, data)
+    {}
+
     virtual ~Matrix() = default;
 
     void fill(std::function<T(void)> value_initializer)
@@ -69,44 +211,118 @@ public:
     void fill(T value)
     {
         assert(data_ != nullptr);
-        for (int i = 0; i < rows_ * cols_; ++i)
-            data_[i] = value;
+        ElementwiseKernels<T>::get().fill(data_.get(), value, rows_ * cols_);
     }
 
+    // Random fills draw their seed from the calling thread's engine, see
+    // set_random_seed
     void fill(fill_type type)
+    {
+        fill(type, type == fill_type::SEQUENCE || type == fill_type::ZERO ? 0 : random_engine()());
+    }
+
+    // Block b of random_fill_block values is drawn from stream b of seed,
+    // so the blocks are filled in parallel and the values do not depend on
+    // the number of threads
+    void fill(fill_type type, uint64_t seed)
     {
         assert(data_ != nullptr);
-        switch(type)
+        const long size = static_cast<long>(rows_) * cols_;
+        T* data = data_.get();
+        if (type == fill_type::SEQUENCE)
         {
+            for (long i = 0; i < size; ++i)
+                data[i] = i;
+            return;
+        }
+        if (type == fill_type::ZERO)
+        {
+            fill(static_cast<T>(0));
+            return;
+        }
+
+        const double fan_in = cols_;
+        const double fan_out = rows_;
+        double scale = 1;
+        double limit = std::numeric_limits<double>::infinity();
+        bool normal = true;
+        switch (type)
+        {
+            case fill_type::TRUNCATED_NORMAL:
+                limit = 2;
+                break;
+            case fill_type::XAVIER_NORMAL:
+                scale = std::sqrt(2 / (fan_in + fan_out));
+                break;
+            case fill_type::HE_NORMAL:
+                scale = std::sqrt(2 / fan_in);
+                break;
             case fill_type::RANDOM_FLOAT:
-                for (int i = 0; i < rows_ * cols_; ++i)
-                    data_[i] = get_random_float();
+                normal = false;
                 break;
-            case fill_type::SEQUENCE:
-                for (int i = 0; i < rows_ * cols_; ++i)
-                    data_[i] = i;
+            case fill_type::XAVIER_UNIFORM:
+                scale = std::sqrt(6 / (fan_in + fan_out));
+                normal = false;
                 break;
-            case fill_type::ZERO:
-                for (int i = 0; i < rows_ * cols_; ++i)
-                    data_[i] = static_cast<T>(0);
+            case fill_type::HE_UNIFORM:
+                scale = std::sqrt(6 / fan_in);
+                normal = false;
+                break;
+            default:
                 break;
         }
+
+        const int nb_blocks = (size + random_fill_block - 1) / random_fill_block;
+        auto fill_block = [=](int b) {
+            Random random(seed, b);
+            const long end = std::min(size, (b + 1) * random_fill_block);
+            for (long i = b * random_fill_block; i < end; ++i)
+                data[i] = static_cast<T>(scale * (normal ? random.normal(limit)
+                                                         : random.uniform(-1, 1)));
+        };
+        // Small matrices are not worth waking the pool
+        if (nb_blocks >= 16)
+            ThreadPool::global().parallel_for(nb_blocks, fill_block);
+        else
+            for (int b = 0; b < nb_blocks; ++b)
+                fill_block(b);
     }
 
-    Matrix<T>& map_inplace(std::function<T(T)> value_initializer)
+    // Any callable works; lambdas are inlined into the loop and can be
+    // vectorized, std::function still goes through an indirect call.
+    template <typename F>
+    Matrix<T>& map_inplace(F&& value_initializer)
     {
         assert(data_ != nullptr);
+        T* data = data_.get();
         for (int i = 0; i < rows_ * cols_; ++i)
-            data_[i] = value_initializer(data_[i]);
+            data[i] = value_initializer(data[i]);
         return *this;
     }
 
-    Matrix<T> map(std::function<T(T)> value_initializer) const
+    // this[i] = f(this[i], other[i])
+    template <typename F>
+    Matrix<T>& map_inplace(const Matrix& other, F&& f)
+    {
+        if (rows_ != other.rows_ || cols_ != other.cols_)
+            throw std::invalid_argument("Invalid matrix shape");
+
+        T* data = data_.get();
+        const T* src = other.data_.get();
+        for (int i = 0; i < rows_ * cols_; ++i)
+            data[i] = f(data[i], src[i]);
+        return *this;
+    }
+
+    template <typename F>
+    Matrix<T> map(F&& value_initializer) const
     {
         assert(data_ != nullptr);
         Matrix<T> result(rows_, cols_);
+        const T* src = data_.get();
+        T* dst = result.data_.get();
         for (int i = 0; i < rows_ * cols_; ++i)
-            result.data_[i] = value_initializer(data_[i]);
+            dst[i] = value_initializer(src[i]);
         return result;
     }
 
@@ -126,34 +342,30 @@ public:
     {
         if (cols_ != right.cols_ || rows_ != right.rows_)
             throw std::invalid_argument("+ on Matrix need same width and height");
-        for (int i = 0; i < rows_; ++i)
-        {
-            for (int j = 0; j < cols_; ++j)
-                if ((*this)(i, j) != right(i, j))
-                    return false;
-        }
+        for (int i = 0; i < rows_ * cols_; ++i)
+            if (data_[i] != right.data_[i])
+                return false;
         return true;
     }
 
     Matrix<T>& multiply_inplace(const Matrix& b)
     {
         if (rows_ != b.rows_ || cols_ != b.cols_)
-            throw "Invalid matrix shape";
-
-        for (int i = 0; i < rows_ * cols_; i++)
-            data_[i] *= b.data_[i];
+            throw std::invalid_argument("Invalid matrix shape");
 
+        ElementwiseKernels<T>::get().mul(data_.get(), data_.get(), b.data_.get(),
+                                         rows_ * cols_);
         return *this;
     }
 
     static Matrix<T> multiply(const Matrix& a, const Matrix& b)
     {
         if (a.rows_ != b.rows_ || a.cols_ != b.cols_)
-            throw "Invalid matrix shape";
+            throw std::invalid_argument("Invalid matrix shape");
 
-        Matrix res(a);
-        for (int i = 0; i < a.rows_ * a.cols_; i++)
-            res.data_[i] *= b.data_[i];
+        Matrix res(a.rows_, a.cols_);
+        ElementwiseKernels<T>::get().mul(res.data_.get(), a.data_.get(), b.data_.get(),
+                                         a.rows_ * a.cols_);
         return res;
     }
 
@@ -164,64 +376,51 @@ public:
 
     static Matrix<T> dot(const Matrix& left, const Matrix &right, transpose order)
     {
-        if (left.cols_ == right.rows_)
-        {
-            Matrix result(left.rows_, right.cols_);
-            float sum = 0.0f;
-            for (int y = 0; y < left.rows_; ++y)
-            {
-                for (int x = 0; x < right.cols_; ++x)
-                {
-                    for (int k = 0; k < left.cols_; k++)
-                        sum += left(y, k) * right(k, x);
-                    result(y, x) = sum;
-                    sum = 0;
-                }
-            }
-            return result;
-        }
-        else if (left.rows_ == right.rows_ && order == transpose::LEFT) // Implicit left transpose
-        {
-            Matrix result(left.cols_, right.cols_);
-            float sum = 0.0f;
-            for (int x = 0; x < left.cols_; ++x)
-            {
-                for (int y = 0; y < right.cols_; ++y)
-                {
-                    for (int k = 0; k < left.rows_; k++)
-                        sum += left(k, x) * right(k, y);
-                    result(x, y) = sum;
-                    sum = 0;
-                }
-            }
-            return result;
-        }
-        else if (left.cols_ == right.cols_ && order == transpose::RIGHT) // Implicit right transpose
+        Matrix result;
+        dot_into(result, left, right, order);
+        return result;
+    }
+
+    // out = op(left) * op(right), or += when accumulate. out is reallocated
+    // only if its shape does not match. ep(row, col, out_row, n) is run on
+    // each finished row segment of out, see Gemm.
+    template <typename Epilogue = NoEpilogue<T>>
+    static void dot_into(Matrix& out, const Matrix& left, const Matrix& right,
+                         transpose order, bool accumulate = false,
+                         const Epilogue& ep = Epilogue())
+    {
+        bool trans_left = order == transpose::LEFT;
+        bool trans_right = order == transpose::RIGHT;
+
+        int m = trans_left ? left.cols_ : left.rows_;
+        int k = trans_left ? left.rows_ : left.cols_;
+        int k_right = trans_right ? right.cols_ : right.rows_;
+        int n = trans_right ? right.rows_ : right.cols_;
+        if (k != k_right)
+            throw std::invalid_argument("Bad Matrix multiplication");
+
+        if (out.rows_ != m || out.cols_ != n || out.data_ == nullptr)
         {
-            Matrix result(left.rows_, right.rows_);
-            float sum = 0.0f;
-            for (int y = 0; y < left.rows_; ++y)
-            {
-                for (int x = 0; x < right.rows_; ++x)
-                {
-                    for (int k = 0; k < right.cols_; k++)
-                        sum += left(y, k) * right(x, k);
-                    result(y, x) = sum;
-                    sum = 0;
-                }
-            }
-            return result;
+            if (accumulate)
+                throw std::invalid_argument("Bad accumulator shape");
+            out = Matrix(m, n);
         }
-        else
-            throw std::invalid_argument("Bad Matrix multiplication");
+
+        Gemm<T>::compute(trans_left, trans_right, m, n, k,
+                         left.data_.get(), left.cols_,
+                         right.data_.get(), right.cols_,
+                         out.data_.get(), out.cols_, accumulate, ep);
+    }
+
+    friend Matrix<T> operator*(const Matrix& left, const Matrix& right)
+    {
+        return dot(left, right);
     }
 
     Matrix<T> transpose(void) const
     {
         Matrix trans(cols_, rows_);
-        for (int y = 0; y < rows_; ++y)
-            for (int x = 0; x < cols_; ++x)
-                trans(x, y) = (*this)(y, x);
+        transpose_blocked(trans.data_.get(), rows_, data_.get(), cols_, rows_, cols_);
         return trans;
     }
 
@@ -229,46 +428,175 @@ public:
     {
         if (cols_ != right.cols_ || rows_ != right.rows_)
             throw std::invalid_argument("+ on Matrix need same width and height");
-        for (int i = 0; i < rows_; ++i)
-        {
-            for (int j = 0; j < cols_; ++j)
-                (*this)(i, j) += right(i, j);
-        }
+
+        ElementwiseKernels<T>::get().add(data_.get(), data_.get(), right.data_.get(),
+                                         rows_ * cols_);
         return *this;
     }
 
     Matrix<T>& operator-=(const Matrix& right)
     {
         if (cols_ != right.cols_ || rows_ != right.rows_)
+            throw std::invalid_argument("- on Matrix need same width and height");
+
+        ElementwiseKernels<T>::get().sub(data_.get(), data_.get(), right.data_.get(),
+                                         rows_ * cols_);
+        return *this;
+    }
+
+    // Two plain matrices add and subtract eagerly, so that auto c = a - b
+    // is a copy; start from lazy() to build an expression instead
+    friend Matrix<T> operator+(const Matrix& left, const Matrix& right)
+    {
+        if (left.cols_ != right.cols_ || left.rows_ != right.rows_)
             throw std::invalid_argument("+ on Matrix need same width and height");
 
+        Matrix result(left.rows_, left.cols_);
+        ElementwiseKernels<T>::get().add(result.data_.get(), left.data_.get(),
+                                         right.data_.get(), left.rows_ * left.cols_);
+        return result;
+    }
+
+    friend Matrix<T> operator-(const Matrix& left, const Matrix& right)
+    {
+        if (left.cols_ != right.cols_ || left.rows_ != right.rows_)
+            throw std::invalid_argument("- on Matrix need same width and height");
+
+        Matrix result(left.rows_, left.cols_);
+        ElementwiseKernels<T>::get().sub(result.data_.get(), left.data_.get(),
+                                         right.data_.get(), left.rows_ * left.cols_);
+        return result;
+    }
+
+    template <typename E>
+    Matrix<T>& operator+=(const MatrixExpr<E>& right)
+    {
+        return assign(lazy() + right.self());
+    }
+
+    template <typename E>
+    Matrix<T>& operator-=(const MatrixExpr<E>& right)
+    {
+        return assign(lazy() - right.self());
+    }
+
+    // Broadcast a rows x 1 column over every column, e.g. biases over a batch
+    Matrix<T>& add_to_columns(const Matrix& column)
+    {
+        if (column.rows_ != rows_ || column.cols_ != 1)
+            throw std::invalid_argument("Broadcast column must be rows x 1");
+
+        T* data = data_.get();
+        const T* col = column.data_.get();
         for (int i = 0; i < rows_; ++i)
         {
+            const T v = col[i];
             for (int j = 0; j < cols_; ++j)
-                (*this)(i, j) -= right(i, j);
+                data[i * cols_ + j] += v;
         }
         return *this;
     }
 
-    Matrix<T> operator-(const Matrix& right)
+    // Sum of all columns, as a rows x 1 column (reduction over a batch)
+    Matrix<T> sum_columns(void) const
     {
-        if (cols_ != right.cols_ || rows_ != right.rows_)
-            throw std::invalid_argument("+ on Matrix need same width and height");
+        Matrix result(rows_, 1);
+        result.fill(fill_type::ZERO);
+        result.add_column_sums(*this);
+        return result;
+    }
+
+    // this (rows x 1) += sum of all columns of m
+    Matrix<T>& add_column_sums(const Matrix& m)
+    {
+        if (m.rows_ != rows_ || cols_ != 1)
+            throw std::invalid_argument("Column sums need a rows x 1 target");
 
-        Matrix result(rows_, cols_);
+        const T* src = m.data_.get();
         for (int i = 0; i < rows_; ++i)
         {
-            for (int j = 0; j < cols_; ++j)
-            {
-                result(i, j) = (*this)(i, j);
-                result(i, j) -= right(i, j);
-            }
+            T sum = static_cast<T>(0);
+            for (int j = 0; j < m.cols_; ++j)
+                sum += src[i * m.cols_ + j];
+            data_[i] += sum;
         }
+        return *this;
+    }
+
+    // View over the first rows * cols elements with a new shape, e.g. a
+    // smaller batch in a buffer planned for a larger one
+    Matrix<T> prefix(int rows, int cols) const
+    {
+        if (rows * cols > rows_ * cols_)
+            throw std::invalid_argument("prefix larger than Matrix");
+        return Matrix(data_, data_.get(), rows, cols);
+    }
+
+    // Rows [begin, end), sharing the data: contiguous, so a full Matrix
+    Matrix<T> row_range(int begin, int end) const
+    {
+        if (begin < 0 || begin > end || end > rows_)
+            throw std::invalid_argument("Bad row range");
+        return Matrix(data_, data_.get() + static_cast<size_t>(begin) * cols_, end - begin, cols_);
+    }
+
+    // Concatenates samples[begin, end) side by side; all must have the same
+    // number of rows. Used to turn column samples into a rows x batch matrix.
+    static Matrix<T> hstack(const std::vector<Matrix>& samples, size_t begin, size_t end)
+    {
+        if (begin >= end || end > samples.size())
+            throw std::invalid_argument("Bad hstack range");
+
+        int cols = 0;
+        for (size_t s = begin; s < end; ++s)
+            cols += samples[s].cols_;
+
+        Matrix result(samples[begin].rows_, cols);
+        hstack_into(result, samples, begin, end);
         return result;
     }
 
+    // hstack into an existing matrix of the right shape
+    static void hstack_into(Matrix& out, const std::vector<Matrix>& samples,
+                            size_t begin, size_t end)
+    {
+        if (begin >= end || end > samples.size())
+            throw std::invalid_argument("Bad hstack range");
+
+        const int rows = out.rows_;
+        const int cols = out.cols_;
+        T* dst = out.data_.get();
+        int offset = 0;
+        for (size_t s = begin; s < end; ++s)
+        {
+            const Matrix& m = samples[s];
+            if (m.rows_ != rows || offset + m.cols_ > cols)
+                throw std::invalid_argument("hstack on Matrix need same height");
+            for (int i = 0; i < rows; ++i)
+                for (int j = 0; j < m.cols_; ++j)
+                    dst[i * cols + offset + j] = m.data_[i * m.cols_ + j];
+            offset += m.cols_;
+        }
+        if (offset != cols)
+            throw std::invalid_argument("hstack on Matrix need same width");
+    }
+
+    // Copies columns [begin, begin + out.cols) of m into out, which has the
+    // same number of rows
+    static void columns_into(Matrix& out, const Matrix& m, int begin)
+    {
+        if (out.rows_ != m.rows_ || begin < 0 || begin + out.cols_ > m.cols_)
+            throw std::invalid_argument("Bad column range");
+        for (int i = 0; i < out.rows_; ++i)
+            std::copy(m.data_.get() + i * m.cols_ + begin,
+                      m.data_.get() + i * m.cols_ + begin + out.cols_,
+                      out.data_.get() + i * out.cols_);
+    }
+
     int get_cols(void) const { return cols_; }
     int get_rows(void) const { return rows_; }
+    T* get_data(void) { return data_.get(); }
+    const T* get_data(void) const { return data_.get(); }
 
     friend std::ostream& operator<<(std::ostream& os, Matrix& m)
     {
@@ -286,13 +614,4 @@ private:
     int rows_;
     int cols_;
     std::shared_ptr<T[]> data_;
-
-    float get_random_float(void)
-    {
-        static constexpr float min_rand_value = -1.0f;
-        static constexpr float max_rand_value = 1.0f;
-        return min_rand_value
-                + static_cast <float>(rand()) /
-                    (static_cast<float>(RAND_MAX/(max_rand_value-min_rand_value)));
-    }
 };
@@ -0,0 +1,121 @@
+#pragma once
+
+#include <stdexcept>
+#include <type_traits>
+
+#include "matrix.hh"
+
+// Non-owning strided window over matrix data: element (i, j) is at
+// data[i * row_stride + j * col_stride]. Slicing and transposing only
+// change the strides, nothing is copied; to_matrix() copies into a
+// contiguous Matrix. A view is valid as long as the data it points to, so
+// keep the Matrix (or one of its copies) alive meanwhile.
+//
+//   MatrixView<const float> batch(x);        // x is features x batch
+//   Matrix<float> sample = batch.col(3).to_matrix();
+//
+// T may be const, for views over a const Matrix.
+template <typename T>
+class MatrixView
+{
+public:
+    using value_type = std::remove_const_t<T>;
+
+    MatrixView(T* data, int rows, int cols, long row_stride, long col_stride = 1)
+        : data_(data), rows_(rows), cols_(cols), row_stride_(row_stride), col_stride_(col_stride)
+    {}
+
+    // Whole matrix; a const Matrix only gives a MatrixView<const T>
+    template <typename M, typename = std::enable_if_t<
+        std::is_same<std::remove_const_t<M>, Matrix<value_type>>::value>>
+    MatrixView(M& m)
+        : MatrixView(m.get_data(), m.get_rows(), m.get_cols(), m.get_cols())
+    {}
+
+    T& operator()(int i, int j) const { return data_[i * row_stride_ + j * col_stride_]; }
+
+    MatrixView row(int i) const { return block(i, 0, 1, cols_); }
+    MatrixView col(int j) const { return block(0, j, rows_, 1); }
+
+    // rows x cols window whose first element is (i, j)
+    MatrixView block(int i, int j, int rows, int cols) const
+    {
+        if (i < 0 || j < 0 || rows < 0 || cols < 0 || i + rows > rows_ || j + cols > cols_)
+            throw std::invalid_argument("View out of the matrix");
+        return MatrixView(data_ + i * row_stride_ + j * col_stride_, rows, cols,
+                          row_stride_, col_stride_);
+    }
+
+    // Transpose, by swapping the strides
+    MatrixView t(void) const
+    {
+        return MatrixView(data_, cols_, rows_, col_stride_, row_stride_);
+    }
+
+    // Same layout as a Matrix of this shape
+    bool is_contiguous(void) const
+    {
+        return (col_stride_ == 1 || cols_ <= 1) && (row_stride_ == cols_ || rows_ <= 1);
+    }
+
+    // Contiguous copy. A transposed view of contiguous rows goes through
+    // the blocked transpose.
+    Matrix<value_type> to_matrix(void) const
+    {
+        Matrix<value_type> m(rows_, cols_);
+        copy_to(m.get_data());
+        return m;
+    }
+
+    // Copies from a view of the same shape
+    template <typename U>
+    void assign(const MatrixView<U>& other) const
+    {
+        static_assert(!std::is_const<T>::value, "Cannot assign through a const view");
+        if (other.get_rows() != rows_ || other.get_cols() != cols_)
+            throw std::invalid_argument("Invalid matrix shape");
+        for (int i = 0; i < rows_; ++i)
+            for (int j = 0; j < cols_; ++j)
+                (*this)(i, j) = other(i, j);
+    }
+
+    void fill(value_type value) const
+    {
+        static_assert(!std::is_const<T>::value, "Cannot fill a const view");
+        for (int i = 0; i < rows_; ++i)
+            for (int j = 0; j < cols_; ++j)
+                (*this)(i, j) = value;
+    }
+
+    T* get_data(void) const { return data_; }
+    int get_rows(void) const { return rows_; }
+    int get_cols(void) const { return cols_; }
+    long get_row_stride(void) const { return row_stride_; }
+    long get_col_stride(void) const { return col_stride_; }
+
+private:
+    // Into rows_ x cols_ contiguous elements
+    void copy_to(value_type* dst) const
+    {
+        if (col_stride_ == 1)
+        {
+            for (int i = 0; i < rows_; ++i)
+                std::copy(data_ + i * row_stride_, data_ + i * row_stride_ + cols_,
+                          dst + static_cast<long>(i) * cols_);
+        }
+        else if (row_stride_ == 1)
+            transpose_blocked(dst, cols_, data_, col_stride_, cols_, rows_);
+        else
+        {
+            for (int i = 0; i < rows_; ++i)
+                for (int j = 0; j < cols_; ++j)
+                    dst[static_cast<long>(i) * cols_ + j] = (*this)(i, j);
+        }
+    }
+
+    T* data_;
+    int rows_;
+    int cols_;
+    long row_stride_;
+    long col_stride_;
+};
@@ -0,0 +1,161 @@
+#pragma once
+
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <mutex>
+#include <random>
+
+// Random numbers for initializing parameters and test data. Random is
+// xoshiro256** (Blackman and Vigna): 256 bits of state, a few shifts and
+// rotations per 64-bit draw, no lock. A seed has independent streams, so
+// that block b of a parallel fill draws the same values whatever thread
+// runs it, see Matrix::fill.
+
+// Finalizer of splitmix64: a bijection that spreads every input bit
+inline uint64_t splitmix64_mix(uint64_t x)
+{
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+}
+
+// Seed of stream n of seed, e.g. one per layer or per block
+inline uint64_t derive_seed(uint64_t seed, uint64_t n)
+{
+    return splitmix64_mix(seed ^ splitmix64_mix(n + 1));
+}
+
+class Random
+{
+public:
+    explicit Random(uint64_t seed = 0, uint64_t stream = 0) { this->seed(seed, stream); }
+
+    // The state is the splitmix64 sequence from the derived seed, as the
+    // authors recommend, which is never all zeros
+    void seed(uint64_t seed, uint64_t stream = 0)
+    {
+        uint64_t x = derive_seed(seed, stream);
+        for (uint64_t& s : state_)
+        {
+            x += 0x9e3779b97f4a7c15ull;
+            s = splitmix64_mix(x);
+        }
+        has_spare_ = false;
+    }
+
+    uint64_t operator()(void)
+    {
+        const uint64_t result = rotl(state_[1] * 5, 7) * 9;
+        const uint64_t t = state_[1] << 17;
+        state_[2] ^= state_[0];
+        state_[3] ^= state_[1];
+        state_[1] ^= state_[2];
+        state_[0] ^= state_[3];
+        state_[2] ^= t;
+        state_[3] = rotl(state_[3], 45);
+        return result;
+    }
+
+    // Uniform in [0, 1), from the top 53 bits
+    double uniform(void) { return ((*this)() >> 11) * 0x1.0p-53; }
+
+    double uniform(double low, double high) { return low + (high - low) * uniform(); }
+
+    // Standard normal, redrawn until within limit standard deviations.
+    // Marsaglia's polar method: two values per point drawn in the unit
+    // disk, for one log and no trigonometry.
+    double normal(double limit = std::numeric_limits<double>::infinity())
+    {
+        for (;;)
+        {
+            double x = spare_;
+            if (!has_spare_)
+            {
+                double u;
+                double v;
+                double s;
+                do
+                {
+                    u = uniform(-1, 1);
+                    v = uniform(-1, 1);
+                    s = u * u + v * v;
+                } while (s >= 1 || s == 0);
+                const double scale = std::sqrt(-2 * std::log(s) / s);
+                x = u * scale;
+                spare_ = v * scale;
+            }
+            has_spare_ = !has_spare_;
+            if (std::abs(x) <= limit)
+                return x;
+        }
+    }
+
+private:
+    static uint64_t rotl(uint64_t x, int k) { return (x << k) | (x >> (64 - k)); }
+
+    uint64_t state_[4];
+    double spare_ = 0;
+    bool has_spare_ = false;
+};
+
+// Seed shared by the engines of all threads, from std::random_device until
+// set_random_seed
+struct RandomSeed
+{
+    RandomSeed() : seed((static_cast<uint64_t>(std::random_device()()) << 32)
+                        ^ std::random_device()()) {}
+
+    std::mutex mutex;
+    uint64_t seed;
+    // Streams handed out so far, and bumped on every set_random_seed
+    uint64_t next_stream = 1;
+    std::atomic<uint64_t> generation{ 1 };
+};
+
+inline RandomSeed& random_seed(void)
+{
+    static RandomSeed seed;
+    return seed;
+}
+
+struct ThreadRandom
+{
+    Random engine;
+    uint64_t generation = 0;
+};
+
+inline ThreadRandom& thread_random(void)
+{
+    thread_local ThreadRandom random;
+    return random;
+}
+
+// Engine of the calling thread. Each thread draws from its own stream of
+// the global seed, taken on its first draw after a new seed.
+inline Random& random_engine(void)
+{
+    ThreadRandom& random = thread_random();
+    RandomSeed& seed = random_seed();
+    if (random.generation != seed.generation.load(std::memory_order_acquire))
+    {
+        std::lock_guard<std::mutex> lock(seed.mutex);
+        random.engine.seed(seed.seed, seed.next_stream++);
+        random.generation = seed.generation.load(std::memory_order_relaxed);
+    }
+    return random.engine;
+}
+
+// Makes later draws reproducible: the calling thread restarts on stream 0
+// of seed, other threads on the next streams in the order they draw.
+inline void set_random_seed(uint64_t seed)
+{
+    RandomSeed& global = random_seed();
+    ThreadRandom& random = thread_random();
+    std::lock_guard<std::mutex> lock(global.mutex);
+    global.seed = seed;
+    global.next_stream = 1;
+    random.engine.seed(seed, 0);
+    random.generation = global.generation.fetch_add(1, std::memory_order_acq_rel) + 1;
+}
@@ -0,0 +1,211 @@
+#pragma once
+
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <type_traits>
+
+// Elementwise kernels (fill, +, -, *) compiled for several x86 instruction
+// sets and selected once, at first use, from what the CPU supports. Setting
+// PROPHECY_SIMD=scalar|sse2|avx2|avx512 caps the selected level.
+
+enum class simd_level
+{
+    SCALAR,
+    SSE2,
+    AVX2,
+    AVX512
+};
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define PROPHECY_SIMD_X86 1
+#else
+#define PROPHECY_SIMD_X86 0
+#endif
+
+inline simd_level detect_simd_level(void)
+{
+    simd_level level = simd_level::SCALAR;
+#if PROPHECY_SIMD_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+        level = simd_level::AVX512;
+    else if (__builtin_cpu_supports("avx2"))
+        level = simd_level::AVX2;
+    else if (__builtin_cpu_supports("sse2"))
+        level = simd_level::SSE2;
+#endif
+
+    const char* cap = std::getenv("PROPHECY_SIMD");
+    if (cap != nullptr)
+    {
+        std::string s(cap);
+        simd_level max = s == "scalar" ? simd_level::SCALAR
+                       : s == "sse2" ? simd_level::SSE2
+                       : s == "avx2" ? simd_level::AVX2
+                       : simd_level::AVX512;
+        if (max < level)
+            level = max;
+    }
+    return level;
+}
+
+inline simd_level active_simd_level(void)
+{
+    static const simd_level level = detect_simd_level();
+    return level;
+}
+
+struct simd_add
+{
+    template <typename V>
+    static void apply(V& dst, const V& a, const V& b) { dst = a + b; }
+};
+
+struct simd_sub
+{
+    template <typename V>
+    static void apply(V& dst, const V& a, const V& b) { dst = a - b; }
+};
+
+struct simd_mul
+{
+    template <typename V>
+    static void apply(V& dst, const V& a, const V& b) { dst = a * b; }
+};
+
+// Loop bodies shared by every instruction set: Bytes is the register width.
+// They are always inlined into a target-specific entry point below, so the
+// vector type is lowered to that instruction set's registers.
+template <typename T, int Bytes>
+struct SimdLoop
+{
+    typedef T vec __attribute__((vector_size(Bytes)));
+    static constexpr int width = Bytes / sizeof(T);
+
+    static inline __attribute__((always_inline))
+    void fill(T* dst, T value, int n)
+    {
+        vec v;
+        for (int l = 0; l < width; ++l)
+            v[l] = value;
+
+        int i = 0;
+        for (; i + width <= n; i += width)
+            std::memcpy(dst + i, &v, sizeof(vec));
+        for (; i < n; ++i)
+            dst[i] = value;
+    }
+
+    template <typename Op>
+    static inline __attribute__((always_inline))
+    void binary(T* dst, const T* a, const T* b, int n)
+    {
+        int i = 0;
+        for (; i + width <= n; i += width)
+        {
+            vec va;
+            vec vb;
+            vec vd;
+            std::memcpy(&va, a + i, sizeof(vec));
+            std::memcpy(&vb, b + i, sizeof(vec));
+            Op::apply(vd, va, vb);
+            std::memcpy(dst + i, &vd, sizeof(vec));
+        }
+        for (; i < n; ++i)
+            Op::apply(dst[i], a[i], b[i]);
+    }
+};
+
+template <typename T>
+void fill_scalar(T* dst, T value, int n)
+{
+    for (int i = 0; i < n; ++i)
+        dst[i] = value;
+}
+
+template <typename T, typename Op>
+void binary_scalar(T* dst, const T* a, const T* b, int n)
+{
+    for (int i = 0; i < n; ++i)
+        Op::apply(dst[i], a[i], b[i]);
+}
+
+#if PROPHECY_SIMD_X86
+template <typename T>
+__attribute__((target("sse2")))
+void fill_sse2(T* dst, T value, int n) { SimdLoop<T, 16>::fill(dst, value, n); }
+
+template <typename T, typename Op>
+__attribute__((target("sse2")))
+void binary_sse2(T* dst, const T* a, const T* b, int n)
+{
+    SimdLoop<T, 16>::template binary<Op>(dst, a, b, n);
+}
+
+template <typename T>
+__attribute__((target("avx2")))
+void fill_avx2(T* dst, T value, int n) { SimdLoop<T, 32>::fill(dst, value, n); }
+
+template <typename T, typename Op>
+__attribute__((target("avx2")))
+void binary_avx2(T* dst, const T* a, const T* b, int n)
+{
+    SimdLoop<T, 32>::template binary<Op>(dst, a, b, n);
+}
+
+template <typename T>
+__attribute__((target("avx512f")))
+void fill_avx512(T* dst, T value, int n) { SimdLoop<T, 64>::fill(dst, value, n); }
+
+template <typename T, typename Op>
+__attribute__((target("avx512f")))
+void binary_avx512(T* dst, const T* a, const T* b, int n)
+{
+    SimdLoop<T, 64>::template binary<Op>(dst, a, b, n);
+}
+#endif
+
+// Dispatch table for one element type. Output may alias either input.
+template <typename T>
+struct ElementwiseKernels
+{
+    void (*fill)(T* dst, T value, int n);
+    void (*add)(T* dst, const T* a, const T* b, int n);
+    void (*sub)(T* dst, const T* a, const T* b, int n);
+    void (*mul)(T* dst, const T* a, const T* b, int n);
+
+    // Table for a given level, or the scalar one if T has no vector kernels
+    static ElementwiseKernels<T> for_level(simd_level level)
+    {
+#if PROPHECY_SIMD_X86
+        if constexpr (std::is_same<T, float>::value || std::is_same<T, double>::value)
+        {
+            switch (level)
+            {
+                case simd_level::AVX512:
+                    return { fill_avx512<T>, binary_avx512<T, simd_add>,
+                             binary_avx512<T, simd_sub>, binary_avx512<T, simd_mul> };
+                case simd_level::AVX2:
+                    return { fill_avx2<T>, binary_avx2<T, simd_add>,
+                             binary_avx2<T, simd_sub>, binary_avx2<T, simd_mul> };
+                case simd_level::SSE2:
+                    return { fill_sse2<T>, binary_sse2<T, simd_add>,
+                             binary_sse2<T, simd_sub>, binary_sse2<T, simd_mul> };
+                case simd_level::SCALAR:
+                    break;
+            }
+        }
+#endif
+        (void) level;
+        return { fill_scalar<T>, binary_scalar<T, simd_add>,
+                 binary_scalar<T, simd_sub>, binary_scalar<T, simd_mul> };
+    }
+
+    // Table selected for this CPU
+    static const ElementwiseKernels<T>& get(void)
+    {
+        static const ElementwiseKernels<T> kernels = for_level(active_simd_level());
+        return kernels;
+    }
+};
@@ -0,0 +1,184 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <vector>
+
+#include "matrix.hh"
+#include "thread_pool.hh"
+
+// Compressed sparse row matrix, for pruned weights. Row i holds the values
+// values_[row_offsets_[i] .. row_offsets_[i + 1]) at columns cols_[...].
+//
+// Products are taken with a dense right operand (features x batch), so the
+// inner loops run over its contiguous rows:
+//   multiply:            out = A * B,   out_row_i += a_ij * B_row_j
+//   multiply_transposed: out = A^T * B, out_row_j += a_ij * B_row_i
+// Both take an epilogue ep(row, col, out_row, n) like Matrix::dot_into,
+// called once per finished row segment of out.
+template <typename T>
+class CsrMatrix
+{
+public:
+    CsrMatrix() = default;
+
+    // Entries of m whose magnitude is at least threshold; explicit zeros are
+    // always dropped
+    static CsrMatrix from_dense(const Matrix<T>& m, T threshold = 0)
+    {
+        CsrMatrix csr;
+        csr.rows_ = m.get_rows();
+        csr.cols_ = m.get_cols();
+        csr.row_offsets_.assign(1, 0);
+        const T* data = m.get_data();
+        for (int i = 0; i < csr.rows_; ++i)
+        {
+            for (int j = 0; j < csr.cols_; ++j)
+            {
+                const T v = data[i * csr.cols_ + j];
+                if (v != 0 && std::abs(v) >= threshold)
+                {
+                    csr.values_.push_back(v);
+                    csr.cols_index_.push_back(j);
+                }
+            }
+            csr.row_offsets_.push_back(csr.values_.size());
+        }
+        csr.values_.shrink_to_fit();
+        csr.cols_index_.shrink_to_fit();
+        return csr;
+    }
+
+    Matrix<T> to_dense(void) const
+    {
+        Matrix<T> m(rows_, cols_);
+        m.fill(fill_type::ZERO);
+        T* data = m.get_data();
+        for (int i = 0; i < rows_; ++i)
+            for (int p = row_offsets_[i]; p < row_offsets_[i + 1]; ++p)
+                data[i * cols_ + cols_index_[p]] = values_[p];
+        return m;
+    }
+
+    int get_rows(void) const { return rows_; }
+    int get_cols(void) const { return cols_; }
+    size_t nnz(void) const { return values_.size(); }
+
+    // Fraction of zeros
+    double sparsity(void) const
+    {
+        const double size = static_cast<double>(rows_) * cols_;
+        return size > 0 ? 1 - nnz() / size : 0;
+    }
+
+    // Storage of values and indices
+    size_t bytes(void) const
+    {
+        return values_.size() * sizeof(T) + cols_index_.size() * sizeof(int)
+               + row_offsets_.size() * sizeof(int);
+    }
+
+    T* values(void) { return values_.data(); }
+    const T* values(void) const { return values_.data(); }
+    const int* row_offsets(void) const { return row_offsets_.data(); }
+    const int* col_indices(void) const { return cols_index_.data(); }
+
+    template <typename Epilogue = NoEpilogue<T>>
+    void multiply(Matrix<T>& out, const Matrix<T>& b, const Epilogue& ep = Epilogue()) const
+    {
+        if (b.get_rows() != cols_)
+            throw std::invalid_argument("Bad Matrix multiplication");
+        const int n = b.get_cols();
+        reshape(out, rows_, n);
+        const T* b_data = b.get_data();
+        T* out_data = out.get_data();
+
+        // Rows of out are independent: split them across the pool
+        for_ranges(rows_, static_cast<long>(nnz()) * n, [&](int begin, int end) {
+            for (int i = begin; i < end; ++i)
+            {
+                T* out_row = out_data + static_cast<long>(i) * n;
+                std::fill(out_row, out_row + n, static_cast<T>(0));
+                for (int p = row_offsets_[i]; p < row_offsets_[i + 1]; ++p)
+                {
+                    const T v = values_[p];
+                    const T* b_row = b_data + static_cast<long>(cols_index_[p]) * n;
+                    for (int x = 0; x < n; ++x)
+                        out_row[x] += v * b_row[x];
+                }
+                ep(i, 0, out_row, n);
+            }
+        });
+    }
+
+    template <typename Epilogue = NoEpilogue<T>>
+    void multiply_transposed(Matrix<T>& out, const Matrix<T>& b,
+                             const Epilogue& ep = Epilogue()) const
+    {
+        if (b.get_rows() != rows_)
+            throw std::invalid_argument("Bad Matrix multiplication");
+        const int n = b.get_cols();
+        reshape(out, cols_, n);
+        const T* b_data = b.get_data();
+        T* out_data = out.get_data();
+
+        // Rows of A scatter into every row of out: split the columns instead
+        const int nb_blocks = std::max(1, std::min(n / 16, ThreadPool::global().get_nb_threads()));
+        for_ranges(nb_blocks, static_cast<long>(nnz()) * n, [&](int first, int last) {
+            for (int block = first; block < last; ++block)
+            {
+                const int begin = static_cast<long>(n) * block / nb_blocks;
+                const int end = static_cast<long>(n) * (block + 1) / nb_blocks;
+                for (int j = 0; j < cols_; ++j)
+                    std::fill(out_data + static_cast<long>(j) * n + begin,
+                              out_data + static_cast<long>(j) * n + end, static_cast<T>(0));
+                for (int i = 0; i < rows_; ++i)
+                {
+                    const T* b_row = b_data + static_cast<long>(i) * n;
+                    for (int p = row_offsets_[i]; p < row_offsets_[i + 1]; ++p)
+                    {
+                        const T v = values_[p];
+                        T* out_row = out_data + static_cast<long>(cols_index_[p]) * n;
+                        for (int x = begin; x < end; ++x)
+                            out_row[x] += v * b_row[x];
+                    }
+                }
+                for (int j = 0; j < cols_; ++j)
+                    ep(j, begin, out_data + static_cast<long>(j) * n + begin, end - begin);
+            }
+        });
+    }
+
+private:
+    // Same threshold as the dense product for going parallel
+    static constexpr long parallel_work = 128L * 128 * 128;
+
+    static void reshape(Matrix<T>& out, int rows, int cols)
+    {
+        if (out.get_data() == nullptr || out.get_rows() != rows || out.get_cols() != cols)
+            out = Matrix<T>(rows, cols);
+    }
+
+    // f(begin, end) over [0, count), on the pool when there is enough work
+    template <typename F>
+    static void for_ranges(int count, long work, const F& f)
+    {
+        ThreadPool& pool = ThreadPool::global();
+        if (pool.get_nb_threads() == 1 || work < parallel_work || count < 2)
+        {
+            f(0, count);
+            return;
+        }
+        const int nb_tasks = std::min(count, pool.get_nb_threads() * 4);
+        pool.parallel_for(nb_tasks, [&](int t) {
+            f(static_cast<long>(count) * t / nb_tasks, static_cast<long>(count) * (t + 1) / nb_tasks);
+        });
+    }
+
+    int rows_ = 0;
+    int cols_ = 0;
+    std::vector<int> row_offsets_;
+    std::vector<int> cols_index_;
+    std::vector<T> values_;
+};
@@ -0,0 +1,310 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdlib>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+// Persistent work-stealing pool. parallel_for(n, f) runs f(0..n-1) and
+// returns once all are done:
+// - the index range is split into one contiguous share per participant;
+// - each participant runs its own share from the front and, once it is
+//   empty, steals the back half of another participant's share;
+// - the calling thread takes part, so nested calls from inside a task
+//   cannot deadlock;
+// - the first exception thrown by a task is rethrown on the calling thread
+//   once every index has run.
+// Submitting work does not allocate.
+class ThreadPool
+{
+public:
+    // Shares per job; threads beyond this only steal
+    static constexpr int max_shares = 64;
+
+    // nb_threads counts the calling thread: nb_threads - 1 workers are started
+    explicit ThreadPool(int nb_threads)
+    {
+        jobs_.reserve(64);
+        start(nb_threads);
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        work_cv_.notify_all();
+        for (auto& worker : workers_)
+            worker.join();
+    }
+
+    int get_nb_threads(void) const { return nb_workers_.load() + 1; }
+
+    template <typename F>
+    void parallel_for(int n, F&& f)
+    {
+        if (n <= 0)
+            return;
+        if (n == 1 || nb_workers_.load() == 0)
+        {
+            for (int i = 0; i < n; ++i)
+                f(i);
+            return;
+        }
+
+        using Fn = std::remove_reference_t<F>;
+        Job job;
+        job.fn = [](void* ctx, int i) { (*static_cast<Fn*>(ctx))(i); };
+        job.ctx = const_cast<void*>(static_cast<const void*>(&f));
+        job.n = n;
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        // Held back while the workers are being replaced, unless nested in a
+        // task that the resize is waiting for
+        done_cv_.wait(lock, [this]() { return !resizing_ || task_depth() > 0; });
+        job.nb_shares = std::min({ n, get_nb_threads(), max_shares });
+        for (int s = 0; s < job.nb_shares; ++s)
+        {
+            job.shares[s].begin = static_cast<long>(n) * s / job.nb_shares;
+            job.shares[s].end = static_cast<long>(n) * (s + 1) / job.nb_shares;
+        }
+        jobs_.push_back(&job);
+        callers_++;
+        lock.unlock();
+        work_cv_.notify_all();
+
+        run(job);
+
+        // No new worker may join, then wait for those still running
+        lock.lock();
+        jobs_.erase(std::find(jobs_.begin(), jobs_.end(), &job));
+        done_cv_.wait(lock, [&job]() {
+            return job.done.load() == job.n && job.users == 0;
+        });
+        if (--callers_ == 0)
+            done_cv_.notify_all();
+        lock.unlock();
+
+        if (job.error)
+            std::rethrow_exception(job.error);
+    }
+
+    // Restarts the pool with nb_threads threads: new calls wait while the
+    // running ones return, then for the new workers. Must not be called
+    // from inside a task, which would wait for itself.
+    void resize(int nb_threads)
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        done_cv_.wait(lock, [this]() { return !resizing_; });
+        resizing_ = true;
+        done_cv_.wait(lock, [this]() { return callers_ == 0; });
+        stop_ = true;
+        lock.unlock();
+        work_cv_.notify_all();
+        for (auto& worker : workers_)
+            worker.join();
+
+        lock.lock();
+        workers_.clear();
+        stop_ = false;
+        start(nb_threads);
+        resizing_ = false;
+        lock.unlock();
+        done_cv_.notify_all();
+    }
+
+    // Shared pool, sized from PROPHECY_THREADS or the hardware. Built once
+    // by whichever thread gets there first; the others wait for it.
+    static ThreadPool& global(void)
+    {
+        static ThreadPool pool(default_nb_threads());
+        return pool;
+    }
+
+    // Resizes the shared pool in place, so references to it stay valid;
+    // safe while other threads are using it
+    static void set_global_threads(int nb_threads)
+    {
+        global().resize(std::max(1, nb_threads));
+    }
+
+    static int default_nb_threads(void)
+    {
+        const char* env = std::getenv("PROPHECY_THREADS");
+        if (env != nullptr && std::atoi(env) > 0)
+            return std::atoi(env);
+        return std::max(1u, std::thread::hardware_concurrency());
+    }
+
+private:
+    // Remaining indices [begin, end) of one participant
+    struct Share
+    {
+        std::atomic_flag lock = ATOMIC_FLAG_INIT;
+        int begin = 0;
+        int end = 0;
+
+        void acquire(void) { while (lock.test_and_set(std::memory_order_acquire)) {} }
+        void release(void) { lock.clear(std::memory_order_release); }
+    };
+
+    struct Job
+    {
+        void (*fn)(void*, int);
+        void* ctx;
+        int n;
+        Share shares[max_shares];
+        int nb_shares;
+        std::atomic<int> next_share{0}; // next share to hand to a participant
+        std::atomic<int> claimed{0};
+        std::atomic<int> done{0};
+        std::atomic<bool> failed{false};
+        std::exception_ptr error; // first exception, set by whoever fails first
+        int users = 0; // workers inside run(), guarded by mutex_
+    };
+
+    // Counts a task in task_depth() for as long as it runs, even if it throws
+    struct TaskScope
+    {
+        TaskScope() { task_depth()++; }
+        ~TaskScope() { task_depth()--; }
+        TaskScope(const TaskScope&) = delete;
+        TaskScope& operator=(const TaskScope&) = delete;
+    };
+
+    void start(int nb_threads)
+    {
+        for (int i = 1; i < nb_threads; ++i)
+            workers_.emplace_back([this]() { worker_loop(); });
+        nb_workers_.store(static_cast<int>(workers_.size()));
+    }
+
+    // Tasks running on the calling thread, counting nested ones
+    static int& task_depth(void)
+    {
+        thread_local int depth = 0;
+        return depth;
+    }
+
+    static bool has_work(const Job* job) { return job->claimed.load() < job->n; }
+
+    // Takes the front index of a share, or -1 if it is empty
+    static int pop(Share& share)
+    {
+        share.acquire();
+        int i = share.begin < share.end ? share.begin++ : -1;
+        share.release();
+        return i;
+    }
+
+    // Moves the back half of victim into own (which is empty); returns false
+    // if the victim had nothing left
+    static bool steal(Share& victim, Share& own)
+    {
+        victim.acquire();
+        int left = victim.end - victim.begin;
+        if (left <= 0)
+        {
+            victim.release();
+            return false;
+        }
+        int mid = victim.end - (left + 1) / 2;
+        int end = victim.end;
+        victim.end = mid;
+        victim.release();
+
+        own.acquire();
+        own.begin = mid;
+        own.end = end;
+        own.release();
+        return true;
+    }
+
+    void run(Job& job)
+    {
+        int s = job.next_share.fetch_add(1);
+        Share spare;
+        Share& own = s < job.nb_shares ? job.shares[s] : spare;
+        const int start = s % job.nb_shares;
+
+        while (has_work(&job))
+        {
+            int i = pop(own);
+            if (i >= 0)
+            {
+                job.claimed.fetch_add(1);
+                try
+                {
+                    TaskScope scope;
+                    job.fn(job.ctx, i);
+                }
+                catch (...)
+                {
+                    if (!job.failed.exchange(true))
+                        job.error = std::current_exception();
+                }
+                job.done.fetch_add(1);
+                continue;
+            }
+
+            bool stolen = false;
+            for (int v = 1; v <= job.nb_shares && !stolen; ++v)
+            {
+                Share& victim = job.shares[(start + v) % job.nb_shares];
+                if (&victim != &own)
+                    stolen = steal(victim, own);
+            }
+            if (!stolen)
+                return;
+        }
+    }
+
+    void worker_loop(void)
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (true)
+        {
+            Job* job = nullptr;
+            work_cv_.wait(lock, [this, &job]() {
+                // Latest job first: innermost when calls are nested
+                for (auto it = jobs_.rbegin(); it != jobs_.rend(); ++it)
+                {
+                    if (has_work(*it))
+                    {
+                        job = *it;
+                        return true;
+                    }
+                }
+                return stop_;
+            });
+            if (job == nullptr)
+                return;
+
+            job->users++;
+            lock.unlock();
+            run(*job);
+            lock.lock();
+            if (--job->users == 0)
+                done_cv_.notify_all();
+        }
+    }
+
+    std::vector<std::thread> workers_;
+    std::vector<Job*> jobs_;
+    std::mutex mutex_;
+    std::condition_variable work_cv_;
+    std::condition_variable done_cv_;
+    std::atomic<int> nb_workers_{0};
+    int callers_ = 0; // parallel_for calls using the workers
+    bool resizing_ = false;
+    bool stop_ = false;
+};
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+
+#include "matrix.hh"
+
+// Arena holding every temporary of a training step in one aligned block.
+// Users first reserve() the shapes they need, then allocate() once, then
+// fetch their slots as Matrix views which share ownership of the block
+// without any further allocation.
+template <typename T>
+class Workspace
+{
+public:
+    static constexpr size_t alignment = matrix_alignment;
+
+    Workspace() = default;
+
+    // Plans a rows x cols buffer and returns its slot id
+    int reserve(int rows, int cols)
+    {
+        slots_.push_back({ size_, rows, cols });
+
+        // Keep every slot on its own cache line
+        constexpr size_t per_line = alignment / sizeof(T) > 0 ? alignment / sizeof(T) : 1;
+        size_t n = static_cast<size_t>(rows) * cols;
+        size_ += (n + per_line - 1) / per_line * per_line;
+        return slots_.size() - 1;
+    }
+
+    void allocate(void)
+    {
+        block_ = aligned_array<T>(size_);
+    }
+
+    // Full-size view over a reserved slot
+    Matrix<T> slot(int id) const
+    {
+        const Slot& s = slots_.at(id);
+        return Matrix<T>(block_, block_.get() + s.offset, s.rows, s.cols);
+    }
+
+    // Number of elements, padding included
+    size_t size(void) const { return size_; }
+
+private:
+    struct Slot
+    {
+        size_t offset;
+        int rows;
+        int cols;
+    };
+
+    std::vector<Slot> slots_;
+    size_t size_ = 0;
+    std::shared_ptr<T[]> block_;
+};
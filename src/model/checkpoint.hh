@@ -0,0 +1,343 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "../optimizer/training_state.hh"
+
+// Training checkpoints, see Model::set_checkpoints. A checkpoint is a
+// TrainingState written as, in the byte order of the host:
+//
+//   CheckpointFileHeader
+//   int64 counters, then double scalars
+//   each array: uint64 size, then its values
+//
+// Checkpoint n of prefix is the file prefix.n, n the number of batches
+// trained when it was taken. Files are written next to their path, synced
+// and renamed over it, so a crash never leaves a partial checkpoint.
+
+struct CheckpointFileHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t value_size; // sizeof(T)
+    uint32_t reserved;
+    uint64_t nb_counters;
+    uint64_t nb_scalars;
+    uint64_t nb_arrays;
+};
+
+constexpr char checkpoint_file_magic[8] = { 'P', 'R', 'O', 'P', 'H', 'C', 'K', 'P' };
+constexpr uint32_t checkpoint_file_version = 1;
+constexpr uint32_t checkpoint_file_byte_order = 0x01020304;
+
+template <typename T>
+void write_checkpoint_file(const std::string& path, const TrainingState<T>& state)
+{
+    CheckpointFileHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, checkpoint_file_magic, sizeof(header.magic));
+    header.version = checkpoint_file_version;
+    header.byte_order = checkpoint_file_byte_order;
+    header.value_size = sizeof(T);
+    header.nb_counters = state.get_counters().size();
+    header.nb_scalars = state.get_scalars().size();
+    header.nb_arrays = state.get_nb_arrays();
+
+    const std::string tmp_path = path + ".tmp";
+    int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        throw std::runtime_error("Cannot open " + tmp_path);
+
+    bool ok = true;
+    auto write_all = [fd, &ok](const void* data, uint64_t bytes) {
+        const char* p = static_cast<const char*>(data);
+        while (ok && bytes > 0)
+        {
+            const ssize_t n = write(fd, p, bytes);
+            // Interrupted before anything was written: try again
+            if (n < 0 && errno == EINTR)
+                continue;
+            ok = n > 0;
+            p += ok ? n : 0;
+            bytes -= ok ? n : 0;
+        }
+    };
+    write_all(&header, sizeof(header));
+    write_all(state.get_counters().data(), sizeof(int64_t) * header.nb_counters);
+    write_all(state.get_scalars().data(), sizeof(double) * header.nb_scalars);
+    for (size_t i = 0; i < state.get_nb_arrays(); i++)
+    {
+        const uint64_t size = state.array(i).size();
+        write_all(&size, sizeof(size));
+        write_all(state.array(i).data(), sizeof(T) * size);
+    }
+    ok = fsync(fd) == 0 && ok;
+    ok = close(fd) == 0 && ok;
+    if (!ok || std::rename(tmp_path.c_str(), path.c_str()) != 0)
+    {
+        std::remove(tmp_path.c_str());
+        throw std::runtime_error("Cannot write " + path);
+    }
+
+    // Make the rename itself durable
+    const size_t slash = path.rfind('/');
+    const std::string directory = slash == std::string::npos ? "." : path.substr(0, slash + 1);
+    int dir = open(directory.c_str(), O_RDONLY);
+    if (dir >= 0)
+    {
+        fsync(dir);
+        close(dir);
+    }
+}
+
+template <typename T>
+void read_checkpoint_file(const std::string& path, TrainingState<T>& state)
+{
+    std::ifstream in(path, std::ios::binary);
+    if (!in)
+        throw std::runtime_error("Cannot open " + path);
+    auto fail = [&path](const char* reason) {
+        return std::runtime_error("Bad checkpoint " + path + ": " + reason);
+    };
+    auto read_bytes = [&in, &fail](void* data, uint64_t bytes) {
+        if (!in.read(static_cast<char*>(data), bytes))
+            throw fail("truncated");
+    };
+
+    CheckpointFileHeader header;
+    read_bytes(&header, sizeof(header));
+    if (std::memcmp(header.magic, checkpoint_file_magic, sizeof(header.magic)) != 0)
+        throw fail("not a checkpoint");
+    if (header.version != checkpoint_file_version)
+        throw fail("unsupported version");
+    if (header.byte_order != checkpoint_file_byte_order || header.value_size != sizeof(T))
+        throw fail("written with another byte order or value type");
+
+    in.seekg(0, std::ios::end);
+    const uint64_t file_size = in.tellg();
+    in.seekg(sizeof(header));
+    // Sizes are checked against the file before anything is allocated
+    auto check = [&](uint64_t count, uint64_t value_size) {
+        const uint64_t position = in.tellg();
+        if (count > (file_size - position) / value_size)
+            throw fail("truncated");
+    };
+
+    state.clear();
+    check(header.nb_counters, sizeof(int64_t));
+    for (uint64_t i = 0; i < header.nb_counters; i++)
+    {
+        int64_t counter;
+        read_bytes(&counter, sizeof(counter));
+        state.put_counter(counter);
+    }
+    check(header.nb_scalars, sizeof(double));
+    for (uint64_t i = 0; i < header.nb_scalars; i++)
+    {
+        double scalar;
+        read_bytes(&scalar, sizeof(scalar));
+        state.put_scalar(scalar);
+    }
+    for (uint64_t i = 0; i < header.nb_arrays; i++)
+    {
+        uint64_t size;
+        read_bytes(&size, sizeof(size));
+        check(size, sizeof(T));
+        read_bytes(state.put_array(size), sizeof(T) * size);
+    }
+}
+
+// Checkpoints of prefix on disk, oldest (fewest batches) first
+inline std::vector<std::string> list_checkpoints(const std::string& prefix)
+{
+    const size_t slash = prefix.rfind('/');
+    const bool here = slash == std::string::npos;
+    const std::string directory = here ? "." : prefix.substr(0, slash + 1);
+    const std::string name = (here ? prefix : prefix.substr(slash + 1)) + ".";
+
+    std::vector<std::pair<uint64_t, std::string>> found;
+    if (DIR* dir = opendir(directory.c_str()))
+    {
+        while (const dirent* entry = readdir(dir))
+        {
+            const std::string file = entry->d_name;
+            if (file.size() <= name.size() || file.compare(0, name.size(), name) != 0
+                || file.find_first_not_of("0123456789", name.size()) != std::string::npos)
+                continue;
+            const std::string step = file.substr(name.size());
+            found.emplace_back(std::stoull(step), prefix + "." + step);
+        }
+        closedir(dir);
+    }
+    std::sort(found.begin(), found.end());
+
+    std::vector<std::string> paths;
+    for (const auto& f : found)
+        paths.push_back(f.second);
+    return paths;
+}
+
+// Most recent checkpoint of prefix, empty if there is none
+inline std::string latest_checkpoint(const std::string& prefix)
+{
+    const std::vector<std::string> paths = list_checkpoints(prefix);
+    return paths.empty() ? std::string() : paths.back();
+}
+
+// Background writer of the checkpoints of a training run. The training
+// thread fills buffer() and submits it, which only swaps buffers under a
+// lock: serialization, fsync and rotation happen on the writer's thread.
+// Three buffers take turns (filled, pending, being written), so snapshots
+// reuse their storage. A snapshot still pending when the next one is
+// submitted is replaced by it; the last one submitted is always written.
+template <typename T>
+class CheckpointWriter
+{
+public:
+    // Keeps the last keep checkpoints written by this writer; files of
+    // prefix from earlier runs are left alone
+    CheckpointWriter(const std::string& prefix, int keep)
+        : prefix_(prefix), keep_(keep)
+    {
+        if (prefix.empty() || keep < 1)
+            throw std::invalid_argument("Bad checkpoint prefix or count");
+        writer_ = std::thread([this]() { run(); });
+    }
+
+    CheckpointWriter(const CheckpointWriter&) = delete;
+    CheckpointWriter& operator=(const CheckpointWriter&) = delete;
+
+    // Writes the pending snapshot, if any, before returning. Errors are
+    // lost by then: flush() first to get them.
+    ~CheckpointWriter()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        cv_.notify_all();
+        writer_.join();
+    }
+
+    // Owned by the training thread until submit()
+    TrainingState<T>& buffer(void) { return filled_; }
+
+    // Hands buffer() over as checkpoint number step. Throws if a previous
+    // checkpoint could not be written.
+    void submit(uint64_t step)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            rethrow();
+            std::swap(filled_, pending_);
+            skipped_ += has_pending_;
+            has_pending_ = true;
+            pending_step_ = step;
+        }
+        cv_.notify_all();
+    }
+
+    // Waits until every submitted checkpoint is on disk
+    void flush(void)
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [this]() { return !has_pending_ && !writing_; });
+        rethrow();
+    }
+
+    // Snapshots replaced before the writer got to them
+    size_t get_skipped(void) const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return skipped_;
+    }
+
+private:
+    void rethrow(void)
+    {
+        if (error_.empty())
+            return;
+        const std::string error = error_;
+        error_.clear();
+        throw std::runtime_error(error);
+    }
+
+    void run(void)
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        for (;;)
+        {
+            cv_.wait(lock, [this]() { return stop_ || has_pending_; });
+            if (!has_pending_)
+                return;
+            std::swap(pending_, writing_buffer_);
+            has_pending_ = false;
+            writing_ = true;
+            const std::string path = prefix_ + "." + std::to_string(pending_step_);
+            lock.unlock();
+
+            std::string error;
+            try
+            {
+                write_checkpoint_file(path, writing_buffer_);
+                // Rewritten after a resume in the same run: it keeps its place
+                written_.erase(std::remove(written_.begin(), written_.end(), path),
+                               written_.end());
+                written_.push_back(path);
+                while (written_.size() > static_cast<size_t>(keep_))
+                {
+                    std::remove(written_.front().c_str());
+                    written_.pop_front();
+                }
+            }
+            catch (const std::exception& e)
+            {
+                error = e.what();
+            }
+
+            lock.lock();
+            writing_ = false;
+            if (!error.empty())
+                error_ = error;
+            cv_.notify_all();
+        }
+    }
+
+    std::string prefix_;
+    int keep_;
+    // Checkpoints written and still on disk, oldest first; only used by the
+    // writer thread
+    std::deque<std::string> written_;
+
+    TrainingState<T> filled_;
+    TrainingState<T> pending_;
+    TrainingState<T> writing_buffer_;
+    uint64_t pending_step_ = 0;
+    bool has_pending_ = false;
+    bool writing_ = false;
+    bool stop_ = false;
+    size_t skipped_ = 0;
+    std::string error_;
+
+    mutable std::mutex mutex_;
+    std::condition_variable cv_;
+    std::thread writer_;
+};
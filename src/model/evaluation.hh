@@ -0,0 +1,161 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <limits>
+#include <stdexcept>
+#include <vector>
+
+#include "../matrix/matrix.hh"
+#include "../loss/loss.hh"
+
+// Metrics of a model over a labelled set, see Model::evaluate. The class of
+// a target or output column is its arg max, or its side of 0.5 for a single
+// output (two classes).
+struct Evaluation
+{
+    size_t samples = 0;
+    // Mean per sample, under the compiled loss
+    double loss = 0;
+    double accuracy = 0;
+    // Fraction of samples whose target class is among their top_k outputs
+    double top_k_accuracy = 0;
+    int top_k = 1;
+    int nb_classes = 0;
+    // nb_classes x nb_classes counts, target class by predicted class
+    std::vector<size_t> confusion;
+
+    size_t confusion_count(int target, int predicted) const
+    {
+        return confusion[static_cast<size_t>(target) * nb_classes + predicted];
+    }
+};
+
+// Running sums of an Evaluation over batches of outputs and targets
+// (outputs x batch). Each thread of Model::evaluate has its own, and they
+// are merged at the end, so no prediction is kept after its batch.
+template <typename T>
+class EvaluationCounters
+{
+public:
+    EvaluationCounters(int nb_outputs, int top_k)
+    : nb_outputs_(nb_outputs)
+    , nb_classes_(nb_outputs == 1 ? 2 : nb_outputs)
+    , top_k_(std::max(1, std::min(top_k, nb_classes_)))
+    , confusion_(static_cast<size_t>(nb_classes_) * nb_classes_, 0)
+    {}
+
+    void add(const Matrix<T>& a, const Matrix<T>& y, const Loss<T>& loss)
+    {
+        if (a.get_rows() != nb_outputs_)
+            throw std::invalid_argument("Outputs do not match the counters");
+        loss_ += loss.value(a, y);
+
+        const int cols = a.get_cols();
+        const T* outputs = a.get_data();
+        const T* targets = y.get_data();
+        for (int j = 0; j < cols; ++j)
+        {
+            int target;
+            int predicted;
+            int rank; // outputs above the one of the target class
+            if (nb_outputs_ == 1)
+            {
+                target = targets[j] > T(0.5);
+                predicted = outputs[j] > T(0.5);
+                rank = target != predicted;
+            }
+            else
+            {
+                target = arg_max(targets + j, cols);
+                predicted = arg_max(outputs + j, cols);
+                const T score = outputs[static_cast<long>(target) * cols + j];
+                rank = 0;
+                for (int i = 0; i < nb_outputs_; ++i)
+                    rank += outputs[static_cast<long>(i) * cols + j] > score;
+            }
+            correct_ += target == predicted;
+            top_k_correct_ += rank < top_k_;
+            confusion_[static_cast<size_t>(target) * nb_classes_ + predicted]++;
+        }
+        samples_ += cols;
+    }
+
+    void merge(const EvaluationCounters& other)
+    {
+        samples_ += other.samples_;
+        loss_ += other.loss_;
+        correct_ += other.correct_;
+        top_k_correct_ += other.top_k_correct_;
+        for (size_t i = 0; i < confusion_.size(); ++i)
+            confusion_[i] += other.confusion_[i];
+    }
+
+    Evaluation result(void) const
+    {
+        Evaluation e;
+        const double n = std::max<size_t>(samples_, 1);
+        e.samples = samples_;
+        e.loss = loss_ / n;
+        e.accuracy = correct_ / n;
+        e.top_k_accuracy = top_k_correct_ / n;
+        e.top_k = top_k_;
+        e.nb_classes = nb_classes_;
+        e.confusion = confusion_;
+        return e;
+    }
+
+private:
+    // Row of the largest value of a column, whose first value is at column
+    int arg_max(const T* column, int stride) const
+    {
+        int best = 0;
+        for (int i = 1; i < nb_outputs_; ++i)
+            if (column[static_cast<long>(i) * stride] > column[static_cast<long>(best) * stride])
+                best = i;
+        return best;
+    }
+
+    int nb_outputs_;
+    int nb_classes_;
+    int top_k_;
+    size_t samples_ = 0;
+    double loss_ = 0;
+    size_t correct_ = 0;
+    size_t top_k_correct_ = 0;
+    std::vector<size_t> confusion_;
+};
+
+// Stops training once the validation loss has not improved by more than
+// min_delta for patience evaluations in a row, see Model::set_validation
+class EarlyStopping
+{
+public:
+    explicit EarlyStopping(int patience, double min_delta = 0)
+    : patience_(patience), min_delta_(min_delta)
+    {
+        if (patience < 1 || min_delta < 0)
+            throw std::invalid_argument("Bad early stopping parameters");
+    }
+
+    // Whether to go on training
+    bool operator()(int, const Evaluation& e)
+    {
+        if (e.loss < best_loss_ - min_delta_)
+        {
+            best_loss_ = e.loss;
+            waited_ = 0;
+        }
+        else
+            waited_++;
+        return waited_ < patience_;
+    }
+
+    double get_best_loss(void) const { return best_loss_; }
+
+private:
+    int patience_;
+    double min_delta_;
+    double best_loss_ = std::numeric_limits<double>::infinity();
+    int waited_ = 0;
+};
@@ -1,47 +1,284 @@
 #pragma once
 
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <iomanip>
+#include <iostream>
 #include <memory>
+#include <numeric>
+#include <sstream>
+#include <stdexcept>
 #include <string>
 #include <vector>
 
 #include "../layer/input_layer.hh"
 #include "../layer/hidden_layer.hh"
+#include "../matrix/thread_pool.hh"
+#include "../dataset/pipeline.hh"
+#include "checkpoint.hh"
+#include "evaluation.hh"
+#include "model_file.hh"
+#include "profiler.hh"
+
+enum class inference_mode
+{
+    FLOAT,
+    INT8
+};
+
+// Error of the int8 path against the float model on the same inputs
+struct QuantizationReport
+{
+    double mean_abs_error;
+    double max_abs_error;
+    // Fraction of samples with the same predicted class: same arg max of
+    // the outputs, or same side of 0.5 for a single output
+    double top1_agreement;
+};
 
 template <typename T = float>
 class Model
 {
 public:
-    Model() : compiled_(false)
-    {
-        srand(time(NULL));
-    }
+    // Initial parameters from a seed drawn from random_engine()
+    Model() : Model(random_engine()())
+    {}
 
+    // Parameters initialized by compile() only depend on seed
+    explicit Model(uint64_t seed) : compiled_(false), init_seed_(seed)
+    {}
+
+    // The model needs compiling again afterwards
     Model& add(Layer<T>* layer)
     {
         layers_.emplace_back(layer);
+        compiled_ = false;
         return *this;
     }
 
-    Matrix<T> predict(const Matrix<T>& input)
+    // Runs input (features x samples) through the model. Thread-safe; every
+    // call allocates its own buffers.
+    Matrix<T> predict(const Matrix<T>& input) const
     {
-        return layers_[0]->feedforward(input, false);
+        std::vector<LayerContext<T>> contexts;
+        return predict_batch(input, contexts);
     }
 
-    virtual ~Model() = default;
+    // Re-entrant inference over shared weights: several threads may call it
+    // at once, each with its own contexts (one per layer, resized if
+    // needed). Buffers in contexts are reused by later calls with the same
+    // batch size, so the result is only valid until the next one.
+    Matrix<T> predict_batch(const Matrix<T>& input,
+                            std::vector<LayerContext<T>>& contexts) const
+    {
+        check_input(input);
+        return infer(input, contexts, mode_);
+    }
 
-    void compile(T learning_rate)
+    // Loss and classification metrics over a labelled set, in batches of
+    // batch_size spread over the threads of the pool. Every thread keeps
+    // its own buffers for one batch and its own counters, merged at the end:
+    // predictions are dropped as soon as they are counted.
+    Evaluation evaluate(const std::vector<Matrix<T>>& x, const std::vector<Matrix<T>>& y,
+                        int batch_size = 256, int top_k = 5) const
     {
-        learning_rate_ = learning_rate;
-        compiled_ = true;
+        if (x.size() != y.size() || x.empty())
+            throw std::invalid_argument("Bad evaluation set");
+        // Every sample up front: the batches are stacked inside pool tasks
+        for (size_t s = 0; compiled_ && s < x.size(); s++)
+            if (x[s].get_rows() != steps_.front().outputs || x[s].get_cols() != 1
+                || y[s].get_rows() != steps_.back().outputs || y[s].get_cols() != 1)
+                throw std::invalid_argument("Evaluation set does not match the model");
+        return evaluate_batches(x.size(), batch_size, top_k,
+            [&x, &y](Matrix<T>& x_batch, Matrix<T>& y_batch, size_t begin, size_t end) {
+                Matrix<T>::hstack_into(x_batch, x, begin, end);
+                Matrix<T>::hstack_into(y_batch, y, begin, end);
+            });
+    }
 
-        if (layers_.size() >= 2)
+    Evaluation evaluate(const Dataset<T>& data, int batch_size = 256, int top_k = 5) const
+    {
+        if (data.size() == 0)
+            throw std::invalid_argument("Bad evaluation set");
+        if (compiled_ && (data.get_x_size() != steps_.front().outputs
+                          || data.get_y_size() != steps_.back().outputs))
+            throw std::invalid_argument("Evaluation set does not match the model");
+        return evaluate_batches(data.size(), batch_size, top_k,
+            [&data](Matrix<T>& x_batch, Matrix<T>& y_batch, size_t begin, size_t end) {
+                thread_local std::vector<size_t> indices;
+                indices.resize(end - begin);
+                std::iota(indices.begin(), indices.end(), begin);
+                data.gather(indices.data(), indices.size(), x_batch, y_batch);
+            });
+    }
+
+    // Evaluates the model on a validation set after every `every` epochs of
+    // train(), and passes the number of epochs trained since compile() and
+    // the result to on_evaluation. Training stops as soon as it returns
+    // false, e.g. with an EarlyStopping(patience).
+    void set_validation(const std::vector<Matrix<T>>& x, const std::vector<Matrix<T>>& y,
+                        int every, std::function<bool(int, const Evaluation&)> on_evaluation,
+                        int batch_size = 256)
+    {
+        set_validation([x, y, batch_size](const Model& model) {
+            return model.evaluate(x, y, batch_size);
+        }, every, std::move(on_evaluation));
+    }
+
+    void set_validation(const Dataset<T>& data, int every,
+                        std::function<bool(int, const Evaluation&)> on_evaluation,
+                        int batch_size = 256)
+    {
+        set_validation([data, batch_size](const Model& model) {
+            return model.evaluate(data, batch_size);
+        }, every, std::move(on_evaluation));
+    }
+
+    void clear_validation(void)
+    {
+        validate_ = nullptr;
+        on_validation_ = nullptr;
+    }
+
+    // Post-training int8 quantization of the dense layers. calibration
+    // (features x samples) should be representative of the inputs to serve:
+    // it sets the range of each layer's inputs. Switches inference to the
+    // int8 path and returns its error against the float model on
+    // calibration. Training again brings layers back to float.
+    QuantizationReport quantize(const Matrix<T>& calibration)
+    {
+        check_input(calibration);
+        // Largest input of every layer, from a float pass
+        std::vector<LayerContext<T>> contexts(layers_.size());
+        Matrix<T> a = calibration;
+        for (size_t l = 0; l < layers_.size(); l++)
         {
-            int last = layers_.size() - 1;
-            layers_[0]->compile(std::weak_ptr<Layer<T>>(), layers_[1]);
-            layers_[last]->compile(layers_[last - 1], nullptr);
+            if (l > 0)
+            {
+                T max = 0;
+                const T* data = a.get_data();
+                for (int i = 0; i < a.get_rows() * a.get_cols(); i++)
+                    max = std::max(max, std::abs(data[i]));
+                steps_[l].hidden->quantize(max / 127);
+            }
+            a = layers_[l]->forward(a, contexts[l], false);
         }
-        for (size_t i = 1; i < layers_.size() - 1; i++)
-            layers_[i]->compile(layers_[i - 1], layers_[i + 1]);
+
+        mode_ = inference_mode::INT8;
+        return compare_quantized(calibration);
+    }
+
+    // Error of the int8 path against the float one on x
+    QuantizationReport compare_quantized(const Matrix<T>& x) const
+    {
+        check_input(x);
+        std::vector<LayerContext<T>> float_contexts;
+        std::vector<LayerContext<T>> int8_contexts;
+        Matrix<T> expected = infer(x, float_contexts, inference_mode::FLOAT);
+        Matrix<T> actual = infer(x, int8_contexts, inference_mode::INT8);
+
+        QuantizationReport report = { 0, 0, 0 };
+        const int rows = expected.get_rows();
+        const int cols = expected.get_cols();
+        int agree = 0;
+        for (int j = 0; j < cols; j++)
+        {
+            int best_expected = 0;
+            int best_actual = 0;
+            for (int i = 0; i < rows; i++)
+            {
+                const double error = std::abs(expected(i, j) - actual(i, j));
+                report.mean_abs_error += error;
+                report.max_abs_error = std::max(report.max_abs_error, error);
+                if (expected(i, j) > expected(best_expected, j))
+                    best_expected = i;
+                if (actual(i, j) > actual(best_actual, j))
+                    best_actual = i;
+            }
+            if (rows == 1)
+                agree += (expected(0, j) > 0.5) == (actual(0, j) > 0.5);
+            else
+                agree += best_expected == best_actual;
+        }
+        report.mean_abs_error /= std::max(1, rows * cols);
+        report.top1_agreement = static_cast<double>(agree) / std::max(1, cols);
+        return report;
+    }
+
+    // Magnitude pruning of every dense layer: the fraction sparsity of its
+    // weights with the smallest magnitudes is zeroed, and the others move
+    // to sparse (CSR) storage, used by inference and training from then on.
+    // Pruned weights stay zero through later training.
+    void prune(double sparsity)
+    {
+        if (!compiled_)
+            throw std::invalid_argument("Model has not been compiled");
+        for (const Step& step : steps_)
+            if (step.hidden != nullptr)
+                step.hidden->prune(sparsity);
+    }
+
+    // Gradual pruning during train(): after each of the next nb_epochs
+    // epochs e, prunes to final_sparsity * (1 - (1 - e / nb_epochs)^3).
+    // Most weights go early, while the network can recover from it, and
+    // the last ones slowly.
+    void set_pruning_schedule(double final_sparsity, int nb_epochs)
+    {
+        if (final_sparsity < 0 || final_sparsity >= 1 || nb_epochs < 0)
+            throw std::invalid_argument("Bad pruning schedule");
+        pruning_sparsity_ = final_sparsity;
+        pruning_epochs_ = nb_epochs;
+        pruning_epoch_ = 0;
+    }
+
+    // Mean loss per sample of the last training batch, and of the last
+    // epoch of train(), as the backward passes found it before updating the
+    // parameters
+    double get_batch_loss(void) const { return batch_loss_; }
+    double get_epoch_loss(void) const { return epoch_loss_; }
+    const Loss<T>& get_loss(void) const { return loss_; }
+    // Seed of the initial parameters, to reproduce a run of Model()
+    uint64_t get_seed(void) const { return init_seed_; }
+
+    void set_inference_mode(inference_mode mode) { mode_ = mode; }
+    inference_mode get_inference_mode(void) const { return mode_; }
+
+    virtual ~Model() = default;
+
+    // batch_size sizes the training workspace; train() re-plans it once if
+    // it is given larger batches. nb_threads > 1 enables data-parallel
+    // training: each batch is split across that many replicas, whose
+    // gradients are summed in a fixed order, so results are reproducible
+    // bit for bit for a given nb_threads.
+    void compile(T learning_rate, int batch_size = 1, int nb_threads = 1)
+    {
+        compile(Optimizer<T>::sgd(learning_rate), batch_size, nb_threads);
+    }
+
+    // Same, with another update rule than SGD, e.g. Optimizer<T>::adam(lr)
+    void compile(const Optimizer<T>& optimizer, int batch_size = 1, int nb_threads = 1)
+    {
+        compile(optimizer, Loss<T>::mse(), batch_size, nb_threads);
+    }
+
+    // Same, minimizing another loss than MSE, e.g. categorical cross-entropy
+    // over a Softmax<T> output layer
+    void compile(const Optimizer<T>& optimizer, const Loss<T>& loss, int batch_size = 1,
+                 int nb_threads = 1)
+    {
+        if (nb_threads <= 0)
+            throw std::invalid_argument("Bad number of threads");
+
+        loss_ = loss;
+        optimizer_ = optimizer;
+        epoch_ = 0;
+        step_ = 0;
+        batch_ = 0;
+        learning_rate_ = optimizer.learning_rate;
+        nb_replicas_ = nb_threads;
+        link();
+        plan(batch_size);
     }
 
     void train(std::vector<Matrix<T>>& x,
@@ -52,37 +289,705 @@ public:
         if (!compiled_)
             throw "Model has not been compiled.";
 
-        for (int epoch = 0; epoch < epochs; epoch++)
+        if (batch_size <= 0 || x.size() != y.size() || x.empty())
+            throw std::invalid_argument("Bad training set or batch size");
+
+        start_run(batch_size, 0);
+        train_run(x, y, epochs, 0);
+        flush_checkpoints();
+    }
+
+    // Trains on a dataset file, shuffled at every epoch from seed. Batches
+    // are stacked by a background thread while the previous one trains.
+    void train(const Dataset<T>& data, int epochs, int batch_size, uint64_t seed = 0)
+    {
+        if (!compiled_)
+            throw "Model has not been compiled.";
+
+        if (batch_size <= 0 || data.size() == 0
+            || data.get_x_size() != layers_.front()->get_nb_neurons()
+            || data.get_y_size() != layers_.back()->get_nb_neurons())
+            throw std::invalid_argument("Bad training set or batch size");
+
+        start_run(batch_size, seed);
+        train_run(data, epochs, 0);
+        flush_checkpoints();
+    }
+
+    // Checkpoints the training state every `every` batches of train(), to
+    // prefix.<batches trained since compile()>, and keeps the last keep
+    // checkpoints written from then on; files already there are never
+    // removed. The training thread only copies the parameters, optimizer
+    // moments and position to a buffer: a background thread writes and
+    // syncs the file while training goes on. train() returns once the last
+    // one is on disk, and throws std::runtime_error if one could not be
+    // written.
+    void set_checkpoints(const std::string& prefix, int every, int keep = 3)
+    {
+        if (every <= 0)
+            throw std::invalid_argument("Bad checkpoint interval");
+        clear_checkpoints();
+        checkpoints_.reset(new CheckpointWriter<T>(prefix, keep));
+        checkpoint_every_ = every;
+    }
+
+    // Waits for the checkpoints still being written, and stops taking them.
+    // Throws if one of them could not be written.
+    void clear_checkpoints(void)
+    {
+        std::unique_ptr<CheckpointWriter<T>> writer = std::move(checkpoints_);
+        if (writer)
+            writer->flush();
+    }
+
+    // Waits until every checkpoint taken is on disk. Throws if one of them
+    // could not be written, as do train() and resume().
+    void flush_checkpoints(void)
+    {
+        if (checkpoints_)
+            checkpoints_->flush();
+    }
+
+    // Restores a checkpoint taken by train() on a model of the same layers,
+    // compiled the same way, and trains on from the batch after it until
+    // epochs since compile(): the arguments of the interrupted train()
+    // call, if it was the first one. The batch size and, for a dataset,
+    // the shuffle seed are the ones of that call.
+    void resume(const std::string& path, std::vector<Matrix<T>>& x, std::vector<Matrix<T>>& y,
+                int epochs)
+    {
+        if (x.size() != y.size() || x.empty())
+            throw std::invalid_argument("Bad training set or batch size");
+        restore(path);
+        if (epoch_ < epochs)
+            train_run(x, y, epochs - epoch_, batch_);
+        flush_checkpoints();
+    }
+
+    void resume(const std::string& path, const Dataset<T>& data, int epochs)
+    {
+        if (data.size() == 0 || data.get_x_size() != layers_.front()->get_nb_neurons()
+            || data.get_y_size() != layers_.back()->get_nb_neurons())
+            throw std::invalid_argument("Bad training set or batch size");
+        restore(path);
+        // The shuffles of the run are replayed from its seed
+        const size_t nb_batches = (data.size() + batch_size_ - 1) / batch_size_;
+        if (epoch_ < epochs)
+            train_run(data, epochs - first_epoch_, (epoch_ - first_epoch_) * nb_batches + batch_);
+        flush_checkpoints();
+    }
+
+    // Prints, per layer, its size and the memory of its parameters, of
+    // their gradients and of its planned activations (over all replicas).
+    // Builds with PROPHECY_PROFILE add the time and FLOP rate of every pass
+    // since compile() or reset_profile().
+    void summary(std::ostream& out = std::cout) const
+    {
+        const std::ios_base::fmtflags flags = out.flags();
+        const std::streamsize precision = out.precision();
+
+        out << std::left << std::setw(7) << "Layer" << std::setw(20) << "Type"
+            << std::right << std::setw(8) << "Units" << std::setw(12) << "Params"
+            << std::setw(12) << "Weights" << std::setw(12) << "Gradients"
+            << std::setw(14) << "Activations" << std::endl;
+
+        size_t total_params = 0;
+        size_t total_bytes = 0;
+        for (size_t l = 0; l < layers_.size(); l++)
         {
-            // Determine batches
-            int i = 0;
-            int nb_batches = ceil(x.size() / batch_size);
-            for (int batch = 0; batch < nb_batches; batch++)
+            const Layer<T>& layer = *layers_[l];
+            size_t params = layer.get_nb_parameters();
+            size_t weights = layer.get_parameters_bytes();
+            size_t gradients = 0;
+            size_t activations = 0;
+            for (int r = 0; r < static_cast<int>(replicas_.size()); r++)
             {
-                // For each batch, compute delta weights and biases
-                for (int k = 0; k < batch_size && i < static_cast<int>(x.size()); k++)
+                const LayerContext<T>& ctx = r == 0 ? layers_[l]->get_context()
+                                                    : replicas_[r].contexts[l];
+                gradients += bytes(ctx.delta_weights) + bytes(ctx.delta_biases);
+                for (const auto& buffer : ctx.buffers)
+                    activations += bytes(buffer);
+                if (l == 0)
+                    activations += bytes(replicas_[r].x_buffer);
+            }
+            total_params += params;
+            total_bytes += weights + gradients + activations;
+
+            out << std::left << std::setw(7) << l << std::setw(20) << describe(layer)
+                << std::right << std::setw(8) << layer.get_nb_neurons()
+                << std::setw(12) << params << std::setw(12) << format_bytes(weights)
+                << std::setw(12) << format_bytes(gradients)
+                << std::setw(14) << format_bytes(activations) << std::endl;
+        }
+        out << "Total params: " << total_params << ", memory: "
+            << format_bytes(total_bytes) << std::endl;
+        out << "Optimizer: " << optimizer_name(optimizer_.id) << ", learning rate "
+            << optimizer_.learning_rate << std::endl;
+        out << "Loss: " << loss_name(loss_.id) << std::endl;
+
+        if constexpr (profiling_enabled)
+        {
+            const char* names[] = { "forward", "backward", "update" };
+            double total_ns = 0;
+            for (size_t l = 0; l < profiler_.size(); l++)
+                for (int p = 0; p < nb_profile_passes; p++)
+                    total_ns += profiler_.get(l, static_cast<profile_pass>(p)).nanoseconds;
+
+            out << std::endl << "Profile (thread time, summed over replicas)" << std::endl
+                << std::left << std::setw(7) << "Layer" << std::setw(10) << "Pass"
+                << std::right << std::setw(10) << "Calls" << std::setw(12) << "Time ms"
+                << std::setw(9) << "Share" << std::setw(10) << "GFLOP/s" << std::endl;
+            for (size_t l = 0; l < profiler_.size(); l++)
+            {
+                for (int p = 0; p < nb_profile_passes; p++)
                 {
-                    layers_[0]->feedforward(x[i], true);
-                    layers_[layers_.size() - 1]->backpropagation(&y[i]);
-                    ++i;
+                    Profiler::Counters c = profiler_.get(l, static_cast<profile_pass>(p));
+                    if (c.calls == 0)
+                        continue;
+                    out << std::left << std::setw(7) << l << std::setw(10) << names[p]
+                        << std::right << std::setw(10) << c.calls << std::fixed
+                        << std::setprecision(2) << std::setw(12) << c.nanoseconds * 1e-6
+                        << std::setw(8) << 100 * c.nanoseconds / std::max(total_ns, 1.0) << "%"
+                        << std::setw(10) << c.flops / std::max<double>(c.nanoseconds, 1)
+                        << std::endl;
                 }
+            }
+        }
+
+        out.flags(flags);
+        out.precision(precision);
+    }
+
+    // Per-layer counters, empty unless built with PROPHECY_PROFILE
+    const Profiler& get_profiler(void) const { return profiler_; }
+    void reset_profile(void) { profiler_.reset(); }
+
+    // Writes topology, activations, learning rate and parameters, see
+    // model_file.hh
+    void save(const std::string& path) const
+    {
+        if (!compiled_)
+            throw std::invalid_argument("Model has not been compiled");
+        write_model_file(path, layers_, learning_rate_);
+    }
+
+    // Replaces the layers with the ones of a saved model. The file is
+    // mapped, not read: parameters are used in place and paged in on first
+    // use. The model is ready for inference; training plans its workspace
+    // on the first batch, and goes on with the compiled optimizer at the
+    // saved learning rate, from zero moments.
+    void load(const std::string& path)
+    {
+        layers_ = read_model_file<T>(path, learning_rate_);
+        mode_ = inference_mode::FLOAT;
+        optimizer_.learning_rate = learning_rate_;
+        link();
+        replicas_.clear();
+        workspace_ = Workspace<T>();
+        planned_batch_size_ = 0;
+    }
 
-                // At the end of batch, update weights_ and biases_
-                for (size_t l = 1; l < layers_.size(); l++)
+private:
+    // One layer of the execution plan, resolved by link(). The passes are
+    // plain loops over the steps: no cast, weak_ptr::lock or reference
+    // count on the way.
+    struct Step
+    {
+        Layer<T>* layer;
+        HiddenLayer<T>* hidden; // nullptr for the input layer
+        HiddenLayer<T>* next;   // nullptr for the output layer
+        int inputs;             // 0 for the input layer
+        int outputs;
+    };
+
+    // Per-replica state: batch buffers and one context per layer. Replica 0
+    // uses the layers' own contexts; step_contexts points at the ones of
+    // the replica, in plan order.
+    struct Replica
+    {
+        Matrix<T> x_buffer;
+        Matrix<T> y_buffer;
+        std::vector<LayerContext<T>> contexts;
+        std::vector<LayerContext<T>*> step_contexts;
+    };
+
+    LayerContext<T>& context(int replica, size_t layer)
+    {
+        return *replicas_[replica].step_contexts[layer];
+    }
+
+    // Forward and backward over samples [begin, end) of the batch on one
+    // replica. gather(x_batch, y_batch, begin, end) stacks these samples as
+    // the columns of the replica's buffers.
+    template <typename Gather>
+    void run_replica(int r, int begin, int end, const Gather& gather)
+    {
+        const Step* steps = steps_.data();
+        LayerContext<T>* const* contexts = replicas_[r].step_contexts.data();
+        const size_t last = steps_.size() - 1;
+        const int count = end - begin;
+
+        // Stack the samples as columns and run them at once
+        auto x_batch = replicas_[r].x_buffer.prefix(steps[0].outputs, count);
+        auto y_batch = replicas_[r].y_buffer.prefix(steps[last].outputs, count);
+        gather(x_batch, y_batch, begin, end);
+
+        Matrix<T> a = x_batch;
+        for (size_t l = 0; l <= last; l++)
+        {
+            ProfileScope scope(profiler_, l, profile_pass::FORWARD,
+                               [&]() { return steps[l].layer->forward_flops(count); });
+            a = steps[l].layer->forward(a, *contexts[l], true);
+        }
+
+        for (size_t l = last; l >= 1; l--)
+        {
+            ProfileScope scope(profiler_, l, profile_pass::BACKWARD,
+                               [&]() { return steps[l].layer->backward_flops(count); });
+            bool output = l == last;
+            steps[l].layer->backward(*contexts[l], *contexts[l - 1], steps[l].next,
+                                     output ? nullptr : contexts[l + 1],
+                                     output ? &y_batch : nullptr, loss_);
+        }
+    }
+
+    // One step over a batch of count samples, see run_replica for gather
+    template <typename Gather>
+    void train_batch(int count, const Gather& gather)
+    {
+        // Contiguous, near-equal shares of the batch for each replica
+        const int nb_replicas = std::min(nb_replicas_, count);
+        ThreadPool::global().parallel_for(nb_replicas, [&](int r) {
+            run_replica(r,
+                        static_cast<long>(count) * r / nb_replicas,
+                        static_cast<long>(count) * (r + 1) / nb_replicas,
+                        gather);
+        });
+
+        // Losses summed by the output layers of the replicas, before the
+        // update
+        double loss = 0;
+        for (int r = 0; r < nb_replicas; r++)
+            loss += context(r, steps_.size() - 1).loss;
+        batch_loss_ = loss / count;
+        epoch_loss_sum_ += loss;
+        epoch_samples_ += count;
+
+        // Pairwise tree reduction of the gradients into replica 0, always in
+        // the same order for a given number of replicas
+        for (int stride = 1; stride < nb_replicas; stride *= 2)
+        {
+            const int nb_pairs = (nb_replicas - stride + 2 * stride - 1) / (2 * stride);
+            ThreadPool::global().parallel_for(nb_pairs, [&](int p) {
+                const int dst = p * 2 * stride;
+                const int src = dst + stride;
+                for (size_t l = 1; l < steps_.size(); l++)
                 {
-                    auto layer = std::dynamic_pointer_cast<HiddenLayer<T>>(layers_[l]);
-                    layer->update(learning_rate_);
+                    LayerContext<T>& to = context(dst, l);
+                    LayerContext<T>& from = context(src, l);
+                    to.delta_weights += from.delta_weights;
+                    to.delta_biases += from.delta_biases;
+                    from.delta_weights.fill(fill_type::ZERO);
+                    from.delta_biases.fill(fill_type::ZERO);
                 }
+            });
+        }
+
+        // At the end of batch, update weights_ and biases_
+        for (size_t l = 1; l < steps_.size(); l++)
+        {
+            ProfileScope scope(profiler_, l, profile_pass::UPDATE,
+                               [&]() { return 2.0 * steps_[l].layer->get_nb_parameters(); });
+            steps_[l].hidden->update(optimizer_, context(0, l));
+        }
+        // Which dropped their int8 weights
+        mode_ = inference_mode::FLOAT;
+    }
+
+    // Inference needs compiled layers, and inputs of the size of the first
+    void check_input(const Matrix<T>& input) const
+    {
+        if (layers_.empty())
+            throw std::invalid_argument("Model has no layer");
+        if (!compiled_)
+            throw std::invalid_argument("Model has not been compiled");
+        if (input.get_rows() != layers_[0]->get_nb_neurons())
+            throw std::invalid_argument("Input does not match the input layer");
+    }
+
+    // Position of a new train() call
+    void start_run(int batch_size, uint64_t seed)
+    {
+        batch_size_ = batch_size;
+        seed_ = seed;
+        first_epoch_ = epoch_;
+        batch_ = 0;
+    }
+
+    // epochs epochs over x and y, the first one from batch first_batch
+    void train_run(std::vector<Matrix<T>>& x, std::vector<Matrix<T>>& y, int epochs,
+                   size_t first_batch)
+    {
+        if (batch_size_ > planned_batch_size_)
+            plan(batch_size_);
+
+        const size_t n = x.size();
+        const size_t nb_batches = (n + batch_size_ - 1) / batch_size_;
+        for (int epoch = 0; epoch < epochs; epoch++)
+        {
+            for (size_t batch = epoch == 0 ? first_batch : 0; batch < nb_batches; batch++)
+            {
+                size_t first = batch * batch_size_;
+                size_t last = std::min(first + batch_size_, n);
+                train_batch(last - first,
+                    [&x, &y, first](Matrix<T>& x_batch, Matrix<T>& y_batch, int begin, int end) {
+                        Matrix<T>::hstack_into(x_batch, x, first + begin, first + end);
+                        Matrix<T>::hstack_into(y_batch, y, first + begin, first + end);
+                    });
+                if (!end_batch(nb_batches))
+                    return;
             }
         }
     }
 
-    void summary();
-    void save(const std::string& path);
-    void load(const std::string& path);
+    // The run's epochs over a dataset, from batch first_batch of the run
+    // shuffled from seed_
+    void train_run(const Dataset<T>& data, int epochs, size_t first_batch)
+    {
+        if (batch_size_ > planned_batch_size_)
+            plan(batch_size_);
+
+        BatchPipeline<T> pipeline(data, batch_size_, epochs, seed_, 2, first_batch);
+        const size_t nb_batches = (data.size() + batch_size_ - 1) / batch_size_;
+        Matrix<T> x;
+        Matrix<T> y;
+        while (pipeline.next(x, y))
+        {
+            train_batch(x.get_cols(),
+                [&x, &y](Matrix<T>& x_batch, Matrix<T>& y_batch, int begin, int) {
+                    Matrix<T>::columns_into(x_batch, x, begin);
+                    Matrix<T>::columns_into(y_batch, y, begin);
+                });
+            if (!end_batch(nb_batches))
+                break;
+        }
+    }
+
+    // After each batch of train(): closes the epoch after its last batch,
+    // then takes a checkpoint if one is due. Returns whether to go on.
+    bool end_batch(size_t nb_batches)
+    {
+        step_++;
+        bool go_on = true;
+        if (++batch_ == nb_batches)
+        {
+            batch_ = 0;
+            go_on = end_epoch();
+        }
+        if (checkpoints_ && step_ % checkpoint_every_ == 0)
+        {
+            TrainingState<T>& state = checkpoints_->buffer();
+            state.clear();
+            save_state(state);
+            checkpoints_->submit(step_);
+        }
+        return go_on;
+    }
+
+    // Position, losses and layers; the gradients are all zero between two
+    // batches
+    void save_state(TrainingState<T>& state) const
+    {
+        state.put_counter(steps_.size());
+        state.put_counter(batch_size_);
+        state.put_counter(static_cast<int64_t>(seed_));
+        state.put_counter(first_epoch_);
+        state.put_counter(epoch_);
+        state.put_counter(batch_);
+        state.put_counter(step_);
+        state.put_counter(pruning_epoch_);
+        state.put_counter(epoch_samples_);
+        state.put_scalar(epoch_loss_sum_);
+        state.put_scalar(epoch_loss_);
+        state.put_scalar(batch_loss_);
+        for (size_t l = 1; l < steps_.size(); l++)
+            steps_[l].hidden->save_state(state);
+    }
+
+    void restore(const std::string& path)
+    {
+        if (!compiled_)
+            throw std::invalid_argument("Model has not been compiled");
+        TrainingState<T> state;
+        read_checkpoint_file(path, state);
+        if (state.get_counter() != static_cast<int64_t>(steps_.size()))
+            throw std::runtime_error("Checkpoint does not match the model");
+        const int batch_size = state.get_counter();
+        if (batch_size <= 0)
+            throw std::runtime_error("Bad checkpoint " + path + ": batch size");
+        batch_size_ = batch_size;
+        seed_ = state.get_counter();
+        first_epoch_ = state.get_counter();
+        epoch_ = state.get_counter();
+        batch_ = state.get_counter();
+        step_ = state.get_counter();
+        pruning_epoch_ = state.get_counter();
+        epoch_samples_ = state.get_counter();
+        epoch_loss_sum_ = state.get_scalar();
+        epoch_loss_ = state.get_scalar();
+        batch_loss_ = state.get_scalar();
+        for (size_t l = 1; l < steps_.size(); l++)
+            steps_[l].hidden->restore_state(state);
+    }
+
+    // Closes the epoch's loss, steps the pruning schedule and runs the
+    // validation, if any. Returns whether to go on training.
+    bool end_epoch(void)
+    {
+        epoch_++;
+        epoch_loss_ = epoch_loss_sum_ / std::max<size_t>(epoch_samples_, 1);
+        epoch_loss_sum_ = 0;
+        epoch_samples_ = 0;
+
+        if (pruning_epoch_ < pruning_epochs_)
+        {
+            pruning_epoch_++;
+            const double remaining = 1 - static_cast<double>(pruning_epoch_) / pruning_epochs_;
+            prune(pruning_sparsity_ * (1 - remaining * remaining * remaining));
+        }
+
+        if (validate_ && epoch_ % validation_every_ == 0)
+            return on_validation_(epoch_, validate_(*this));
+        return true;
+    }
+
+    void set_validation(std::function<Evaluation(const Model&)> validate, int every,
+                        std::function<bool(int, const Evaluation&)> on_evaluation)
+    {
+        if (every <= 0 || !on_evaluation)
+            throw std::invalid_argument("Bad validation schedule");
+        validate_ = std::move(validate);
+        validation_every_ = every;
+        on_validation_ = std::move(on_evaluation);
+    }
+
+    // Batches [b * batch_size, ...) of n samples, interleaved over the
+    // tasks so that each one sees the same amount of work. gather(x_batch,
+    // y_batch, begin, end) stacks samples [begin, end).
+    template <typename Gather>
+    Evaluation evaluate_batches(size_t n, int batch_size, int top_k, const Gather& gather) const
+    {
+        if (!compiled_)
+            throw std::invalid_argument("Model has not been compiled");
+        if (batch_size <= 0)
+            throw std::invalid_argument("Bad batch size");
+
+        const int inputs = steps_.front().outputs;
+        const int outputs = steps_.back().outputs;
+        const size_t nb_batches = (n + batch_size - 1) / batch_size;
+        ThreadPool& pool = ThreadPool::global();
+        const int nb_tasks = std::min<size_t>(pool.get_nb_threads(), nb_batches);
+        std::vector<EvaluationCounters<T>> counters(nb_tasks,
+                                                    EvaluationCounters<T>(outputs, top_k));
+        pool.parallel_for(nb_tasks, [&](int t) {
+            std::vector<LayerContext<T>> contexts;
+            Matrix<T> x_buffer(inputs, batch_size);
+            Matrix<T> y_buffer(outputs, batch_size);
+            for (size_t b = t; b < nb_batches; b += nb_tasks)
+            {
+                const size_t begin = b * batch_size;
+                const size_t end = std::min(begin + batch_size, n);
+                Matrix<T> x_batch = x_buffer.prefix(inputs, end - begin);
+                Matrix<T> y_batch = y_buffer.prefix(outputs, end - begin);
+                gather(x_batch, y_batch, begin, end);
+                counters[t].add(infer(x_batch, contexts, mode_), y_batch, loss_);
+            }
+        });
+
+        // Always in the same order, for a given number of threads
+        for (int t = 1; t < nb_tasks; t++)
+            counters[0].merge(counters[t]);
+        return counters[0].result();
+    }
+
+    Matrix<T> infer(const Matrix<T>& input, std::vector<LayerContext<T>>& contexts,
+                    inference_mode mode) const
+    {
+        contexts.resize(steps_.size());
+        Matrix<T> a = input;
+        for (size_t l = 0; l < steps_.size(); l++)
+        {
+            const Layer<T>* layer = steps_[l].layer;
+            const int batch = a.get_cols();
+            ProfileScope scope(profiler_, l, profile_pass::FORWARD,
+                               [&]() { return layer->forward_flops(batch); });
+            a = mode == inference_mode::INT8 ? layer->forward_int8(a, contexts[l])
+                                             : layer->forward(a, contexts[l], false);
+        }
+        return a;
+    }
+
+    static size_t bytes(const Matrix<T>& m)
+    {
+        return m.get_data() == nullptr ? 0 : sizeof(T) * m.get_rows() * m.get_cols();
+    }
+
+    static std::string format_bytes(size_t n)
+    {
+        const char* units[] = { "B", "KiB", "MiB", "GiB", "TiB" };
+        double value = n;
+        int unit = 0;
+        while (value >= 1024 && unit < 4)
+        {
+            value /= 1024;
+            unit++;
+        }
+        std::ostringstream out;
+        out << std::setprecision(unit == 0 ? 0 : 1) << std::fixed << value << " " << units[unit];
+        return out.str();
+    }
+
+    // Name of the activation, and its math mode unless EXACT
+    static std::string describe_activation(const HiddenLayer<T>& layer)
+    {
+        std::string name = activation_name(layer.get_activation());
+        if (layer.get_math_mode() != math_mode::EXACT)
+            name += std::string(", ") + math_mode_name(layer.get_math_mode());
+        return name;
+    }
+
+    static std::string describe(const Layer<T>& layer)
+    {
+        switch (layer.get_kind())
+        {
+            case layer_kind::INPUT:
+                return "input";
+            case layer_kind::DENSE:
+                return "dense(" + describe_activation(static_cast<const HiddenLayer<T>&>(layer)) + ")";
+            case layer_kind::CONV2D:
+                return "conv2d(" + describe_activation(static_cast<const HiddenLayer<T>&>(layer))
+                       + ")";
+            case layer_kind::MAX_POOL2D:
+                return "max_pool2d";
+            default:
+                return "unknown";
+        }
+    }
+
+    // Connects the layers and initializes the parameters they do not have
+    void link(void)
+    {
+        compiled_ = true;
+        for (size_t i = 0; i < layers_.size(); i++)
+            if (auto hidden = dynamic_cast<HiddenLayer<T>*>(layers_[i].get()))
+                hidden->set_seed(derive_seed(init_seed_, i));
+        if (layers_.size() >= 2)
+        {
+            int last = layers_.size() - 1;
+            layers_[0]->compile(std::weak_ptr<Layer<T>>(), layers_[1]);
+            layers_[last]->compile(layers_[last - 1], nullptr);
+        }
+        for (size_t i = 1; i < layers_.size() - 1; i++)
+            layers_[i]->compile(layers_[i - 1], layers_[i + 1]);
+
+        steps_.clear();
+        for (size_t i = 0; i < layers_.size(); i++)
+        {
+            Step step;
+            step.layer = layers_[i].get();
+            step.hidden = dynamic_cast<HiddenLayer<T>*>(step.layer);
+            step.next = i + 1 < layers_.size()
+                      ? dynamic_cast<HiddenLayer<T>*>(layers_[i + 1].get()) : nullptr;
+            step.inputs = i > 0 ? layers_[i - 1]->get_nb_neurons() : 0;
+            step.outputs = layers_[i]->get_nb_neurons();
+            if (i > 0 && step.hidden == nullptr)
+                throw std::invalid_argument("Only the first layer may be an input layer");
+            steps_.push_back(step);
+        }
+        profiler_.resize(layers_.size());
+    }
+
+    // Lays out every buffer of a training step in one workspace, so that
+    // steps make no heap allocation
+    void plan(int batch_size)
+    {
+        const int share = (batch_size + nb_replicas_ - 1) / nb_replicas_;
+        const size_t last = layers_.size() - 1;
+
+        workspace_ = Workspace<T>();
+        replicas_.assign(nb_replicas_, Replica());
+        std::vector<int> x_slots;
+        std::vector<int> y_slots;
+        for (int r = 0; r < nb_replicas_; r++)
+        {
+            if (r > 0)
+                replicas_[r].contexts.resize(layers_.size());
+            for (size_t l = 0; l <= last; l++)
+                replicas_[r].step_contexts.push_back(
+                    r == 0 ? &layers_[l]->get_context() : &replicas_[r].contexts[l]);
+            x_slots.push_back(workspace_.reserve(layers_[0]->get_nb_neurons(), share));
+            y_slots.push_back(workspace_.reserve(layers_[last]->get_nb_neurons(), share));
+            for (size_t l = 0; l <= last; l++)
+            {
+                context(r, l).slots.clear();
+                layers_[l]->reserve(workspace_, context(r, l), share);
+            }
+        }
+
+        workspace_.allocate();
+        for (int r = 0; r < nb_replicas_; r++)
+        {
+            replicas_[r].x_buffer = workspace_.slot(x_slots[r]);
+            replicas_[r].y_buffer = workspace_.slot(y_slots[r]);
+            for (size_t l = 0; l <= last; l++)
+                layers_[l]->bind(workspace_, context(r, l));
+        }
+        planned_batch_size_ = batch_size;
+    }
 
-private:
     bool compiled_;
     T learning_rate_;
+    Optimizer<T> optimizer_;
+    Loss<T> loss_;
     std::vector<std::shared_ptr<Layer<T>>> layers_;
+    // Execution plan over layers_, see Step
+    std::vector<Step> steps_;
+
+    int nb_replicas_ = 1;
+    std::vector<Replica> replicas_;
+    Workspace<T> workspace_;
+    mutable Profiler profiler_;
+    inference_mode mode_ = inference_mode::FLOAT;
+    int planned_batch_size_ = 0;
+
+    // Training loss, see get_batch_loss
+    double batch_loss_ = 0;
+    double epoch_loss_ = 0;
+    double epoch_loss_sum_ = 0;
+    size_t epoch_samples_ = 0;
+
+    // Epochs trained since compile(), and the validation run after every
+    // validation_every_ of them, see set_validation
+    int epoch_ = 0;
+    std::function<Evaluation(const Model&)> validate_;
+    int validation_every_ = 1;
+    std::function<bool(int, const Evaluation&)> on_validation_;
+
+    // Position of train(), saved in checkpoints: batches trained since
+    // compile() and in the current epoch, and the batch size and shuffle
+    // seed of the train() call that started at epoch first_epoch_
+    long step_ = 0;
+    size_t batch_ = 0;
+    int batch_size_ = 0;
+    uint64_t seed_ = 0;
+    int first_epoch_ = 0;
+    // Seed of the initial parameters, one stream per layer
+    uint64_t init_seed_;
+    std::unique_ptr<CheckpointWriter<T>> checkpoints_;
+    int checkpoint_every_ = 1;
+
+    // Gradual pruning, see set_pruning_schedule
+    double pruning_sparsity_ = 0;
+    int pruning_epochs_ = 0;
+    int pruning_epoch_ = 0;
 };
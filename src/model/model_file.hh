@@ -0,0 +1,273 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../layer/input_layer.hh"
+#include "../layer_implem/dense_layer.hh"
+
+// Binary model format. All fields are in the byte order of the host that
+// wrote the file:
+//
+//   ModelFileHeader
+//   ModelFileLayer, one per layer
+//   weights then biases of each dense layer, row-major, each array on a
+//   model_file_alignment boundary
+//
+// Offsets are from the start of the file, so a mapped file is used in
+// place: the loaded matrices are views over the mapped pages, which are
+// shared by every process mapping the same file until one writes to them.
+// Pruned layers are saved dense, and loaded dense. Convolution and pooling
+// layers cannot be saved yet.
+
+struct ModelFileHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t value_size; // sizeof(T)
+    uint32_t nb_layers;
+    double learning_rate;
+};
+
+struct ModelFileLayer
+{
+    uint32_t kind; // layer_kind
+    uint32_t nb_neurons;
+    uint32_t activation; // activation_id, dense layers only
+    uint32_t activation_mode; // math_mode, 0 (EXACT) in older files
+    double activation_parameter;
+    uint64_t weights_offset;
+    uint64_t biases_offset;
+};
+
+constexpr char model_file_magic[8] = { 'P', 'R', 'O', 'P', 'H', 'E', 'C', 'Y' };
+constexpr uint32_t model_file_version = 1;
+constexpr uint32_t model_file_byte_order = 0x01020304;
+constexpr uint64_t model_file_alignment = 64;
+
+inline uint64_t model_file_align(uint64_t offset)
+{
+    return (offset + model_file_alignment - 1) / model_file_alignment * model_file_alignment;
+}
+
+// Dense layer with an activation that has a math_mode
+template <typename T, template <typename, math_mode> class Activation>
+Layer<T>* make_dense_layer(int nb_neurons, math_mode mode)
+{
+    switch (mode)
+    {
+        case math_mode::EXACT:
+            return new DenseLayer<T, Activation<T, math_mode::EXACT>>(nb_neurons);
+        case math_mode::FAST:
+            return new DenseLayer<T, Activation<T, math_mode::FAST>>(nb_neurons);
+        case math_mode::TABLE:
+            return new DenseLayer<T, Activation<T, math_mode::TABLE>>(nb_neurons);
+        default:
+            throw std::runtime_error("Bad model file: unknown math mode");
+    }
+}
+
+// Dense layer with the activation recorded in a file
+template <typename T>
+Layer<T>* make_dense_layer(int nb_neurons, activation_id activation, double parameter,
+                           math_mode mode)
+{
+    switch (activation)
+    {
+        case activation_id::SIGMOID:
+            return make_dense_layer<T, Sigmoid>(nb_neurons, mode);
+        case activation_id::TANH:
+            return make_dense_layer<T, Tanh>(nb_neurons, mode);
+        case activation_id::RELU:
+            return new DenseLayer<T, ReLU<T>>(nb_neurons);
+        case activation_id::LEAKY_RELU:
+            return new DenseLayer<T, LeakyReLU<T>>(nb_neurons,
+                                                   LeakyReLU<T>(static_cast<T>(parameter)));
+        case activation_id::SOFTPLUS:
+            return make_dense_layer<T, Softplus>(nb_neurons, mode);
+        case activation_id::SOFTMAX:
+            return new DenseLayer<T, Softmax<T>>(nb_neurons);
+        default:
+            throw std::runtime_error("Bad model file: unknown activation");
+    }
+}
+
+// Writes the layers of a compiled model. The file is written next to path
+// and renamed over it, so readers never see a partial model.
+template <typename T>
+void write_model_file(const std::string& path,
+                      const std::vector<std::shared_ptr<Layer<T>>>& layers,
+                      T learning_rate)
+{
+    ModelFileHeader header;
+    std::memcpy(header.magic, model_file_magic, sizeof(header.magic));
+    header.version = model_file_version;
+    header.byte_order = model_file_byte_order;
+    header.value_size = sizeof(T);
+    header.nb_layers = layers.size();
+    header.learning_rate = learning_rate;
+
+    // Lay out the parameters after the layer table
+    std::vector<ModelFileLayer> entries(layers.size());
+    std::vector<const HiddenLayer<T>*> hidden(layers.size(), nullptr);
+    uint64_t offset = sizeof(ModelFileHeader) + layers.size() * sizeof(ModelFileLayer);
+    for (size_t l = 0; l < layers.size(); l++)
+    {
+        ModelFileLayer& entry = entries[l];
+        std::memset(&entry, 0, sizeof(entry));
+        entry.kind = static_cast<uint32_t>(layers[l]->get_kind());
+        entry.nb_neurons = layers[l]->get_nb_neurons();
+
+        hidden[l] = dynamic_cast<const HiddenLayer<T>*>(layers[l].get());
+        if (hidden[l] == nullptr)
+            continue;
+        if (layers[l]->get_kind() != layer_kind::DENSE)
+            throw std::invalid_argument("Cannot save convolution or pooling layers");
+        if (hidden[l]->get_activation() == activation_id::CUSTOM)
+            throw std::invalid_argument("Cannot save a layer with a custom activation");
+        entry.activation = static_cast<uint32_t>(hidden[l]->get_activation());
+        entry.activation_parameter = hidden[l]->get_activation_parameter();
+        entry.activation_mode = static_cast<uint32_t>(hidden[l]->get_math_mode());
+
+        const Matrix<T>& weights = hidden[l]->get_weights(); // shape only
+        entry.weights_offset = model_file_align(offset);
+        offset = entry.weights_offset + sizeof(T) * weights.get_rows() * weights.get_cols();
+        entry.biases_offset = model_file_align(offset);
+        offset = entry.biases_offset + sizeof(T) * hidden[l]->get_biases().get_rows();
+    }
+
+    const std::string tmp_path = path + ".tmp";
+    std::ofstream out(tmp_path, std::ios::binary | std::ios::trunc);
+    if (!out)
+        throw std::runtime_error("Cannot open " + tmp_path);
+
+    uint64_t written = 0;
+    auto write = [&out, &written](const void* data, uint64_t bytes) {
+        out.write(static_cast<const char*>(data), bytes);
+        written += bytes;
+    };
+    auto pad_to = [&out, &written](uint64_t target) {
+        while (written < target)
+        {
+            out.put(0);
+            written++;
+        }
+    };
+
+    write(&header, sizeof(header));
+    write(entries.data(), entries.size() * sizeof(ModelFileLayer));
+    for (size_t l = 0; l < layers.size(); l++)
+    {
+        if (hidden[l] == nullptr)
+            continue;
+        const Matrix<T> weights = hidden[l]->get_dense_weights();
+        const Matrix<T>& biases = hidden[l]->get_biases();
+        pad_to(entries[l].weights_offset);
+        write(weights.get_data(), sizeof(T) * weights.get_rows() * weights.get_cols());
+        pad_to(entries[l].biases_offset);
+        write(biases.get_data(), sizeof(T) * biases.get_rows());
+    }
+
+    out.close();
+    if (!out || std::rename(tmp_path.c_str(), path.c_str()) != 0)
+    {
+        std::remove(tmp_path.c_str());
+        throw std::runtime_error("Cannot write " + path);
+    }
+}
+
+// Maps a model file and rebuilds its layers. Parameters are views over the
+// private, copy-on-write mapping, which stays alive as long as one of them
+// does; nothing is read from disk until it is used.
+template <typename T>
+std::vector<std::shared_ptr<Layer<T>>> read_model_file(const std::string& path,
+                                                       T& learning_rate)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        throw std::runtime_error("Cannot open " + path);
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || static_cast<uint64_t>(st.st_size) < sizeof(ModelFileHeader))
+    {
+        close(fd);
+        throw std::runtime_error("Bad model file: " + path);
+    }
+
+    const uint64_t size = st.st_size;
+    void* address = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (address == MAP_FAILED)
+        throw std::runtime_error("Cannot map " + path);
+
+    std::shared_ptr<T[]> mapping(static_cast<T*>(address),
+                                 [size](T* p) { munmap(p, size); });
+    char* base = static_cast<char*>(address);
+    auto fail = [&path](const char* reason) {
+        return std::runtime_error("Bad model file " + path + ": " + reason);
+    };
+
+    ModelFileHeader header;
+    std::memcpy(&header, base, sizeof(header));
+    if (std::memcmp(header.magic, model_file_magic, sizeof(header.magic)) != 0)
+        throw fail("not a model");
+    if (header.version != model_file_version)
+        throw fail("unsupported version");
+    if (header.byte_order != model_file_byte_order || header.value_size != sizeof(T))
+        throw fail("written with another byte order or value type");
+    if (header.nb_layers < 2
+        || (size - sizeof(header)) / sizeof(ModelFileLayer) < header.nb_layers)
+        throw fail("truncated layer table");
+
+    // View over an array of the file, checked against its size
+    auto array = [&](uint64_t offset, int rows, int cols) {
+        const uint64_t bytes = sizeof(T) * static_cast<uint64_t>(rows) * cols;
+        if (offset % model_file_alignment != 0 || offset > size || size - offset < bytes)
+            throw fail("parameters out of the file");
+        return Matrix<T>(mapping, reinterpret_cast<T*>(base + offset), rows, cols);
+    };
+
+    std::vector<std::shared_ptr<Layer<T>>> layers;
+    for (uint32_t l = 0; l < header.nb_layers; l++)
+    {
+        ModelFileLayer entry;
+        std::memcpy(&entry, base + sizeof(header) + l * sizeof(ModelFileLayer), sizeof(entry));
+        const int nb_neurons = entry.nb_neurons;
+        if (nb_neurons <= 0)
+            throw fail("empty layer");
+
+        if (l == 0)
+        {
+            if (entry.kind != static_cast<uint32_t>(layer_kind::INPUT))
+                throw fail("first layer is not an input layer");
+            layers.emplace_back(new InputLayer<T>(nb_neurons));
+            continue;
+        }
+        if (entry.kind != static_cast<uint32_t>(layer_kind::DENSE))
+            throw fail("unknown layer");
+
+        std::shared_ptr<Layer<T>> layer(make_dense_layer<T>(
+            nb_neurons, static_cast<activation_id>(entry.activation),
+            entry.activation_parameter, static_cast<math_mode>(entry.activation_mode)));
+        const int inputs = layers.back()->get_nb_neurons();
+        std::static_pointer_cast<HiddenLayer<T>>(layer)->set_parameters(
+            array(entry.weights_offset, nb_neurons, inputs),
+            array(entry.biases_offset, nb_neurons, 1));
+        layers.push_back(layer);
+    }
+
+    learning_rate = header.learning_rate;
+    return layers;
+}
@@ -0,0 +1,113 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <memory>
+
+// Per-layer wall-time and FLOP counters of the training and inference
+// passes. Collected only when built with -DPROPHECY_PROFILE (make profile);
+// otherwise ProfileScope is empty and compiles away.
+#ifdef PROPHECY_PROFILE
+constexpr bool profiling_enabled = true;
+#else
+constexpr bool profiling_enabled = false;
+#endif
+
+enum class profile_pass
+{
+    FORWARD,
+    BACKWARD,
+    UPDATE
+};
+
+constexpr int nb_profile_passes = 3;
+
+class Profiler
+{
+public:
+    struct Counters
+    {
+        long long calls = 0;
+        long long nanoseconds = 0; // summed over threads
+        double flops = 0;
+    };
+
+    explicit Profiler(size_t nb_layers = 0) { resize(nb_layers); }
+
+    // Clears the counters
+    void resize(size_t nb_layers)
+    {
+        nb_layers_ = nb_layers;
+        slots_.reset(new Slot[nb_layers * nb_profile_passes]);
+    }
+
+    void reset(void) { resize(nb_layers_); }
+
+    size_t size(void) const { return nb_layers_; }
+
+    // Thread-safe
+    void record(size_t layer, profile_pass pass, long long nanoseconds, double flops)
+    {
+        Slot& slot = slots_[layer * nb_profile_passes + static_cast<int>(pass)];
+        slot.calls.fetch_add(1, std::memory_order_relaxed);
+        slot.nanoseconds.fetch_add(nanoseconds, std::memory_order_relaxed);
+        slot.flops.fetch_add(static_cast<long long>(flops), std::memory_order_relaxed);
+    }
+
+    Counters get(size_t layer, profile_pass pass) const
+    {
+        const Slot& slot = slots_[layer * nb_profile_passes + static_cast<int>(pass)];
+        Counters counters;
+        counters.calls = slot.calls.load(std::memory_order_relaxed);
+        counters.nanoseconds = slot.nanoseconds.load(std::memory_order_relaxed);
+        counters.flops = slot.flops.load(std::memory_order_relaxed);
+        return counters;
+    }
+
+private:
+    struct Slot
+    {
+        std::atomic<long long> calls{0};
+        std::atomic<long long> nanoseconds{0};
+        std::atomic<long long> flops{0};
+    };
+
+    size_t nb_layers_ = 0;
+    std::unique_ptr<Slot[]> slots_;
+};
+
+// Times its scope into a Profiler when profiling is enabled. flops() is
+// only evaluated then, so it may be as costly as a virtual call:
+//
+//   ProfileScope scope(profiler, l, profile_pass::FORWARD,
+//                      [&]() { return layer.forward_flops(batch); });
+template <typename Flops>
+class ProfileScope
+{
+public:
+    ProfileScope(Profiler& profiler, size_t layer, profile_pass pass, const Flops& flops)
+        : profiler_(profiler), layer_(layer), pass_(pass), flops_(flops)
+    {
+        if constexpr (profiling_enabled)
+            start_ = std::chrono::steady_clock::now();
+    }
+
+    ~ProfileScope()
+    {
+        if constexpr (profiling_enabled)
+        {
+            auto elapsed = std::chrono::steady_clock::now() - start_;
+            profiler_.record(layer_, pass_,
+                std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count(),
+                flops_());
+        }
+    }
+
+private:
+    Profiler& profiler_;
+    size_t layer_;
+    profile_pass pass_;
+    Flops flops_;
+    std::chrono::steady_clock::time_point start_;
+};
@@ -0,0 +1,436 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "../matrix/simd.hh"
+#include "training_state.hh"
+
+#if PROPHECY_SIMD_X86
+#include <immintrin.h>
+#endif
+
+// Gradient descent rules, selected at Model::compile:
+//
+//   model.compile(Optimizer<float>::adam(0.001), batch_size);
+//
+// Gradients are the sums over the batch accumulated by backward(). Each
+// parameter tensor has an OptimizerState, whose step() updates the
+// parameters and the rule's moments and zeroes the gradients in a single
+// pass, with the kernels of the CPU like the elementwise ones (simd.hh).
+
+enum class optimizer_id : uint32_t
+{
+    SGD,
+    MOMENTUM,
+    NESTEROV,
+    RMSPROP,
+    ADAM
+};
+
+inline const char* optimizer_name(optimizer_id id)
+{
+    switch (id)
+    {
+        case optimizer_id::SGD:
+            return "sgd";
+        case optimizer_id::MOMENTUM:
+            return "momentum";
+        case optimizer_id::NESTEROV:
+            return "nesterov";
+        case optimizer_id::RMSPROP:
+            return "rmsprop";
+        case optimizer_id::ADAM:
+            return "adam";
+        default:
+            return "unknown";
+    }
+}
+
+template <typename T>
+struct Optimizer
+{
+    optimizer_id id = optimizer_id::SGD;
+    T learning_rate = 0.01;
+    // Decay of the first moment (momentum, Adam's beta1) and of the second
+    // one (RMSProp's rho, Adam's beta2)
+    T decay1 = 0;
+    T decay2 = 0;
+    T epsilon = 0;
+
+    static Optimizer sgd(T learning_rate)
+    {
+        return make(optimizer_id::SGD, learning_rate, 0, 0, 0);
+    }
+
+    static Optimizer momentum(T learning_rate, T momentum = 0.9, bool nesterov = false)
+    {
+        return make(nesterov ? optimizer_id::NESTEROV : optimizer_id::MOMENTUM,
+                    learning_rate, momentum, 0, 0);
+    }
+
+    static Optimizer rmsprop(T learning_rate, T rho = 0.9, T epsilon = 1e-7)
+    {
+        return make(optimizer_id::RMSPROP, learning_rate, 0, rho, epsilon);
+    }
+
+    static Optimizer adam(T learning_rate, T beta1 = 0.9, T beta2 = 0.999, T epsilon = 1e-7)
+    {
+        return make(optimizer_id::ADAM, learning_rate, beta1, beta2, epsilon);
+    }
+
+    // Moment arrays kept per parameter
+    int nb_moments(void) const
+    {
+        return id == optimizer_id::SGD ? 0 : id == optimizer_id::ADAM ? 2 : 1;
+    }
+
+private:
+    static Optimizer make(optimizer_id id, T learning_rate, T decay1, T decay2, T epsilon)
+    {
+        if (!(learning_rate > 0) || decay1 < 0 || decay1 >= 1 || decay2 < 0 || decay2 >= 1
+            || epsilon < 0)
+            throw std::invalid_argument("Bad optimizer parameters");
+        Optimizer optimizer;
+        optimizer.id = id;
+        optimizer.learning_rate = learning_rate;
+        optimizer.decay1 = decay1;
+        optimizer.decay2 = decay2;
+        optimizer.epsilon = epsilon;
+        return optimizer;
+    }
+};
+
+// Scalars of one step, bias corrections included
+template <typename T>
+struct OptimizerStep
+{
+    T learning_rate;
+    T decay1;
+    T decay2;
+    T epsilon;
+};
+
+// In-place sqrt of a scalar or of a whole register: std::sqrt is not
+// vectorized while it may set errno. The vector ones are inlined into the
+// entry points below, which have their instruction set.
+template <typename T>
+inline std::enable_if_t<std::is_arithmetic<T>::value> simd_sqrt(T& x)
+{
+    x = std::sqrt(x);
+}
+
+#if PROPHECY_SIMD_X86
+typedef float simd_float4 __attribute__((vector_size(16)));
+typedef float simd_float8 __attribute__((vector_size(32)));
+typedef float simd_float16 __attribute__((vector_size(64)));
+typedef double simd_double2 __attribute__((vector_size(16)));
+typedef double simd_double4 __attribute__((vector_size(32)));
+typedef double simd_double8 __attribute__((vector_size(64)));
+
+__attribute__((target("sse2")))
+inline void simd_sqrt(simd_float4& x) { x = _mm_sqrt_ps(x); }
+__attribute__((target("sse2")))
+inline void simd_sqrt(simd_double2& x) { x = _mm_sqrt_pd(x); }
+__attribute__((target("avx")))
+inline void simd_sqrt(simd_float8& x) { x = _mm256_sqrt_ps(x); }
+__attribute__((target("avx")))
+inline void simd_sqrt(simd_double4& x) { x = _mm256_sqrt_pd(x); }
+// Masked forms with every lane set: the plain ones start from an undefined
+// register, which GCC 12 flags as maybe uninitialized
+__attribute__((target("avx512f")))
+inline void simd_sqrt(simd_float16& x) { x = _mm512_maskz_sqrt_ps(0xffff, x); }
+__attribute__((target("avx512f")))
+inline void simd_sqrt(simd_double8& x) { x = _mm512_maskz_sqrt_pd(0xff, x); }
+#endif
+
+// Update rules, on a scalar or a register: w the parameters, g the
+// gradients, m and v the moments
+struct sgd_rule
+{
+    static constexpr int nb_moments = 0;
+
+    template <typename V, typename T>
+    static inline __attribute__((always_inline))
+    void apply(V& w, const V& g, V&, V&, const OptimizerStep<T>& s)
+    {
+        w -= s.learning_rate * g;
+    }
+};
+
+struct momentum_rule
+{
+    static constexpr int nb_moments = 1;
+
+    template <typename V, typename T>
+    static inline __attribute__((always_inline))
+    void apply(V& w, const V& g, V& m, V&, const OptimizerStep<T>& s)
+    {
+        m = s.decay1 * m + g;
+        w -= s.learning_rate * m;
+    }
+};
+
+// Gradient at the look-ahead point, in the reformulation which only keeps
+// the current parameters
+struct nesterov_rule
+{
+    static constexpr int nb_moments = 1;
+
+    template <typename V, typename T>
+    static inline __attribute__((always_inline))
+    void apply(V& w, const V& g, V& m, V&, const OptimizerStep<T>& s)
+    {
+        m = s.decay1 * m + g;
+        w -= s.learning_rate * (g + s.decay1 * m);
+    }
+};
+
+struct rmsprop_rule
+{
+    static constexpr int nb_moments = 1;
+
+    template <typename V, typename T>
+    static inline __attribute__((always_inline))
+    void apply(V& w, const V& g, V& v, V&, const OptimizerStep<T>& s)
+    {
+        v = s.decay2 * v + (1 - s.decay2) * g * g;
+        V root = v;
+        simd_sqrt(root);
+        w -= s.learning_rate * g / (root + s.epsilon);
+    }
+};
+
+// The bias corrections are folded into the step's learning rate and
+// epsilon, see OptimizerState::step
+struct adam_rule
+{
+    static constexpr int nb_moments = 2;
+
+    template <typename V, typename T>
+    static inline __attribute__((always_inline))
+    void apply(V& w, const V& g, V& m, V& v, const OptimizerStep<T>& s)
+    {
+        m = s.decay1 * m + (1 - s.decay1) * g;
+        v = s.decay2 * v + (1 - s.decay2) * g * g;
+        V root = v;
+        simd_sqrt(root);
+        w -= s.learning_rate * m / (root + s.epsilon);
+    }
+};
+
+// Fused loop of a rule, always inlined into a target-specific entry point
+// like SimdLoop: parameters, moments and the zeroed gradients are each
+// read and written once.
+template <typename T, int Bytes>
+struct OptimizerLoop
+{
+    typedef T vec __attribute__((vector_size(Bytes)));
+    static constexpr int width = Bytes / sizeof(T);
+
+    template <typename Rule>
+    static inline __attribute__((always_inline))
+    void run(T* w, T* g, T* m, T* v, int n, const OptimizerStep<T>& s)
+    {
+        const vec zero = {};
+        int i = 0;
+        for (; i + width <= n; i += width)
+        {
+            vec vw;
+            vec vg;
+            vec vm = zero;
+            vec vv = zero;
+            std::memcpy(&vw, w + i, sizeof(vec));
+            std::memcpy(&vg, g + i, sizeof(vec));
+            if constexpr (Rule::nb_moments >= 1)
+                std::memcpy(&vm, m + i, sizeof(vec));
+            if constexpr (Rule::nb_moments >= 2)
+                std::memcpy(&vv, v + i, sizeof(vec));
+            Rule::apply(vw, vg, vm, vv, s);
+            std::memcpy(w + i, &vw, sizeof(vec));
+            std::memcpy(g + i, &zero, sizeof(vec));
+            if constexpr (Rule::nb_moments >= 1)
+                std::memcpy(m + i, &vm, sizeof(vec));
+            if constexpr (Rule::nb_moments >= 2)
+                std::memcpy(v + i, &vv, sizeof(vec));
+        }
+        for (; i < n; ++i)
+        {
+            T unused = 0;
+            Rule::apply(w[i], g[i], Rule::nb_moments >= 1 ? m[i] : unused,
+                        Rule::nb_moments >= 2 ? v[i] : unused, s);
+            g[i] = 0;
+        }
+    }
+};
+
+template <typename T, typename Rule>
+void optimizer_scalar(T* w, T* g, T* m, T* v, int n, const OptimizerStep<T>& s)
+{
+    for (int i = 0; i < n; ++i)
+    {
+        T unused = 0;
+        Rule::apply(w[i], g[i], Rule::nb_moments >= 1 ? m[i] : unused,
+                    Rule::nb_moments >= 2 ? v[i] : unused, s);
+        g[i] = 0;
+    }
+}
+
+#if PROPHECY_SIMD_X86
+template <typename T, typename Rule>
+__attribute__((target("sse2")))
+void optimizer_sse2(T* w, T* g, T* m, T* v, int n, const OptimizerStep<T>& s)
+{
+    OptimizerLoop<T, 16>::template run<Rule>(w, g, m, v, n, s);
+}
+
+template <typename T, typename Rule>
+__attribute__((target("avx2")))
+void optimizer_avx2(T* w, T* g, T* m, T* v, int n, const OptimizerStep<T>& s)
+{
+    OptimizerLoop<T, 32>::template run<Rule>(w, g, m, v, n, s);
+}
+
+template <typename T, typename Rule>
+__attribute__((target("avx512f")))
+void optimizer_avx512(T* w, T* g, T* m, T* v, int n, const OptimizerStep<T>& s)
+{
+    OptimizerLoop<T, 64>::template run<Rule>(w, g, m, v, n, s);
+}
+#endif
+
+// Dispatch table, indexed by optimizer_id
+template <typename T>
+struct OptimizerKernels
+{
+    typedef void (*kernel)(T* w, T* g, T* m, T* v, int n, const OptimizerStep<T>& s);
+
+    kernel rules[5];
+
+    static OptimizerKernels<T> for_level(simd_level level)
+    {
+#if PROPHECY_SIMD_X86
+        if constexpr (std::is_same<T, float>::value || std::is_same<T, double>::value)
+        {
+            switch (level)
+            {
+                case simd_level::AVX512:
+                    return { { optimizer_avx512<T, sgd_rule>, optimizer_avx512<T, momentum_rule>,
+                               optimizer_avx512<T, nesterov_rule>, optimizer_avx512<T, rmsprop_rule>,
+                               optimizer_avx512<T, adam_rule> } };
+                case simd_level::AVX2:
+                    return { { optimizer_avx2<T, sgd_rule>, optimizer_avx2<T, momentum_rule>,
+                               optimizer_avx2<T, nesterov_rule>, optimizer_avx2<T, rmsprop_rule>,
+                               optimizer_avx2<T, adam_rule> } };
+                case simd_level::SSE2:
+                    return { { optimizer_sse2<T, sgd_rule>, optimizer_sse2<T, momentum_rule>,
+                               optimizer_sse2<T, nesterov_rule>, optimizer_sse2<T, rmsprop_rule>,
+                               optimizer_sse2<T, adam_rule> } };
+                case simd_level::SCALAR:
+                    break;
+            }
+        }
+#endif
+        (void) level;
+        return { { optimizer_scalar<T, sgd_rule>, optimizer_scalar<T, momentum_rule>,
+                   optimizer_scalar<T, nesterov_rule>, optimizer_scalar<T, rmsprop_rule>,
+                   optimizer_scalar<T, adam_rule> } };
+    }
+
+    static const OptimizerKernels<T>& get(void)
+    {
+        static const OptimizerKernels<T> kernels = for_level(active_simd_level());
+        return kernels;
+    }
+};
+
+// Moments of one parameter tensor. They start at zero, and again whenever
+// the rule or the size of the tensor changes.
+template <typename T>
+class OptimizerState
+{
+public:
+    // Updates the n parameters from their gradients, and zeroes these
+    void step(const Optimizer<T>& optimizer, T* parameters, T* gradients, int n)
+    {
+        if (optimizer.id != id_ || size_ != n)
+        {
+            id_ = optimizer.id;
+            size_ = n;
+            steps_ = 0;
+            first_.assign(optimizer.nb_moments() >= 1 ? n : 0, 0);
+            second_.assign(optimizer.nb_moments() >= 2 ? n : 0, 0);
+        }
+        steps_++;
+
+        OptimizerStep<T> s = { optimizer.learning_rate, optimizer.decay1, optimizer.decay2,
+                               optimizer.epsilon };
+        if (optimizer.id == optimizer_id::ADAM)
+        {
+            // lr * m / (1 - b1^t) / (sqrt(v / (1 - b2^t)) + eps), with the
+            // corrections moved out of the loop
+            const double correction1 = 1 - std::pow(static_cast<double>(optimizer.decay1), steps_);
+            const double correction2 = std::sqrt(
+                1 - std::pow(static_cast<double>(optimizer.decay2), steps_));
+            s.learning_rate = optimizer.learning_rate * correction2 / correction1;
+            s.epsilon = optimizer.epsilon * correction2;
+        }
+
+        OptimizerKernels<T>::get().rules[static_cast<int>(optimizer.id)](
+            parameters, gradients, first_.data(), second_.data(), n, s);
+    }
+
+    // Back to zero moments
+    void reset(void) { size_ = -1; }
+
+    // Moments and step count, for checkpoints
+    void save(TrainingState<T>& state) const
+    {
+        state.put_counter(static_cast<int64_t>(id_));
+        state.put_counter(size_);
+        state.put_counter(steps_);
+        state.put_array(first_.data(), first_.size());
+        state.put_array(second_.data(), second_.size());
+    }
+
+    // Moments of a tensor of n parameters. Throws std::runtime_error if
+    // they were saved for another size or do not fit their rule: step()
+    // would go out of bounds.
+    void restore(TrainingState<T>& state, int n)
+    {
+        const int64_t id = state.get_counter();
+        const int64_t size = state.get_counter();
+        const int64_t steps = state.get_counter();
+        const std::vector<T>& first = state.get_array();
+        const std::vector<T>& second = state.get_array();
+        if (id < 0 || id > static_cast<int64_t>(optimizer_id::ADAM) || size < -1 || steps < 0)
+            throw std::runtime_error("Bad checkpoint: optimizer state");
+
+        // A reset state (size -1) keeps stale arrays, never read
+        Optimizer<T> rule;
+        rule.id = static_cast<optimizer_id>(id);
+        const size_t first_size = rule.nb_moments() >= 1 ? n : 0;
+        const size_t second_size = rule.nb_moments() >= 2 ? n : 0;
+        if (size >= 0 && (size != n || first.size() != first_size
+                          || second.size() != second_size))
+            throw std::runtime_error("Checkpoint does not match the model");
+
+        id_ = rule.id;
+        size_ = size;
+        steps_ = steps;
+        first_.assign(first.begin(), first.end());
+        second_.assign(second.begin(), second.end());
+    }
+
+private:
+    optimizer_id id_ = optimizer_id::SGD;
+    int size_ = -1;
+    long steps_ = 0;
+    std::vector<T> first_;
+    std::vector<T> second_;
+};
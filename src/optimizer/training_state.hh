@@ -0,0 +1,101 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+
+// Flat copy of a training state, see Model::set_checkpoints: integer
+// counters, double scalars and arrays of values, read back in the order
+// they were put. clear() keeps the capacity of the arrays, so taking the
+// same snapshot again does not allocate.
+template <typename T>
+class TrainingState
+{
+public:
+    void clear(void)
+    {
+        counters_.clear();
+        scalars_.clear();
+        nb_arrays_ = 0;
+        rewind();
+    }
+
+    // Back to the first value of each kind, for reading
+    void rewind(void)
+    {
+        next_counter_ = 0;
+        next_scalar_ = 0;
+        next_array_ = 0;
+    }
+
+    void put_counter(int64_t value) { counters_.push_back(value); }
+    void put_scalar(double value) { scalars_.push_back(value); }
+
+    void put_array(const T* data, size_t n)
+    {
+        std::copy(data, data + n, put_array(n));
+    }
+
+    // Appends an array of n values, left for the caller to fill
+    T* put_array(size_t n)
+    {
+        if (nb_arrays_ == arrays_.size())
+            arrays_.emplace_back();
+        std::vector<T>& array = arrays_[nb_arrays_++];
+        array.resize(n);
+        return array.data();
+    }
+
+    int64_t get_counter(void)
+    {
+        if (next_counter_ >= counters_.size())
+            throw mismatch();
+        return counters_[next_counter_++];
+    }
+
+    double get_scalar(void)
+    {
+        if (next_scalar_ >= scalars_.size())
+            throw mismatch();
+        return scalars_[next_scalar_++];
+    }
+
+    const std::vector<T>& get_array(void)
+    {
+        if (next_array_ >= nb_arrays_)
+            throw mismatch();
+        return arrays_[next_array_++];
+    }
+
+    // Copies the next array to data, which must hold exactly n values
+    void get_array(T* data, size_t n)
+    {
+        const std::vector<T>& array = get_array();
+        if (array.size() != n)
+            throw mismatch();
+        std::copy(array.begin(), array.end(), data);
+    }
+
+    const std::vector<int64_t>& get_counters(void) const { return counters_; }
+    const std::vector<double>& get_scalars(void) const { return scalars_; }
+    size_t get_nb_arrays(void) const { return nb_arrays_; }
+    const std::vector<T>& array(size_t i) const { return arrays_[i]; }
+
+private:
+    static std::runtime_error mismatch(void)
+    {
+        return std::runtime_error("Checkpoint does not match the model");
+    }
+
+    std::vector<int64_t> counters_;
+    std::vector<double> scalars_;
+    // Only the first nb_arrays_ are in use; the others keep their storage
+    std::vector<std::vector<T>> arrays_;
+    size_t nb_arrays_ = 0;
+
+    size_t next_counter_ = 0;
+    size_t next_scalar_ = 0;
+    size_t next_array_ = 0;
+};
@@ -0,0 +1,106 @@
+#include <cmath>
+#include <criterion/criterion.h>
+
+#include "../src/activation_function/activation_function.hh"
+
+// fd(z, f(z)) against a central difference of f
+template <typename A>
+static void check_derivative(const A& activation)
+{
+    const double h = 1e-5;
+    for (double z = -6.0; z <= 6.0; z += 0.37)
+    {
+        double numeric = (activation.f(z + h) - activation.f(z - h)) / (2 * h);
+        cr_assert_float_eq(activation.fd(z, activation.f(z)), numeric, 1e-6);
+    }
+}
+
+Test(test_activation_function, sigmoid)
+{
+    Sigmoid<double> s;
+    cr_assert_float_eq(s.f(0.0), 0.5, 1e-12);
+    check_derivative(s);
+}
+
+Test(test_activation_function, tanh)
+{
+    Tanh<double> t;
+    cr_assert_float_eq(t.f(0.5), std::tanh(0.5), 1e-12);
+    check_derivative(t);
+}
+
+Test(test_activation_function, relu)
+{
+    ReLU<double> r;
+    cr_assert_float_eq(r.f(-2.0), 0.0, 1e-12);
+    cr_assert_float_eq(r.f(3.0), 3.0, 1e-12);
+    check_derivative(r);
+}
+
+Test(test_activation_function, leaky_relu)
+{
+    LeakyReLU<double> r(0.1);
+    cr_assert_float_eq(r.f(-2.0), -0.2, 1e-12);
+    check_derivative(r);
+}
+
+Test(test_activation_function, softplus)
+{
+    Softplus<double> s;
+    cr_assert_float_eq(s.f(0.0), std::log(2.0), 1e-12);
+    cr_assert_float_eq(s.f(1000.0), 1000.0, 1e-12);
+    check_derivative(s);
+
+    // Small a, for negative z, keeps a non-zero gradient
+    Softplus<float> exact;
+    Softplus<float, math_mode::FAST> fast;
+    for (float z : { -20.0f, -40.0f, -80.0f })
+    {
+        const float sigmoid = 1 / (1 + std::exp(-z));
+        cr_assert_float_eq(exact.fd(z, exact.f(z)), sigmoid, 1e-6 * sigmoid);
+        cr_assert_float_eq(fast.fd(z, fast.f(z)), sigmoid, 1e-6 * sigmoid);
+    }
+    cr_assert_float_eq(s.fd(-40.0, s.f(-40.0)), 1 / (1 + std::exp(40.0)), 1e-22);
+}
+
+Test(test_activation_function, type_erased_sigmoid)
+{
+    SigmoidActivationFunction<double> erased;
+    Sigmoid<double> s;
+    for (double z = -4.0; z <= 4.0; z += 0.5)
+    {
+        cr_assert_float_eq(erased.f(z), s.f(z), 1e-12);
+        cr_assert_float_eq(erased.fd(z, erased.f(z)), s.fd(z, s.f(z)), 1e-12);
+    }
+
+    // Without fda_, fd_ takes z
+    erased.fda_ = nullptr;
+    cr_assert_float_eq(erased.fd(1.0, 0.0), s.fd(1.0, s.f(1.0)), 1e-12);
+}
+
+// FAST and TABLE modes against EXACT, for f and fd
+template <template <typename, math_mode> class A>
+static void check_modes(void)
+{
+    A<double, math_mode::EXACT> exact;
+    A<double, math_mode::FAST> fast;
+    A<float, math_mode::TABLE> table;
+    check_derivative(fast);
+    for (double z = -8.0; z <= 8.0; z += 0.13)
+    {
+        const double a = exact.f(z);
+        const float t = table.f(static_cast<float>(z));
+        cr_assert_float_eq(fast.f(z), a, 1e-14);
+        cr_assert_float_eq(t, a, 3e-6);
+        cr_assert_float_eq(table.fd(static_cast<float>(z), t), exact.fd(z, a), 1e-5);
+    }
+}
+
+Test(test_activation_function, math_modes)
+{
+    check_modes<Sigmoid>();
+    check_modes<Tanh>();
+    check_modes<Softplus>();
+    cr_assert((activation_mode<Tanh<float, math_mode::TABLE>>::value == math_mode::TABLE));
+    cr_assert(activation_mode<ReLU<float>>::value == math_mode::EXACT);
+}
@@ -0,0 +1,159 @@
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <vector>
+#include <criterion/criterion.h>
+
+#include "../src/dataset/importers.hh"
+#include "../src/model/model.hh"
+#include "../src/layer_implem/dense_layer.hh"
+
+static Model<double>* make_model(unsigned seed)
+{
+    auto model = new Model<double>(seed);
+    model->add(new InputLayer<double>(3));
+    model->add(new DenseLayer<double, Tanh<double>>(5));
+    model->add(new DenseLayer<double, Sigmoid<double>>(2));
+    model->compile(Optimizer<double>::adam(0.01), Loss<double>::binary_cross_entropy(), 8);
+    return model;
+}
+
+static void remove_checkpoints(const std::string& prefix)
+{
+    for (const std::string& path : list_checkpoints(prefix))
+        std::remove(path.c_str());
+}
+
+static void create_set(std::vector<Matrix<double>>& x, std::vector<Matrix<double>>& y, int n)
+{
+    set_random_seed(11);
+    for (int s = 0; s < n; s++)
+    {
+        x.emplace_back(3, 1);
+        x.back().fill(fill_type::RANDOM_FLOAT);
+        y.emplace_back(2, 1);
+        y.back()(0, 0) = x.back()(0, 0) > x.back()(1, 0);
+        y.back()(1, 0) = x.back()(2, 0) > 0;
+    }
+}
+
+Test(test_checkpoint, resume_matches_uninterrupted)
+{
+    const std::string prefix = "/tmp/prophecy_test_checkpoint";
+    remove_checkpoints(prefix);
+    std::vector<Matrix<double>> x;
+    std::vector<Matrix<double>> y;
+    create_set(x, y, 40);
+
+    // 5 batches per epoch, checkpoints every 3: the last one is mid-epoch
+    std::unique_ptr<Model<double>> full(make_model(1));
+    full->set_checkpoints(prefix, 3, 2);
+    full->train(x, y, 4, 8);
+    full->flush_checkpoints();
+    const std::vector<std::string> kept = list_checkpoints(prefix);
+    cr_assert_leq(kept.size(), 2u);
+    cr_assert_eq(latest_checkpoint(prefix), prefix + ".18");
+
+    // Other initial weights, overwritten by the checkpoint
+    std::unique_ptr<Model<double>> resumed(make_model(2));
+    resumed->resume(latest_checkpoint(prefix), x, y, 4);
+    remove_checkpoints(prefix);
+
+    const Matrix<double> batch = Matrix<double>::hstack(x, 0, x.size());
+    cr_assert(full->predict(batch) == resumed->predict(batch));
+    cr_assert_eq(full->get_epoch_loss(), resumed->get_epoch_loss());
+}
+
+Test(test_checkpoint, resume_dataset_replays_shuffles)
+{
+    const std::string path = "/tmp/prophecy_test_checkpoint.data";
+    const std::string prefix = "/tmp/prophecy_test_checkpoint_dataset";
+    remove_checkpoints(prefix);
+    std::vector<Matrix<double>> x;
+    std::vector<Matrix<double>> y;
+    create_set(x, y, 37);
+    DatasetWriter<double> writer(path, 3, 2);
+    for (size_t s = 0; s < x.size(); s++)
+        writer.append(x[s].get_data(), y[s].get_data());
+    writer.close();
+    Dataset<double> data(path);
+    std::remove(path.c_str());
+
+    std::unique_ptr<Model<double>> full(make_model(1));
+    full->set_checkpoints(prefix, 7);
+    full->train(data, 3, 8, 42);
+    full->clear_checkpoints();
+    cr_assert_eq(latest_checkpoint(prefix), prefix + ".14");
+
+    // Before the last batch of the third epoch
+    std::unique_ptr<Model<double>> resumed(make_model(2));
+    resumed->resume(latest_checkpoint(prefix), data, 3);
+    remove_checkpoints(prefix);
+
+    const Matrix<double> batch = Matrix<double>::hstack(x, 0, x.size());
+    cr_assert(full->predict(batch) == resumed->predict(batch));
+}
+
+Test(test_checkpoint, errors)
+{
+    const std::string prefix = "/tmp/prophecy_test_checkpoint_errors";
+    remove_checkpoints(prefix);
+    std::vector<Matrix<double>> x;
+    std::vector<Matrix<double>> y;
+    create_set(x, y, 16);
+
+    std::unique_ptr<Model<double>> model(make_model(1));
+    cr_assert_throw(model->set_checkpoints(prefix, 0), std::invalid_argument);
+    model->set_checkpoints(prefix, 1, 1);
+    model->train(x, y, 1, 8);
+    model->flush_checkpoints();
+    cr_assert_eq(list_checkpoints(prefix).size(), 1u);
+
+    // Bad arguments are rejected before the checkpoint is restored
+    std::unique_ptr<Model<double>> fresh(make_model(2));
+    const Matrix<double> batch = Matrix<double>::hstack(x, 0, x.size());
+    const Matrix<double> before = fresh->predict(batch);
+    std::vector<Matrix<double>> short_y(y.begin(), y.end() - 1);
+    cr_assert_throw(fresh->resume(latest_checkpoint(prefix), x, short_y, 2),
+                    std::invalid_argument);
+    cr_assert(fresh->predict(batch) == before);
+
+    // Other layers
+    Model<double> other;
+    other.add(new InputLayer<double>(3));
+    other.add(new DenseLayer<double, Sigmoid<double>>(2));
+    other.compile(0.1);
+    cr_assert_throw(other.resume(latest_checkpoint(prefix), x, y, 2), std::runtime_error);
+    remove_checkpoints(prefix);
+    cr_assert_throw(other.resume(prefix + ".1", x, y, 2), std::runtime_error);
+
+    // Failed writes surface from train() itself
+    model->set_checkpoints("/nonexistent/prophecy", 1);
+    cr_assert_throw(model->train(x, y, 1, 8), std::runtime_error);
+    // Reported once
+    model->clear_checkpoints();
+}
+
+Test(test_checkpoint, rotation_keeps_other_runs)
+{
+    const std::string prefix = "/tmp/prophecy_test_checkpoint_rotation";
+    remove_checkpoints(prefix);
+    std::vector<Matrix<double>> x;
+    std::vector<Matrix<double>> y;
+    create_set(x, y, 32);
+
+    // Left by an earlier run, and older than anything written below
+    FILE* f = std::fopen((prefix + ".0").c_str(), "w");
+    cr_assert(f != nullptr);
+    std::fclose(f);
+
+    std::unique_ptr<Model<double>> model(make_model(1));
+    model->set_checkpoints(prefix, 1, 1);
+    model->train(x, y, 1, 8);
+    const std::vector<std::string> kept = list_checkpoints(prefix);
+    remove_checkpoints(prefix);
+    cr_assert_eq(kept.size(), 2u);
+    cr_assert_eq(kept[0], prefix + ".0");
+    cr_assert_eq(kept[1], prefix + ".4");
+}
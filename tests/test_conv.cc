@@ -0,0 +1,201 @@
+#include <cmath>
+#include <cstdlib>
+#include <vector>
+#include <criterion/criterion.h>
+
+#include "../src/model/model.hh"
+#include "../src/layer_implem/conv2d_layer.hh"
+#include "../src/layer_implem/dense_layer.hh"
+#include "../src/layer_implem/max_pool2d_layer.hh"
+
+// Random parameters owned by the test, so that it can perturb them
+static void set_random_parameters(HiddenLayer<double>* layer, int rows, int cols,
+                                  std::vector<Matrix<double>>& parameters)
+{
+    Matrix<double> weights(rows, cols);
+    Matrix<double> biases(rows, 1);
+    weights.fill(fill_type::RANDOM_FLOAT);
+    biases.fill(fill_type::RANDOM_FLOAT);
+    layer->set_parameters(weights, biases);
+    parameters.push_back(weights);
+    parameters.push_back(biases);
+}
+
+Test(test_conv, forward_matches_direct_convolution)
+{
+    set_random_seed(0);
+    Model<double> model;
+    const ImageShape shape = { 2, 5, 6 };
+    auto conv = new Conv2DLayer<double, Tanh<double>>(shape, 3, 3, 2, 1);
+    std::vector<Matrix<double>> parameters;
+    set_random_parameters(conv, 3, 2 * 3 * 3, parameters);
+    model.add(new InputLayer<double>(shape.size()));
+    model.add(conv);
+    model.compile(0.1);
+
+    const ImageShape out = conv->get_output_shape();
+    cr_assert_eq(out.channels, 3);
+    cr_assert_eq(out.height, 3);
+    cr_assert_eq(out.width, 3);
+
+    const int batch = 3;
+    Matrix<double> x(shape.size(), batch);
+    x.fill(fill_type::RANDOM_FLOAT);
+    Matrix<double> a = model.predict(x);
+    cr_assert_eq(a.get_rows(), out.size());
+
+    const Matrix<double>& w = parameters[0];
+    const Matrix<double>& b = parameters[1];
+    for (int n = 0; n < batch; n++)
+    {
+        for (int f = 0; f < out.channels; f++)
+        {
+            for (int oh = 0; oh < out.height; oh++)
+            {
+                for (int ow = 0; ow < out.width; ow++)
+                {
+                    double z = b(f, 0);
+                    for (int c = 0; c < shape.channels; c++)
+                        for (int i = 0; i < 3; i++)
+                            for (int j = 0; j < 3; j++)
+                            {
+                                const int h = oh * 2 - 1 + i;
+                                const int v = ow * 2 - 1 + j;
+                                if (h >= 0 && h < shape.height && v >= 0 && v < shape.width)
+                                    z += w(f, (c * 3 + i) * 3 + j)
+                                         * x((c * shape.height + h) * shape.width + v, n);
+                            }
+                    cr_assert_float_eq(a((f * out.height + oh) * out.width + ow, n),
+                                       std::tanh(z), 1e-12);
+                }
+            }
+        }
+    }
+}
+
+Test(test_conv, max_pool_with_padding)
+{
+    Model<float> model;
+    const ImageShape shape = { 1, 4, 5 };
+    auto pool = new MaxPool2DLayer<float>(shape, 2, 2, 1);
+    model.add(new InputLayer<float>(shape.size()));
+    model.add(pool);
+    model.compile(0.1);
+
+    cr_assert_eq(pool->get_output_shape().height, 3);
+    cr_assert_eq(pool->get_output_shape().width, 3);
+
+    // Pixel (h, w) is h * 5 + w in the first sample, its opposite in the
+    // second one
+    Matrix<float> x(shape.size(), 2);
+    for (int i = 0; i < shape.size(); i++)
+    {
+        x(i, 0) = i;
+        x(i, 1) = -i;
+    }
+    Matrix<float> a = model.predict(x);
+    const float first[] = { 0, 2, 4, 10, 12, 14, 15, 17, 19 };
+    const float second[] = { 0, -1, -3, -5, -6, -8, -15, -16, -18 };
+    for (int i = 0; i < 9; i++)
+    {
+        cr_assert_eq(a(i, 0), first[i]);
+        cr_assert_eq(a(i, 1), second[i]);
+    }
+}
+
+// Gradients of 0.5 * sum (a - y)^2, read from one SGD step, against
+// central differences, through convolution, pooling and dense layers
+Test(test_conv, gradients_match_finite_differences)
+{
+    set_random_seed(1);
+    Model<double> model;
+    const ImageShape shape = { 2, 6, 6 };
+    auto conv1 = new Conv2DLayer<double, Tanh<double>>(shape, 3, 3, 1, 1);
+    auto pool = new MaxPool2DLayer<double>(conv1->get_output_shape());
+    auto conv2 = new Conv2DLayer<double, Tanh<double>>(pool->get_output_shape(), 2, 2);
+    auto dense = new DenseLayer<double, Sigmoid<double>>(2);
+    std::vector<Matrix<double>> parameters;
+    set_random_parameters(conv1, 3, 2 * 3 * 3, parameters);
+    set_random_parameters(conv2, 2, 3 * 2 * 2, parameters);
+    set_random_parameters(dense, 2, conv2->get_output_shape().size(), parameters);
+    model.add(new InputLayer<double>(shape.size()));
+    model.add(conv1);
+    model.add(pool);
+    model.add(conv2);
+    model.add(dense);
+
+    const int batch = 4;
+    std::vector<Matrix<double>> x;
+    std::vector<Matrix<double>> y;
+    for (int n = 0; n < batch; n++)
+    {
+        x.emplace_back(shape.size(), 1);
+        y.emplace_back(2, 1);
+        x.back().fill(fill_type::RANDOM_FLOAT);
+        y.back()(0, 0) = n % 2;
+        y.back()(1, 0) = 1 - n % 2;
+    }
+    const Matrix<double> x_batch = Matrix<double>::hstack(x, 0, batch);
+    const Matrix<double> y_batch = Matrix<double>::hstack(y, 0, batch);
+
+    const double learning_rate = 1e-3;
+    model.compile(learning_rate, batch);
+    auto loss = [&]() {
+        Matrix<double> a = model.predict(x_batch);
+        double sum = 0;
+        for (int i = 0; i < a.get_rows(); i++)
+            for (int n = 0; n < batch; n++)
+                sum += 0.5 * (a(i, n) - y_batch(i, n)) * (a(i, n) - y_batch(i, n));
+        return sum;
+    };
+
+    std::vector<std::vector<double>> before;
+    std::vector<std::vector<double>> expected;
+    for (Matrix<double>& p : parameters)
+    {
+        const int size = p.get_rows() * p.get_cols();
+        double* data = p.get_data();
+        before.emplace_back(data, data + size);
+        expected.emplace_back(size);
+        for (int i = 0; i < size; i++)
+        {
+            const double h = 1e-6;
+            const double v = data[i];
+            data[i] = v + h;
+            const double up = loss();
+            data[i] = v - h;
+            const double down = loss();
+            data[i] = v;
+            expected.back()[i] = (up - down) / (2 * h);
+        }
+    }
+
+    model.train(x, y, 1, batch);
+    for (size_t k = 0; k < parameters.size(); k++)
+    {
+        const double* data = parameters[k].get_data();
+        for (size_t i = 0; i < expected[k].size(); i++)
+            cr_assert_float_eq((before[k][i] - data[i]) / learning_rate, expected[k][i], 1e-6,
+                               "parameter %zu of array %zu", i, k);
+    }
+}
+
+Test(test_conv, bad_shapes)
+{
+    const ImageShape shape = { 1, 4, 4 };
+    cr_assert_throw(Conv2DLayer<float>(shape, 2, 5), std::invalid_argument);
+    cr_assert_throw(Conv2DLayer<float>(shape, 2, 3, 0), std::invalid_argument);
+    cr_assert_throw(Conv2DLayer<float>(shape, 0, 3), std::invalid_argument);
+    cr_assert_throw(MaxPool2DLayer<float>(shape, 2, 2, 2), std::invalid_argument);
+
+    Model<float> model;
+    model.add(new InputLayer<float>(15));
+    model.add(new Conv2DLayer<float, ReLU<float>>(shape, 2, 3));
+    cr_assert_throw(model.compile(0.1), std::invalid_argument);
+
+    Model<float> pooled;
+    pooled.add(new InputLayer<float>(shape.size()));
+    pooled.add(new MaxPool2DLayer<float>(shape));
+    pooled.compile(0.1);
+    cr_assert_throw(pooled.save("/tmp/prophecy_pooled.model"), std::invalid_argument);
+}
@@ -0,0 +1,186 @@
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <set>
+#include <criterion/criterion.h>
+
+#include "../src/dataset/importers.hh"
+#include "../src/model/model.hh"
+#include "../src/layer_implem/dense_layer.hh"
+
+// Sample s has inputs (s, 2s, 3s) and target (-s)
+static void write_sequence(const std::string& path, int n)
+{
+    DatasetWriter<float> writer(path, 3, 1);
+    for (int s = 0; s < n; s++)
+    {
+        float x[3] = { float(s), 2.0f * s, 3.0f * s };
+        float y = -s;
+        writer.append(x, &y);
+    }
+    writer.close();
+}
+
+Test(test_dataset, write_and_gather)
+{
+    const std::string path = "/tmp/prophecy_test_sequence.data";
+    write_sequence(path, 10);
+    Dataset<float> data(path);
+    std::remove(path.c_str());
+
+    cr_assert_eq(data.size(), 10u);
+    cr_assert_eq(data.get_x_size(), 3);
+    cr_assert_eq(data.get_y_size(), 1);
+
+    size_t indices[2] = { 7, 2 };
+    Matrix<float> x(3, 2);
+    Matrix<float> y(1, 2);
+    data.gather(indices, 2, x, y);
+    cr_assert_eq(x(0, 0), 7);
+    cr_assert_eq(x(2, 0), 21);
+    cr_assert_eq(x(1, 1), 4);
+    cr_assert_eq(y(0, 1), -2);
+}
+
+Test(test_dataset, bad_header_sizes)
+{
+    const std::string path = "/tmp/prophecy_test_header.data";
+    // x_size above INT_MAX, then x_size + y_size wrapping to 0
+    const uint64_t sizes[][2] = { { 1ull << 31, 1 }, { 1ull << 63, 1ull << 63 } };
+    for (const auto& size : sizes)
+    {
+        write_sequence(path, 10);
+        {
+            std::fstream file(path, std::ios::in | std::ios::out | std::ios::binary);
+            file.seekp(offsetof(DatasetFileHeader, x_size));
+            file.write(reinterpret_cast<const char*>(size), sizeof(size));
+        }
+        cr_assert_throw(Dataset<float> data(path), std::runtime_error);
+    }
+    std::remove(path.c_str());
+}
+
+static std::vector<int> pipeline_order(const Dataset<float>& data, int epochs, uint64_t seed)
+{
+    BatchPipeline<float> pipeline(data, 4, epochs, seed);
+    std::vector<int> order;
+    Matrix<float> x;
+    Matrix<float> y;
+    while (pipeline.next(x, y))
+        for (int j = 0; j < x.get_cols(); j++)
+            order.push_back(x(0, j));
+    return order;
+}
+
+Test(test_dataset, pipeline_epochs)
+{
+    const std::string path = "/tmp/prophecy_test_pipeline.data";
+    write_sequence(path, 10);
+    Dataset<float> data(path);
+    std::remove(path.c_str());
+
+    std::vector<int> order = pipeline_order(data, 3, 1);
+    cr_assert_eq(order.size(), 30u);
+    for (int epoch = 0; epoch < 3; epoch++)
+    {
+        std::set<int> seen(order.begin() + 10 * epoch, order.begin() + 10 * (epoch + 1));
+        cr_assert_eq(seen.size(), 10u);
+    }
+
+    cr_assert(pipeline_order(data, 3, 1) == order);
+    cr_assert(pipeline_order(data, 3, 2) != order);
+}
+
+Test(test_dataset, import_csv)
+{
+    const std::string csv = "/tmp/prophecy_test.csv";
+    const std::string path = "/tmp/prophecy_test_csv.data";
+    {
+        std::ofstream out(csv);
+        out << "a,b,c,label\n1, 2, 3, 0\n4,5,6,1\n\n-7,8.5,9e1,0\n";
+    }
+    cr_assert_eq(import_csv<float>(csv, path, 1, true), 3u);
+    Dataset<float> data(path);
+    cr_assert_eq(data.get_x_size(), 3);
+    cr_assert_eq(data.x(2)[1], 8.5f);
+    cr_assert_eq(data.x(2)[2], 90.0f);
+    cr_assert_eq(data.y(1)[0], 1.0f);
+
+    {
+        std::ofstream out(csv);
+        out << "1,2,3\n4,5\n";
+    }
+    cr_assert_throw(import_csv<float>(csv, path, 1), std::runtime_error);
+    std::remove(csv.c_str());
+    std::remove(path.c_str());
+}
+
+static void write_idx(const std::string& path, std::vector<unsigned> dims,
+                      const std::vector<unsigned char>& bytes)
+{
+    std::ofstream out(path, std::ios::binary);
+    out.put(0).put(0).put(0x08).put(dims.size());
+    for (unsigned d : dims)
+        out.put(d >> 24).put(d >> 16).put(d >> 8).put(d);
+    out.write(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+}
+
+Test(test_dataset, import_idx)
+{
+    const std::string images = "/tmp/prophecy_test_images.idx";
+    const std::string labels = "/tmp/prophecy_test_labels.idx";
+    const std::string path = "/tmp/prophecy_test_idx.data";
+    write_idx(images, { 2, 2, 2 }, { 0, 255, 51, 102, 255, 0, 0, 0 });
+    write_idx(labels, { 2 }, { 3, 1 });
+
+    cr_assert_eq(import_idx<float>(images, labels, path, 4), 2u);
+    Dataset<float> data(path);
+    cr_assert_eq(data.get_x_size(), 4);
+    cr_assert_eq(data.get_y_size(), 4);
+    cr_assert_float_eq(data.x(0)[1], 1.0f, 1e-6);
+    cr_assert_float_eq(data.x(0)[2], 0.2f, 1e-6);
+    cr_assert_eq(data.y(0)[3], 1.0f);
+    cr_assert_eq(data.y(1)[1], 1.0f);
+    cr_assert_eq(data.y(1)[3], 0.0f);
+
+    write_idx(labels, { 2 }, { 3, 9 });
+    cr_assert_throw(import_idx<float>(images, labels, path, 4), std::runtime_error);
+    std::remove(images.c_str());
+    std::remove(labels.c_str());
+    std::remove(path.c_str());
+}
+
+Test(test_dataset, train_xor_from_file)
+{
+    const std::string path = "/tmp/prophecy_test_xor.data";
+    {
+        DatasetWriter<float> writer(path, 2, 1);
+        for (int a = 0; a < 2; a++)
+            for (int b = 0; b < 2; b++)
+            {
+                float x[2] = { float(a), float(b) };
+                float y = a ^ b;
+                writer.append(x, &y);
+            }
+        writer.close();
+    }
+    Dataset<float> data(path);
+    std::remove(path.c_str());
+
+    set_random_seed(0);
+    Model<float> model;
+    model.add(new InputLayer<float>(2));
+    model.add(new DenseLayer<float, Tanh<float>>(4));
+    model.add(new DenseLayer<float, Sigmoid<float>>(1));
+    model.compile(0.5, 4);
+    model.train(data, 5000, 4);
+
+    for (size_t s = 0; s < data.size(); s++)
+    {
+        Matrix<float> x(2, 1);
+        x(0, 0) = data.x(s)[0];
+        x(1, 0) = data.x(s)[1];
+        cr_assert_float_eq(model.predict(x)(0, 0), data.y(s)[0], 0.2);
+    }
+}
@@ -0,0 +1,157 @@
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include <criterion/criterion.h>
+
+#include "../src/dataset/importers.hh"
+#include "../src/model/model.hh"
+#include "../src/layer_implem/dense_layer.hh"
+
+// Five classes, one-hot targets drawn at random
+static void create_classes(std::vector<Matrix<double>>& x, std::vector<Matrix<double>>& y, int n)
+{
+    for (int s = 0; s < n; s++)
+    {
+        x.emplace_back(4, 1);
+        x.back().fill(fill_type::RANDOM_FLOAT);
+        y.emplace_back(5, 1);
+        y.back().fill(0);
+        y.back()(random_engine()() % 5, 0) = 1;
+    }
+}
+
+static int arg_max(const Matrix<double>& m, int col)
+{
+    int best = 0;
+    for (int i = 1; i < m.get_rows(); i++)
+        if (m(i, col) > m(best, col))
+            best = i;
+    return best;
+}
+
+Test(test_evaluation, matches_sequential_metrics)
+{
+    ThreadPool::set_global_threads(4);
+    set_random_seed(3);
+    Model<double> model;
+    model.add(new InputLayer<double>(4));
+    model.add(new DenseLayer<double, Tanh<double>>(6));
+    model.add(new DenseLayer<double, Softmax<double>>(5));
+    model.compile(Optimizer<double>::sgd(0.1), Loss<double>::categorical_cross_entropy());
+
+    std::vector<Matrix<double>> x;
+    std::vector<Matrix<double>> y;
+    create_classes(x, y, 1003);
+
+    // Batches of 64, the last one short
+    const Evaluation e = model.evaluate(x, y, 64, 2);
+
+    const Matrix<double> a = model.predict(Matrix<double>::hstack(x, 0, x.size()));
+    const Matrix<double> targets = Matrix<double>::hstack(y, 0, y.size());
+    std::vector<size_t> confusion(25, 0);
+    int correct = 0;
+    int top_2 = 0;
+    for (int n = 0; n < a.get_cols(); n++)
+    {
+        const int target = arg_max(targets, n);
+        const int predicted = arg_max(a, n);
+        int above = 0;
+        for (int i = 0; i < 5; i++)
+            above += a(i, n) > a(target, n);
+        correct += target == predicted;
+        top_2 += above < 2;
+        confusion[target * 5 + predicted]++;
+    }
+
+    cr_assert_eq(e.samples, 1003u);
+    cr_assert_eq(e.nb_classes, 5);
+    cr_assert_eq(e.top_k, 2);
+    cr_assert_float_eq(e.loss, model.get_loss().value(a, targets) / 1003, 1e-12);
+    cr_assert_float_eq(e.accuracy, correct / 1003.0, 1e-12);
+    cr_assert_float_eq(e.top_k_accuracy, top_2 / 1003.0, 1e-12);
+    cr_assert(e.confusion == confusion);
+    cr_assert_eq(e.confusion_count(2, 3), confusion[2 * 5 + 3]);
+}
+
+Test(test_evaluation, single_output_and_dataset)
+{
+    // Sample s is (s, 2s, 3s) -> s is odd, through a model that outputs
+    // sigmoid(x0 - 2.5)
+    const std::string path = "/tmp/prophecy_test_evaluation.data";
+    DatasetWriter<float> writer(path, 3, 1);
+    for (int s = 0; s < 10; s++)
+    {
+        float x[3] = { float(s), 2.0f * s, 3.0f * s };
+        float y = s % 2;
+        writer.append(x, &y);
+    }
+    writer.close();
+    Dataset<float> data(path);
+    std::remove(path.c_str());
+
+    Model<float> model;
+    auto output = new DenseLayer<float, Sigmoid<float>>(1);
+    Matrix<float> w(1, 3);
+    Matrix<float> b(1, 1);
+    w.fill(0);
+    w(0, 0) = 1;
+    b(0, 0) = -2.5f;
+    output->set_parameters(w, b);
+    model.add(new InputLayer<float>(3));
+    model.add(output);
+    model.compile(0.1);
+
+    // Predicted 0 for 0, 1, 2 and 1 for the rest
+    const Evaluation e = model.evaluate(data, 3);
+    cr_assert_eq(e.samples, 10u);
+    cr_assert_eq(e.nb_classes, 2);
+    cr_assert_eq(e.confusion_count(0, 0), 2u);
+    cr_assert_eq(e.confusion_count(0, 1), 3u);
+    cr_assert_eq(e.confusion_count(1, 0), 1u);
+    cr_assert_eq(e.confusion_count(1, 1), 4u);
+    cr_assert_float_eq(e.accuracy, 0.6, 1e-12);
+    cr_assert_float_eq(e.top_k_accuracy, 1.0, 1e-12);
+}
+
+Test(test_evaluation, early_stopping)
+{
+    set_random_seed(4);
+    Model<double> model;
+    model.add(new InputLayer<double>(4));
+    model.add(new DenseLayer<double, Softmax<double>>(5));
+    // Barely learning: the validation loss never improves by min_delta
+    // after the first evaluation
+    model.compile(Optimizer<double>::sgd(1e-6), Loss<double>::categorical_cross_entropy(), 8);
+
+    std::vector<Matrix<double>> x;
+    std::vector<Matrix<double>> y;
+    create_classes(x, y, 32);
+
+    EarlyStopping stopping(3, 0.1);
+    std::vector<int> epochs;
+    model.set_validation(x, y, 2, [&](int epoch, const Evaluation& e) {
+        epochs.push_back(epoch);
+        return stopping(epoch, e);
+    });
+    model.train(x, y, 100, 8);
+    cr_assert(epochs == std::vector<int>({ 2, 4, 6, 8 }));
+    cr_assert(stopping.get_best_loss() < 10);
+
+    model.clear_validation();
+    epochs.clear();
+    model.train(x, y, 3, 8);
+    cr_assert(epochs.empty());
+
+    cr_assert_throw(model.set_validation(x, y, 0, stopping), std::invalid_argument);
+    cr_assert_throw(model.evaluate(x, y, 0), std::invalid_argument);
+    cr_assert_throw(model.evaluate(y, y), std::invalid_argument);
+
+    // Checked past the first sample too, before any batch is stacked
+    std::vector<Matrix<double>> bad_x = x;
+    std::vector<Matrix<double>> bad_y = y;
+    bad_x[20] = Matrix<double>(5, 1);
+    cr_assert_throw(model.evaluate(bad_x, y, 8, 1), std::invalid_argument);
+    bad_y[30] = Matrix<double>(5, 2);
+    cr_assert_throw(model.evaluate(x, bad_y, 8, 1), std::invalid_argument);
+    cr_assert_throw(EarlyStopping(0), std::invalid_argument);
+}
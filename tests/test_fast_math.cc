@@ -0,0 +1,153 @@
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <random>
+#include <criterion/criterion.h>
+
+#include "../src/activation_function/fast_math.hh"
+
+static double sigmoid_reference(long double z) { return 1 / (1 + std::exp(-z)); }
+
+static double softplus_reference(long double z)
+{
+    return z > 0 ? z + std::log1p(std::exp(-z)) : std::log1p(std::exp(z));
+}
+
+// Largest error of f against the libm reference (in long double) over the
+// floats of [low, high]: one bit pattern in 1009 of each sign, which visits
+// every exponent and spreads over the mantissas
+template <typename F, typename R>
+static double float_error(F f, R reference, float low, float high, bool relative)
+{
+    double worst = 0;
+    for (uint64_t bits = 0; bits < 0x7f800000u; bits += 1009)
+    {
+        for (uint32_t sign : { 0u, 0x80000000u })
+        {
+            const uint32_t b = static_cast<uint32_t>(bits) | sign;
+            float x;
+            std::memcpy(&x, &b, sizeof(x));
+            if (!(x >= low && x <= high))
+                continue;
+            const double r = reference(static_cast<long double>(x));
+            const double error = std::abs(f(x) - r);
+            worst = std::max(worst, relative && r != 0 ? error / std::abs(r) : error);
+        }
+    }
+    return worst;
+}
+
+// Same on doubles drawn uniformly in [low, high] and log-uniformly in
+// magnitude, so that small values are covered too
+template <typename F, typename R>
+static double double_error(F f, R reference, double low, double high, bool relative)
+{
+    std::mt19937_64 rng(1);
+    std::uniform_real_distribution<double> uniform(low, high);
+    std::uniform_real_distribution<double> exponent(-12, std::log10(std::max(-low, high)));
+    double worst = 0;
+    for (int i = 0; i < 200000; i++)
+    {
+        double x = uniform(rng);
+        if (i % 2)
+            x = std::pow(10.0, exponent(rng)) * (uniform(rng) < 0 ? -1 : 1);
+        if (!(x >= low && x <= high))
+            continue;
+        const long double r = reference(static_cast<long double>(x));
+        const long double error = std::abs(f(x) - r);
+        worst = std::max(worst, static_cast<double>(relative ? error / std::abs(r) : error));
+    }
+    return worst;
+}
+
+Test(test_fast_math, float_bounds)
+{
+    auto exp = [](long double x) { return static_cast<double>(std::exp(x)); };
+    auto log = [](long double x) { return static_cast<double>(std::log(x)); };
+    auto tanh = [](long double x) { return static_cast<double>(std::tanh(x)); };
+    const float max = std::numeric_limits<float>::max();
+    const float normal = std::numeric_limits<float>::min();
+
+    cr_assert_leq(float_error(fast_exp<float>, exp, -86.9f, 88.3f, true), 1.5e-7);
+    cr_assert_leq(float_error(fast_log<float>, log, normal, max, true), 2.5e-7);
+    cr_assert_leq(float_error(fast_sigmoid<float>, sigmoid_reference, -88.3f, max, true), 2e-7);
+    cr_assert_leq(float_error(fast_tanh<float>, tanh, -max, max, true), 6e-7);
+    cr_assert_leq(float_error(fast_softplus<float>, softplus_reference, -86.9f, max, true), 4e-7);
+}
+
+Test(test_fast_math, double_bounds)
+{
+    auto exp = [](long double x) { return std::exp(x); };
+    auto log = [](long double x) { return std::log(std::abs(x)); };
+    auto tanh = [](long double x) { return std::tanh(x); };
+    auto log_abs = [](double x) { return fast_log(std::abs(x)); };
+    auto sigmoid = [](long double x) { return static_cast<long double>(sigmoid_reference(x)); };
+    auto softplus = [](long double x) { return static_cast<long double>(softplus_reference(x)); };
+
+    cr_assert_leq(double_error(fast_exp<double>, exp, -708, 709.4, true), 3e-16);
+    cr_assert_leq(double_error(log_abs, log, -1e300, 1e300, true), 5e-16);
+    cr_assert_leq(double_error(fast_tanh<double>, tanh, -700, 700, true), 6e-15);
+    // Against a reference rounded to double
+    cr_assert_leq(double_error(fast_sigmoid<double>, sigmoid, -709, 709, true), 5e-16);
+    cr_assert_leq(double_error(fast_softplus<double>, softplus, -708, 709, true), 1e-15);
+}
+
+Test(test_fast_math, table_bounds)
+{
+    auto tanh = [](long double x) { return static_cast<double>(std::tanh(x)); };
+    const ActivationTables<float>& t = activation_tables<float>;
+    const float max = std::numeric_limits<float>::max();
+
+    auto sigmoid = [&t](float z) { return t.sigmoid(z); };
+    auto table_tanh = [&t](float z) { return t.tanh(z); };
+    auto softplus = [&t](float z) { return t.softplus(z); };
+    cr_assert_leq(float_error(sigmoid, sigmoid_reference, -max, max, false), 1e-6);
+    cr_assert_leq(float_error(table_tanh, tanh, -max, max, false), 2.5e-6);
+    cr_assert_leq(float_error(softplus, softplus_reference, -max, max, false), 2.5e-6);
+
+    const ActivationTables<double>& d = activation_tables<double>;
+    for (double z = -40; z <= 40; z += 0.0173)
+    {
+        cr_assert_float_eq(d.sigmoid(z), sigmoid_reference(z), 1e-6);
+        cr_assert_float_eq(d.tanh(z), std::tanh(z), 2.5e-6);
+        cr_assert_float_eq(d.softplus(z), softplus_reference(z), 2.5e-6);
+    }
+}
+
+Test(test_fast_math, out_of_range)
+{
+    const float inf = std::numeric_limits<float>::infinity();
+    cr_assert_eq(fast_exp(-100.0f), 0.0f);
+    cr_assert_eq(fast_exp(100.0f), inf);
+    cr_assert_eq(fast_exp(-inf), 0.0f);
+    cr_assert_eq(fast_exp(1e300), std::numeric_limits<double>::infinity());
+    for (float z : { -inf, -1e30f, -200.0f, 200.0f, 1e30f, inf })
+    {
+        cr_assert_eq(fast_sigmoid(z), z > 0 ? 1.0f : 0.0f);
+        cr_assert_eq(fast_tanh(z), z > 0 ? 1.0f : -1.0f);
+        cr_assert_eq(fast_softplus(z), z > 0 ? z : 0.0f);
+    }
+    cr_assert_eq(fast_sigmoid(0.0f), 0.5f);
+    cr_assert_eq(fast_tanh(0.0f), 0.0f);
+}
+
+Test(test_fast_math, table_nan_and_infinity)
+{
+    const ActivationTables<float>& t = activation_tables<float>;
+    const float inf = std::numeric_limits<float>::infinity();
+    const float nan = std::numeric_limits<float>::quiet_NaN();
+    // NaN propagates, as in the other modes, instead of indexing the tables
+    cr_assert(std::isnan(t.sigmoid(nan)));
+    cr_assert(std::isnan(t.tanh(nan)));
+    cr_assert(std::isnan(t.softplus(nan)));
+    cr_assert(std::isnan(fast_sigmoid(nan)));
+    cr_assert(std::isnan(activation_tables<double>.sigmoid(std::nan(""))));
+
+    cr_assert_float_eq(t.sigmoid(inf), 1.0f, 2e-7);
+    cr_assert_float_eq(t.sigmoid(-inf), 0.0f, 2e-7);
+    cr_assert_float_eq(t.tanh(inf), 1.0f, 4e-7);
+    cr_assert_float_eq(t.tanh(-inf), -1.0f, 4e-7);
+    cr_assert_eq(t.softplus(inf), inf);
+    cr_assert_float_eq(t.softplus(-inf), 0.0f, 2e-7);
+}
@@ -0,0 +1,219 @@
+#include <cmath>
+#include <cstdlib>
+#include <vector>
+#include <criterion/criterion.h>
+
+#include "../src/model/model.hh"
+#include "../src/layer_implem/dense_layer.hh"
+#include "../src/loss/loss.hh"
+
+Test(test_loss, softmax_is_stable)
+{
+    // Logits far beyond what exp can take, in the second column
+    float a[] = { 1, 1000,
+                  2, 1001,
+                  3, 1002 };
+    Softmax<float>().normalize(a, 3, 2);
+    const float total = std::exp(1.0f) + std::exp(2.0f) + std::exp(3.0f);
+    for (int i = 0; i < 3; i++)
+    {
+        cr_assert_float_eq(a[2 * i], std::exp(i + 1.0f) / total, 1e-6);
+        cr_assert_float_eq(a[2 * i + 1], a[2 * i], 1e-6);
+    }
+}
+
+Test(test_loss, values)
+{
+    Matrix<double> a(2, 2);
+    Matrix<double> y(2, 2);
+    a(0, 0) = 0.8;
+    a(1, 0) = 0.2;
+    a(0, 1) = 0.4;
+    a(1, 1) = 0.6;
+    y(0, 0) = 1;
+    y(1, 0) = 0;
+    y(0, 1) = 0;
+    y(1, 1) = 1;
+
+    cr_assert_float_eq(Loss<double>::mse().value(a, y), 0.5 * (0.04 + 0.04 + 0.16 + 0.16), 1e-12);
+    cr_assert_float_eq(Loss<double>::binary_cross_entropy().value(a, y),
+                       -2 * std::log(0.8) - 2 * std::log(0.6), 1e-12);
+    cr_assert_float_eq(Loss<double>::categorical_cross_entropy().value(a, y),
+                       -std::log(0.8) - std::log(0.6), 1e-12);
+
+    // Saturated outputs give a finite loss
+    a(0, 0) = 0;
+    cr_assert(std::isfinite(Loss<double>::categorical_cross_entropy().value(a, y)));
+}
+
+Test(test_loss, fused_delta_sums_loss)
+{
+    // Soft targets too, for both terms of binary cross-entropy
+    const double a[] = { 0.8, 0.4, 0.2, 0.6 };
+    const double y[] = { 1, 0, 0.25, 1 };
+    Matrix<double> am(2, 2);
+    Matrix<double> ym(2, 2);
+    for (int i = 0; i < 4; i++)
+    {
+        am.get_data()[i] = a[i];
+        ym.get_data()[i] = y[i];
+    }
+
+    double z[4];
+    const Loss<double> bce = Loss<double>::binary_cross_entropy();
+    cr_assert_float_eq(bce.output_delta(Sigmoid<double>(), z, a, y, 2, 2), bce.value(am, ym), 1e-12);
+    for (int i = 0; i < 4; i++)
+        cr_assert_float_eq(z[i], a[i] - y[i], 1e-15);
+
+    const Loss<double> cce = Loss<double>::categorical_cross_entropy();
+    cr_assert_float_eq(cce.output_delta(Softmax<double>(), z, a, y, 2, 2), cce.value(am, ym), 1e-12);
+    for (int i = 0; i < 4; i++)
+        cr_assert_float_eq(z[i], a[i] - y[i], 1e-15);
+}
+
+// A sigmoid that the losses do not recognize, to check binary
+// cross-entropy through the general path, on outputs in (0, 1)
+struct UnfusedSigmoid : Sigmoid<double>
+{
+    static constexpr activation_id id = activation_id::CUSTOM;
+};
+
+// Gradients of every loss, read from one SGD step, against central
+// differences of Loss::value, for fused and general output layers
+template <typename Activation>
+static void check_gradients(const Loss<double>& loss)
+{
+    set_random_seed(2);
+    Model<double> model;
+    const int inputs = 5;
+    const int outputs = 3;
+    const int batch = 6;
+    auto hidden = new DenseLayer<double, Tanh<double>>(4);
+    auto output = new DenseLayer<double, Activation>(outputs);
+    model.add(new InputLayer<double>(inputs));
+    model.add(hidden);
+    model.add(output);
+
+    std::vector<Matrix<double>> x;
+    std::vector<Matrix<double>> y;
+    for (int n = 0; n < batch; n++)
+    {
+        x.emplace_back(inputs, 1);
+        x.back().fill(fill_type::RANDOM_FLOAT);
+        y.emplace_back(outputs, 1);
+        y.back().fill(0);
+        y.back()(n % outputs, 0) = 1;
+    }
+    const Matrix<double> x_batch = Matrix<double>::hstack(x, 0, batch);
+    const Matrix<double> y_batch = Matrix<double>::hstack(y, 0, batch);
+
+    const double learning_rate = 1e-3;
+    model.compile(Optimizer<double>::sgd(learning_rate), loss, batch);
+    const double initial_loss = loss.value(model.predict(x_batch), y_batch);
+
+    std::vector<Matrix<double>> parameters = { hidden->get_weights(), output->get_weights() };
+    std::vector<std::vector<double>> before;
+    std::vector<std::vector<double>> expected;
+    for (Matrix<double>& p : parameters)
+    {
+        const int size = p.get_rows() * p.get_cols();
+        double* data = p.get_data();
+        before.emplace_back(data, data + size);
+        expected.emplace_back(size);
+        for (int i = 0; i < size; i++)
+        {
+            const double h = 1e-6;
+            const double v = data[i];
+            data[i] = v + h;
+            const double up = loss.value(model.predict(x_batch), y_batch);
+            data[i] = v - h;
+            const double down = loss.value(model.predict(x_batch), y_batch);
+            data[i] = v;
+            expected.back()[i] = (up - down) / (2 * h);
+        }
+    }
+
+    model.train(x, y, 1, batch);
+    cr_assert_float_eq(model.get_batch_loss(), initial_loss / batch, 1e-12);
+    for (size_t k = 0; k < parameters.size(); k++)
+    {
+        const double* data = parameters[k].get_data();
+        for (size_t i = 0; i < expected[k].size(); i++)
+            cr_assert_float_eq((before[k][i] - data[i]) / learning_rate, expected[k][i], 1e-6,
+                               "%s: parameter %zu of layer %zu", loss_name(loss.id), i, k + 1);
+    }
+}
+
+Test(test_loss, fused_gradients)
+{
+    check_gradients<Softmax<double>>(Loss<double>::categorical_cross_entropy());
+    check_gradients<Sigmoid<double>>(Loss<double>::binary_cross_entropy());
+}
+
+Test(test_loss, general_gradients)
+{
+    check_gradients<Sigmoid<double>>(Loss<double>::mse());
+    check_gradients<Sigmoid<double>>(Loss<double>::categorical_cross_entropy());
+    check_gradients<UnfusedSigmoid>(Loss<double>::binary_cross_entropy());
+    check_gradients<Softplus<double>>(Loss<double>::mse());
+    check_gradients<Softmax<double>>(Loss<double>::mse());
+    check_gradients<Softmax<double>>(Loss<double>::binary_cross_entropy());
+}
+
+Test(test_loss, softmax_classifier)
+{
+    // Three classes: which of the three inputs is the largest
+    set_random_seed(0);
+    Model<float> model;
+    model.add(new InputLayer<float>(3));
+    model.add(new DenseLayer<float, Tanh<float>>(8));
+    model.add(new DenseLayer<float, Softmax<float>>(3));
+    model.compile(Optimizer<float>::adam(0.02f), Loss<float>::categorical_cross_entropy(), 16);
+
+    std::vector<Matrix<float>> x;
+    std::vector<Matrix<float>> y;
+    for (int n = 0; n < 96; n++)
+    {
+        x.emplace_back(3, 1);
+        x.back().fill(fill_type::RANDOM_FLOAT);
+        x.back()(n % 3, 0) += 1;
+        y.emplace_back(3, 1);
+        y.back().fill(0);
+        int label = 0;
+        for (int i = 1; i < 3; i++)
+            if (x.back()(i, 0) > x.back()(label, 0))
+                label = i;
+        y.back()(label, 0) = 1;
+    }
+
+    model.train(x, y, 1, 16);
+    const double first_epoch = model.get_epoch_loss();
+    model.train(x, y, 50, 16);
+    cr_assert_lt(model.get_epoch_loss(), first_epoch / 4);
+
+    Matrix<float> a = model.predict(Matrix<float>::hstack(x, 0, x.size()));
+    int correct = 0;
+    for (int n = 0; n < a.get_cols(); n++)
+    {
+        float sum = 0;
+        int best = 0;
+        for (int i = 0; i < 3; i++)
+        {
+            sum += a(i, n);
+            if (a(i, n) > a(best, n))
+                best = i;
+        }
+        cr_assert_float_eq(sum, 1, 1e-5);
+        correct += y[n](best, 0) == 1;
+    }
+    cr_assert_geq(correct, 90);
+}
+
+Test(test_loss, softmax_only_on_output)
+{
+    Model<float> model;
+    model.add(new InputLayer<float>(3));
+    model.add(new DenseLayer<float, Softmax<float>>(4));
+    model.add(new DenseLayer<float, Sigmoid<float>>(1));
+    cr_assert_throw(model.compile(0.1), std::invalid_argument);
+}
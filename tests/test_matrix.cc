@@ -1,7 +1,11 @@
+#include <cstdint>
 #include <iostream>
 #include <criterion/criterion.h>
 
 #include "../src/matrix/matrix.hh"
+#include "../src/matrix/gemm_int8.hh"
+#include "../src/matrix/sparse.hh"
+#include "../src/matrix/matrix_view.hh"
 
 Test(test_matrix, simple_get)
 {
@@ -111,3 +115,445 @@ Test(test_matrix, simple_multiply)
     cr_assert_eq(res(1, 0), 4);
     cr_assert_eq(res(1, 1), 9);
 }
+
+Test(test_matrix, dot_transpose_left)
+{
+    Matrix<int> a(3, 2);
+    Matrix<int> b(3, 2);
+    a.fill(fill_type::SEQUENCE);
+    b.fill(fill_type::SEQUENCE);
+
+    Matrix<int> res = Matrix<int>::dot(a, b, transpose::LEFT);
+
+    cr_assert_eq(res.get_rows(), 2);
+    cr_assert_eq(res.get_cols(), 2);
+    cr_assert_eq(res(0, 0), 20);
+    cr_assert_eq(res(0, 1), 26);
+    cr_assert_eq(res(1, 0), 26);
+    cr_assert_eq(res(1, 1), 35);
+}
+
+Test(test_matrix, dot_transpose_right)
+{
+    Matrix<int> a(2, 3);
+    Matrix<int> b(2, 3);
+    a.fill(fill_type::SEQUENCE);
+    b.fill(fill_type::SEQUENCE);
+
+    Matrix<int> res = Matrix<int>::dot(a, b, transpose::RIGHT);
+
+    cr_assert_eq(res.get_rows(), 2);
+    cr_assert_eq(res.get_cols(), 2);
+    cr_assert_eq(res(0, 0), 5);
+    cr_assert_eq(res(0, 1), 14);
+    cr_assert_eq(res(1, 0), 14);
+    cr_assert_eq(res(1, 1), 50);
+}
+
+Test(test_matrix, dot_transpose_square)
+{
+    // Square operands must still honour the requested transpose mode
+    Matrix<int> a(2, 2);
+    Matrix<int> b(2, 2);
+    a.fill(fill_type::SEQUENCE);
+    b.fill(fill_type::SEQUENCE);
+
+    Matrix<int> res = Matrix<int>::dot(a, b, transpose::LEFT);
+
+    cr_assert_eq(res(0, 0), 4);
+    cr_assert_eq(res(0, 1), 6);
+    cr_assert_eq(res(1, 0), 6);
+    cr_assert_eq(res(1, 1), 10);
+}
+
+Test(test_matrix, dot_blocked)
+{
+    // Large and odd enough to go through packing and edge tiles
+    Matrix<double> a(67, 301);
+    Matrix<double> b(301, 45);
+    a.fill(fill_type::RANDOM_FLOAT);
+    b.fill(fill_type::RANDOM_FLOAT);
+
+    Matrix<double> res = Matrix<double>::dot(a, b);
+    Matrix<double> res_left = Matrix<double>::dot(a.transpose(), b, transpose::LEFT);
+    Matrix<double> res_right = Matrix<double>::dot(a, b.transpose(), transpose::RIGHT);
+
+    for (int y = 0; y < res.get_rows(); ++y)
+    {
+        for (int x = 0; x < res.get_cols(); ++x)
+        {
+            double expected = 0;
+            for (int k = 0; k < a.get_cols(); ++k)
+                expected += a(y, k) * b(k, x);
+            cr_assert_float_eq(res(y, x), expected, 1e-9);
+            cr_assert_float_eq(res_left(y, x), expected, 1e-9);
+            cr_assert_float_eq(res_right(y, x), expected, 1e-9);
+        }
+    }
+}
+
+Test(test_matrix, dot_bad_shape)
+{
+    Matrix<int> a(2, 3);
+    Matrix<int> b(2, 3);
+
+    cr_assert_throw(Matrix<int>::dot(a, b), std::invalid_argument);
+}
+
+Test(test_matrix, multiply_does_not_alias)
+{
+    Matrix<int> a(2, 2);
+    Matrix<int> b(2, 2);
+    a.fill(fill_type::SEQUENCE);
+    b.fill(fill_type::SEQUENCE);
+
+    Matrix<int>::multiply(a, b);
+
+    cr_assert_eq(a(1, 1), 3);
+}
+
+Test(test_matrix, elementwise_kernels_all_levels)
+{
+    // Odd length so that every level also runs its scalar tail
+    constexpr int n = 1037;
+    float a[n];
+    float b[n];
+    float out[n];
+    for (int i = 0; i < n; ++i)
+    {
+        a[i] = 0.5f * i - 100.0f;
+        b[i] = 3.0f - 0.25f * i;
+    }
+
+    for (simd_level level : { simd_level::SCALAR, simd_level::SSE2,
+                              simd_level::AVX2, simd_level::AVX512 })
+    {
+        if (level > active_simd_level())
+            continue;
+        auto kernels = ElementwiseKernels<float>::for_level(level);
+
+        kernels.add(out, a, b, n);
+        for (int i = 0; i < n; ++i)
+            cr_assert_eq(out[i], a[i] + b[i]);
+
+        kernels.sub(out, a, b, n);
+        for (int i = 0; i < n; ++i)
+            cr_assert_eq(out[i], a[i] - b[i]);
+
+        kernels.mul(out, a, b, n);
+        for (int i = 0; i < n; ++i)
+            cr_assert_eq(out[i], a[i] * b[i]);
+
+        kernels.fill(out, 7.0f, n);
+        for (int i = 0; i < n; ++i)
+            cr_assert_eq(out[i], 7.0f);
+    }
+}
+
+Test(test_matrix, batch_helpers)
+{
+    std::vector<Matrix<int>> samples;
+    for (int s = 0; s < 3; ++s)
+    {
+        Matrix<int> col(2, 1);
+        col(0, 0) = s;
+        col(1, 0) = 10 * s;
+        samples.push_back(col);
+    }
+
+    Matrix<int> batch = Matrix<int>::hstack(samples, 0, 3);
+    cr_assert_eq(batch.get_rows(), 2);
+    cr_assert_eq(batch.get_cols(), 3);
+    cr_assert_eq(batch(0, 2), 2);
+    cr_assert_eq(batch(1, 1), 10);
+
+    Matrix<int> bias(2, 1);
+    bias(0, 0) = 1;
+    bias(1, 0) = -1;
+    batch.add_to_columns(bias);
+    cr_assert_eq(batch(0, 0), 1);
+    cr_assert_eq(batch(1, 2), 19);
+
+    Matrix<int> sums = batch.sum_columns();
+    cr_assert_eq(sums.get_cols(), 1);
+    cr_assert_eq(sums(0, 0), 6);
+    cr_assert_eq(sums(1, 0), 27);
+}
+
+Test(test_matrix, dot_into_epilogue)
+{
+    for (int size : { 3, 131 })
+    {
+        Matrix<double> a(size, size + 2);
+        Matrix<double> b(size + 2, size + 5);
+        a.fill(fill_type::RANDOM_FLOAT);
+        b.fill(fill_type::RANDOM_FLOAT);
+        Matrix<double> expected = Matrix<double>::dot(a, b);
+
+        // Epilogue adds the row index and counts visits
+        Matrix<int> visits(size, size + 5);
+        visits.fill(0);
+        Matrix<double> out;
+        Matrix<double>::dot_into(out, a, b, transpose::NO_IMPLICIT, false,
+            [&visits](int row, int col, double* out_row, int n) {
+                for (int j = 0; j < n; ++j)
+                {
+                    out_row[j] += row;
+                    visits(row, col + j) += 1;
+                }
+            });
+
+        for (int y = 0; y < out.get_rows(); ++y)
+        {
+            for (int x = 0; x < out.get_cols(); ++x)
+            {
+                cr_assert_eq(visits(y, x), 1);
+                cr_assert_float_eq(out(y, x), expected(y, x) + y, 1e-9);
+            }
+        }
+
+        // Accumulating into an existing output
+        Matrix<double>::dot_into(out, a, b, transpose::NO_IMPLICIT, true);
+        cr_assert_float_eq(out(size - 1, 0), 2 * expected(size - 1, 0) + size - 1, 1e-9);
+    }
+}
+
+Test(test_matrix, expression_chain)
+{
+    Matrix<double> a(3, 4);
+    Matrix<double> y(3, 4);
+    Matrix<double> z(3, 4);
+    a.fill(fill_type::RANDOM_FLOAT);
+    y.fill(fill_type::RANDOM_FLOAT);
+    z.fill(fill_type::RANDOM_FLOAT);
+
+    auto fd = [](double v) { return v * (1 - v); };
+    Matrix<double> res = (a.lazy() - y).multiply(z.lazy().map(fd));
+
+    for (int i = 0; i < 3; ++i)
+        for (int j = 0; j < 4; ++j)
+            cr_assert_float_eq(res(i, j), (a(i, j) - y(i, j)) * fd(z(i, j)), 1e-12);
+}
+
+Test(test_matrix, expression_inplace_update)
+{
+    Matrix<float> w(2, 3);
+    Matrix<float> dw(2, 3);
+    w.fill(fill_type::SEQUENCE);
+    dw.fill(2.0f);
+    const float* buffer = w.get_data();
+
+    w -= 0.5f * dw;
+
+    cr_assert_eq(w.get_data(), buffer);
+    cr_assert_float_eq(w(0, 0), -1.0f, 1e-6);
+    cr_assert_float_eq(w(1, 2), 4.0f, 1e-6);
+}
+
+Test(test_matrix, expression_transpose)
+{
+    Matrix<int> a(2, 3);
+    Matrix<int> b(3, 2);
+    a.fill(fill_type::SEQUENCE);
+    b.fill(1);
+
+    Matrix<int> res = a.lazy().transpose() + b;
+
+    cr_assert_eq(res.get_rows(), 3);
+    cr_assert_eq(res.get_cols(), 2);
+    cr_assert_eq(res(0, 1), 4);
+    cr_assert_eq(res(2, 0), 3);
+}
+
+Test(test_matrix, expression_keeps_operands_alive)
+{
+    Matrix<int> a(2, 2);
+    a.fill(fill_type::SEQUENCE);
+
+    auto e = a.lazy() + Matrix<int>(a.transpose());
+    Matrix<int> res = e;
+
+    cr_assert_eq(res(0, 1), 3);
+    cr_assert_eq(res(1, 1), 6);
+}
+
+Test(test_matrix, int8_gemm_matches_naive)
+{
+    // Odd sizes: tails along k and n in every kernel
+    const int m = 7;
+    const int n = 70;
+    const int k = 45;
+    std::vector<int8_t> a(m * k);
+    std::vector<int8_t> b(n * k);
+    for (size_t i = 0; i < a.size(); i++)
+        a[i] = static_cast<int8_t>((i * 37) % 255 - 127);
+    for (size_t i = 0; i < b.size(); i++)
+        b[i] = static_cast<int8_t>((i * 91) % 255 - 127);
+
+    std::vector<int32_t> expected(m * n, 0);
+    for (int i = 0; i < m; i++)
+        for (int j = 0; j < n; j++)
+            for (int p = 0; p < k; p++)
+                expected[i * n + j] += a[i * k + p] * b[j * k + p];
+
+    std::vector<int32_t> c(m * n, -1);
+    Int8Gemm::compute(m, n, k, a.data(), b.data(),
+        [&c, n](int row, int col, const int32_t* acc, int count) {
+            for (int j = 0; j < count; j++)
+                c[row * n + col + j] = acc[j];
+        });
+    cr_assert(c == expected);
+
+    const simd_level levels[] = { simd_level::SCALAR, simd_level::SSE2,
+                                  simd_level::AVX2, simd_level::AVX512 };
+    for (simd_level level : levels)
+    {
+        if (level > detect_simd_level())
+            continue;
+        int8_row_kernel kernel = int8_row_for_level(level);
+        for (int i = 0; i < m; i++)
+        {
+            kernel(a.data() + i * k, b.data(), k, n, k, c.data() + i * n);
+            for (int j = 0; j < n; j++)
+                cr_assert_eq(c[i * n + j], expected[i * n + j]);
+        }
+    }
+}
+
+Test(test_matrix, csr_products_match_dense)
+{
+    // About 40% of the entries zero, and an empty row
+    Matrix<float> a(9, 13);
+    a.fill(fill_type::SEQUENCE);
+    for (int i = 0; i < 9; i++)
+        for (int j = 0; j < 13; j++)
+            if ((i * 13 + j) % 7 < 3 || i == 4)
+                a(i, j) = 0;
+    CsrMatrix<float> csr = CsrMatrix<float>::from_dense(a);
+    cr_assert(csr.to_dense() == a);
+    cr_assert_lt(csr.nnz(), 9 * 13 * 2 / 3);
+
+    // Products with a bias epilogue, against the dense ones
+    auto bias = [](int row, int, float* out_row, int n) {
+        for (int j = 0; j < n; j++)
+            out_row[j] += row;
+    };
+    Matrix<float> b(13, 40);
+    b.fill(fill_type::SEQUENCE);
+    Matrix<float> expected;
+    Matrix<float> actual;
+    Matrix<float>::dot_into(expected, a, b, transpose::NO_IMPLICIT, false, bias);
+    csr.multiply(actual, b, bias);
+    cr_assert(actual == expected);
+
+    Matrix<float> d(9, 40);
+    d.fill(fill_type::SEQUENCE);
+    Matrix<float>::dot_into(expected, a, d, transpose::LEFT, false, bias);
+    csr.multiply_transposed(actual, d, bias);
+    cr_assert(actual == expected);
+
+    Matrix<float> bad(12, 40);
+    cr_assert_throw(csr.multiply(actual, bad), std::invalid_argument);
+}
+
+Test(test_matrix, storage_semantics)
+{
+    for (int n : { 1, 3, 17, 100 })
+    {
+        Matrix<float> m(n, n + 1);
+        cr_assert_eq(reinterpret_cast<uintptr_t>(m.get_data()) % matrix_alignment, 0);
+    }
+
+    Matrix<int> a(3, 4);
+    a.fill(fill_type::SEQUENCE);
+
+    // Copies share, clones do not
+    Matrix<int> shared = a;
+    Matrix<int> deep = a.clone();
+    a(0, 0) = 42;
+    cr_assert_eq(shared(0, 0), 42);
+    cr_assert_eq(deep(0, 0), 0);
+    cr_assert_neq(deep.get_data(), a.get_data());
+
+    // Moves take the buffer and leave the source empty
+    const int* data = deep.get_data();
+    Matrix<int> moved = std::move(deep);
+    cr_assert_eq(moved.get_data(), data);
+    cr_assert_eq(deep.get_data(), nullptr);
+    cr_assert_eq(deep.get_rows(), 0);
+    shared = std::move(moved);
+    cr_assert_eq(shared.get_data(), data);
+
+    // Contiguous rows, without a copy
+    Matrix<int> rows = a.row_range(1, 3);
+    cr_assert_eq(rows.get_rows(), 2);
+    cr_assert_eq(rows(0, 1), 5);
+    rows(0, 1) = -5;
+    cr_assert_eq(a(1, 1), -5);
+    cr_assert_throw(a.row_range(2, 4), std::invalid_argument);
+}
+
+Test(test_matrix, blocked_transpose)
+{
+    // Several tiles and partial ones on both sides
+    Matrix<int> m(70, 45);
+    m.fill(fill_type::SEQUENCE);
+    Matrix<int> t = m.transpose();
+    cr_assert_eq(t.get_rows(), 45);
+    cr_assert_eq(t.get_cols(), 70);
+    for (int i = 0; i < 70; i++)
+        for (int j = 0; j < 45; j++)
+            cr_assert_eq(t(j, i), m(i, j));
+}
+
+Test(test_matrix, strided_views)
+{
+    Matrix<int> m(6, 5);
+    m.fill(fill_type::SEQUENCE);
+    const Matrix<int>& cm = m;
+
+    // One sample (column) out of a batch
+    MatrixView<const int> view(cm);
+    Matrix<int> sample = view.col(3).to_matrix();
+    cr_assert_eq(sample.get_rows(), 6);
+    cr_assert_eq(sample.get_cols(), 1);
+    for (int i = 0; i < 6; i++)
+        cr_assert_eq(sample(i, 0), m(i, 3));
+
+    // Transposed views, whole and sliced
+    cr_assert(view.t().to_matrix() == m.transpose());
+    MatrixView<const int> block = view.block(1, 2, 4, 3).t();
+    cr_assert_eq(block.get_rows(), 3);
+    cr_assert_eq(block(2, 1), m(2, 4));
+    Matrix<int> block_copy = block.to_matrix();
+    for (int i = 0; i < 3; i++)
+        for (int j = 0; j < 4; j++)
+            cr_assert_eq(block_copy(i, j), m(1 + j, 2 + i));
+    cr_assert(view.row(2).is_contiguous());
+    cr_assert(!view.col(2).is_contiguous());
+
+    // Writes go to the matrix
+    MatrixView<int> writable(m);
+    writable.block(0, 0, 2, 2).fill(-1);
+    writable.row(5).assign(view.row(4));
+    cr_assert_eq(m(1, 1), -1);
+    cr_assert_eq(m(2, 2), 12);
+    cr_assert_eq(m(5, 3), m(4, 3));
+    cr_assert_throw(view.block(4, 0, 3, 1), std::invalid_argument);
+}
+
+Test(test_matrix, matrix_sum_is_eager)
+{
+    Matrix<int> a(2, 2);
+    Matrix<int> b(2, 2);
+    a.fill(fill_type::SEQUENCE);
+    b.fill(1);
+
+    // A copy, not an expression over a and b
+    auto sum = a + b;
+    auto diff = a - b;
+    a.fill(10);
+
+    cr_assert_eq(sum(1, 1), 4);
+    cr_assert_eq(diff(1, 0), 1);
+}
@@ -0,0 +1,473 @@
+#include <atomic>
+#include <cstdlib>
+#include <sstream>
+#include <thread>
+#include <criterion/criterion.h>
+
+#include "../src/model/model.hh"
+#include "../src/layer_implem/dense_layer.hh"
+
+using training_set = std::vector<Matrix<float>>;
+
+static void create_xor(training_set& x, training_set& y)
+{
+    for (unsigned a = 0; a < 2; a++)
+    {
+        for (unsigned b = 0; b < 2; b++)
+        {
+            Matrix<float> mx(2, 1);
+            mx(0, 0) = a;
+            mx(1, 0) = b;
+            Matrix<float> my(1, 1);
+            my(0, 0) = a ^ b;
+            x.emplace_back(mx);
+            y.emplace_back(my);
+        }
+    }
+}
+
+Test(test_model, predict_batch_shape)
+{
+    Model<float> model;
+    SigmoidActivationFunction<float> s;
+    model.add(new InputLayer<float>(3));
+    model.add(new DenseLayer<float>(5, s));
+    model.add(new DenseLayer<float>(2, s));
+    model.compile(0.1);
+
+    Matrix<float> x(3, 7);
+    x.fill(fill_type::RANDOM_FLOAT);
+    auto y = model.predict(x);
+
+    cr_assert_eq(y.get_rows(), 2);
+    cr_assert_eq(y.get_cols(), 7);
+}
+
+Test(test_model, empty_activation)
+{
+    cr_assert_throw((DenseLayer<float, ActivationFunction<float>>(3)), std::invalid_argument);
+    ActivationFunction<float> no_derivative;
+    no_derivative.f_ = [](float z) { return z; };
+    cr_assert_throw(DenseLayer<float>(3, no_derivative), std::invalid_argument);
+}
+
+Test(test_model, train_xor_batched)
+{
+    set_random_seed(0);
+    Model<float> model;
+    SigmoidActivationFunction<float> s;
+    model.add(new InputLayer<float>(2));
+    model.add(new DenseLayer<float>(4, s));
+    model.add(new DenseLayer<float>(1, s));
+
+    training_set x;
+    training_set y;
+    create_xor(x, y);
+
+    model.compile(0.5);
+    model.train(x, y, 10000, 4);
+
+    for (size_t i = 0; i < x.size(); i++)
+        cr_assert_float_eq(model.predict(x[i])(0, 0), y[i](0, 0), 0.2);
+}
+
+Test(test_model, train_xor_compile_time_activation)
+{
+    set_random_seed(0);
+    Model<float> model;
+    model.add(new InputLayer<float>(2));
+    model.add(new DenseLayer<float, Tanh<float>>(4));
+    model.add(new DenseLayer<float, Sigmoid<float>>(1));
+
+    training_set x;
+    training_set y;
+    create_xor(x, y);
+
+    model.compile(0.5);
+    model.train(x, y, 5000, 4);
+
+    for (size_t i = 0; i < x.size(); i++)
+        cr_assert_float_eq(model.predict(x[i])(0, 0), y[i](0, 0), 0.2);
+}
+
+static Model<float>* make_wide_model(int nb_threads)
+{
+    set_random_seed(42);
+    auto model = new Model<float>();
+    model->add(new InputLayer<float>(8));
+    model->add(new DenseLayer<float, Tanh<float>>(32));
+    model->add(new DenseLayer<float, Sigmoid<float>>(3));
+    model->compile(0.05, 20, nb_threads);
+    return model;
+}
+
+static void create_random_set(training_set& x, training_set& y, int n)
+{
+    set_random_seed(7);
+    for (int i = 0; i < n; i++)
+    {
+        Matrix<float> mx(8, 1);
+        Matrix<float> my(3, 1);
+        mx.fill(fill_type::RANDOM_FLOAT);
+        my.fill(fill_type::RANDOM_FLOAT);
+        my.map_inplace([](float v) { return v > 0 ? 1.0f : 0.0f; });
+        x.push_back(mx);
+        y.push_back(my);
+    }
+}
+
+Test(test_model, data_parallel_reproducible)
+{
+    ThreadPool::set_global_threads(4);
+    training_set x;
+    training_set y;
+    create_random_set(x, y, 50);
+
+    std::unique_ptr<Model<float>> a(make_wide_model(3));
+    std::unique_ptr<Model<float>> b(make_wide_model(3));
+    a->train(x, y, 5, 20);
+    b->train(x, y, 5, 20);
+
+    Matrix<float> batch = Matrix<float>::hstack(x, 0, x.size());
+    Matrix<float> pa = a->predict(batch);
+    Matrix<float> pb = b->predict(batch);
+    cr_assert(pa == pb);
+}
+
+Test(test_model, data_parallel_matches_serial)
+{
+    ThreadPool::set_global_threads(4);
+    training_set x;
+    training_set y;
+    create_random_set(x, y, 50);
+
+    std::unique_ptr<Model<float>> serial(make_wide_model(1));
+    std::unique_ptr<Model<float>> parallel(make_wide_model(4));
+    serial->train(x, y, 5, 20);
+    parallel->train(x, y, 5, 20);
+
+    Matrix<float> batch = Matrix<float>::hstack(x, 0, x.size());
+    Matrix<float> ps = serial->predict(batch);
+    Matrix<float> pp = parallel->predict(batch);
+    for (int i = 0; i < ps.get_rows(); i++)
+        for (int j = 0; j < ps.get_cols(); j++)
+            cr_assert_float_eq(ps(i, j), pp(i, j), 1e-4);
+}
+
+Test(test_model, data_parallel_bad_sample_throws)
+{
+    ThreadPool::set_global_threads(4);
+    training_set x;
+    training_set y;
+    create_random_set(x, y, 40);
+    x[25] = Matrix<float>(5, 1);
+
+    std::unique_ptr<Model<float>> model(make_wide_model(4));
+    cr_assert_throw(model->train(x, y, 1, 20), std::invalid_argument);
+}
+
+Test(test_model, predict_batch_concurrent)
+{
+    ThreadPool::set_global_threads(2);
+    training_set x;
+    training_set y;
+    create_random_set(x, y, 40);
+
+    std::unique_ptr<Model<float>> model(make_wide_model(1));
+    model->train(x, y, 2, 20);
+    const Model<float>& shared = *model;
+
+    Matrix<float> batch = Matrix<float>::hstack(x, 0, x.size());
+    Matrix<float> expected = shared.predict(batch);
+
+    // Serving threads with their own contexts, reused across calls
+    std::vector<int> mismatches(4, 0);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; t++)
+    {
+        threads.emplace_back([&, t]() {
+            std::vector<LayerContext<float>> contexts;
+            for (int i = 0; i < 50; i++)
+                if (!(shared.predict_batch(batch, contexts) == expected))
+                    mismatches[t]++;
+        });
+    }
+    for (auto& thread : threads)
+        thread.join();
+
+    for (int t = 0; t < 4; t++)
+        cr_assert_eq(mismatches[t], 0);
+}
+
+Test(test_model, predict_batch_cold_pool)
+{
+    // First use of the shared pool, from several threads at once: nothing
+    // before the serving threads may touch it
+    setenv("PROPHECY_THREADS", "4", 1);
+    set_random_seed(3);
+    Model<float> model;
+    model.add(new InputLayer<float>(240));
+    model.add(new DenseLayer<float, ReLU<float>>(240));
+    model.add(new DenseLayer<float, Sigmoid<float>>(10));
+    model.compile(0.1);
+
+    Matrix<float> batch(240, 64);
+    batch.fill(fill_type::RANDOM_FLOAT);
+
+    std::atomic<bool> go(false);
+    std::vector<Matrix<float>> results(4, Matrix<float>(10, 64));
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; t++)
+    {
+        threads.emplace_back([&, t]() {
+            std::vector<LayerContext<float>> contexts;
+            while (!go.load())
+                std::this_thread::yield();
+            results[t] = model.predict_batch(batch, contexts);
+        });
+    }
+    go = true;
+    for (auto& thread : threads)
+        thread.join();
+
+    Matrix<float> expected = model.predict(batch);
+    for (int t = 0; t < 4; t++)
+        cr_assert(results[t] == expected);
+}
+
+Test(test_model, summary_counts)
+{
+    Model<float> model;
+    model.add(new InputLayer<float>(3));
+    model.add(new DenseLayer<float, ReLU<float>>(5));
+    model.add(new DenseLayer<float, Sigmoid<float>>(2));
+    model.compile(0.1, 4);
+
+    std::ostringstream out;
+    model.summary(out);
+    const std::string text = out.str();
+    cr_assert_neq(text.find("dense(relu)"), std::string::npos);
+    cr_assert_neq(text.find("Total params: 32,"), std::string::npos);
+    // 3x5 + 5 parameters, as floats
+    cr_assert_neq(text.find("80 B"), std::string::npos);
+}
+
+Test(test_model, profiler_counters)
+{
+    Profiler profiler(2);
+    profiler.record(1, profile_pass::BACKWARD, 1000, 64);
+    profiler.record(1, profile_pass::BACKWARD, 500, 64);
+    Profiler::Counters c = profiler.get(1, profile_pass::BACKWARD);
+    cr_assert_eq(c.calls, 2);
+    cr_assert_eq(c.nanoseconds, 1500);
+    cr_assert_eq(c.flops, 128);
+    cr_assert_eq(profiler.get(0, profile_pass::FORWARD).calls, 0);
+
+    // Scopes only record in PROPHECY_PROFILE builds
+    bool evaluated = false;
+    {
+        ProfileScope scope(profiler, 0, profile_pass::FORWARD,
+                           [&]() { evaluated = true; return 1.0; });
+    }
+    cr_assert_eq(profiler.get(0, profile_pass::FORWARD).calls, profiling_enabled ? 1 : 0);
+    cr_assert_eq(evaluated, profiling_enabled);
+
+    profiler.reset();
+    cr_assert_eq(profiler.get(1, profile_pass::BACKWARD).calls, 0);
+}
+
+Test(test_model, quantized_inference)
+{
+    // Weights from the model's own seed, data from the global one
+    Model<float> model(11);
+    set_random_seed(11);
+    model.add(new InputLayer<float>(20));
+    model.add(new DenseLayer<float, ReLU<float>>(64));
+    model.add(new DenseLayer<float, Sigmoid<float>>(5));
+
+    Matrix<float> calibration(20, 200);
+    calibration.fill(fill_type::RANDOM_FLOAT);
+    cr_assert_throw(model.quantize(calibration), std::invalid_argument);
+    model.compile(0.1);
+    Matrix<float> expected = model.predict(calibration);
+
+    QuantizationReport report = model.quantize(calibration);
+    cr_assert_eq(model.get_inference_mode(), inference_mode::INT8);
+    cr_assert_lt(report.max_abs_error, 0.05);
+    cr_assert_gt(report.top1_agreement, 0.9);
+
+    Matrix<float> actual = model.predict(calibration);
+    for (int i = 0; i < expected.get_rows(); i++)
+        for (int j = 0; j < expected.get_cols(); j++)
+            cr_assert_float_eq(actual(i, j), expected(i, j), 0.05);
+
+    model.set_inference_mode(inference_mode::FLOAT);
+    cr_assert(model.predict(calibration) == expected);
+
+    // Training drops the int8 weights, and the int8 path with them
+    model.quantize(calibration);
+    training_set x(1, Matrix<float>(20, 1));
+    training_set y(1, Matrix<float>(5, 1));
+    x[0].fill(fill_type::RANDOM_FLOAT);
+    y[0].fill(0.5f);
+    model.train(x, y, 1, 1);
+    cr_assert_eq(model.get_inference_mode(), inference_mode::FLOAT);
+}
+
+Test(test_model, pruned_model)
+{
+    Model<float> model(5);
+    set_random_seed(5);
+    auto* hidden = new DenseLayer<float, ReLU<float>>(40);
+    model.add(new InputLayer<float>(30));
+    model.add(hidden);
+    model.add(new DenseLayer<float, Sigmoid<float>>(3));
+    model.compile(0.1, 8);
+
+    Matrix<float> before = hidden->get_weights();
+    model.prune(0.8);
+    cr_assert(hidden->is_sparse());
+    cr_assert_eq(hidden->get_sparse_weights()->nnz(), 30 * 40 / 5);
+    cr_assert_eq(hidden->get_nb_parameters(), 30 * 40 / 5 + 40);
+
+    // The largest weights are kept as they were
+    Matrix<float> after = hidden->get_dense_weights();
+    float smallest_kept = 1e30;
+    float largest_pruned = 0;
+    for (int i = 0; i < 40; i++)
+    {
+        for (int j = 0; j < 30; j++)
+        {
+            if (after(i, j) != 0)
+            {
+                cr_assert_eq(after(i, j), before(i, j));
+                smallest_kept = std::min(smallest_kept, std::abs(before(i, j)));
+            }
+            else
+                largest_pruned = std::max(largest_pruned, std::abs(before(i, j)));
+        }
+    }
+    cr_assert_leq(largest_pruned, smallest_kept);
+
+    // Same predictions as the dense model with these weights, which is what
+    // a pruned model saves
+    const char* path = "/tmp/prophecy_test_pruned.bin";
+    model.save(path);
+    Model<float> dense;
+    dense.load(path);
+    std::remove(path);
+    Matrix<float> x(30, 8);
+    x.fill(fill_type::RANDOM_FLOAT);
+    Matrix<float> expected = dense.predict(x);
+    Matrix<float> actual = model.predict(x);
+    for (int i = 0; i < 3; i++)
+        for (int j = 0; j < 8; j++)
+            cr_assert_float_eq(actual(i, j), expected(i, j), 1e-5);
+
+    // Training moves the kept weights only
+    training_set xs;
+    training_set ys;
+    for (int s = 0; s < 16; s++)
+    {
+        xs.emplace_back(30, 1);
+        ys.emplace_back(3, 1);
+        xs.back().fill(fill_type::RANDOM_FLOAT);
+        ys.back().fill(fill_type::ZERO);
+        ys.back()(s % 3, 0) = 1;
+    }
+    model.train(xs, ys, 2, 8);
+    Matrix<float> trained = hidden->get_dense_weights();
+    bool moved = false;
+    for (int i = 0; i < 40; i++)
+    {
+        for (int j = 0; j < 30; j++)
+        {
+            if (after(i, j) == 0)
+                cr_assert_eq(trained(i, j), 0);
+            moved |= trained(i, j) != after(i, j);
+        }
+    }
+    cr_assert(moved);
+}
+
+Test(test_model, pruning_ties)
+{
+    Model<float> model(4);
+    auto* hidden = new DenseLayer<float, ReLU<float>>(10);
+    model.add(new InputLayer<float>(10));
+    model.add(hidden);
+    model.compile(0.1);
+
+    // Equal magnitudes, as after quantization, and a few zeros
+    Matrix<float> weights(10, 10);
+    Matrix<float> biases(10, 1);
+    weights.fill(0.25f);
+    biases.fill(fill_type::ZERO);
+    for (int i = 0; i < 10; i++)
+        weights(i, i) = i % 2 ? -0.25f : 0.0f;
+    hidden->set_parameters(weights, biases);
+
+    model.prune(0.3);
+    cr_assert_eq(hidden->get_sparse_weights()->nnz(), 70);
+    model.prune(0.75);
+    cr_assert_eq(hidden->get_sparse_weights()->nnz(), 25);
+}
+
+Test(test_model, pruning_schedule)
+{
+    Model<float> model(6);
+    auto* hidden = new DenseLayer<float, ReLU<float>>(20);
+    model.add(new InputLayer<float>(10));
+    model.add(hidden);
+    model.add(new DenseLayer<float, Sigmoid<float>>(1));
+    model.compile(0.1, 4);
+
+    training_set x;
+    training_set y;
+    create_xor(x, y);
+    for (auto& m : x)
+    {
+        Matrix<float> wide(10, 1);
+        wide.fill(fill_type::ZERO);
+        wide(0, 0) = m(0, 0);
+        wide(1, 0) = m(1, 0);
+        m = wide;
+    }
+
+    // 1 - (1 - 1/2)^3 of 0.8 after the first epoch, 0.8 after the second,
+    // then no more pruning
+    model.set_pruning_schedule(0.8, 2);
+    model.train(x, y, 1, 4);
+    cr_assert_eq(hidden->get_sparse_weights()->nnz(), 200 - 140);
+    model.train(x, y, 2, 4);
+    cr_assert_eq(hidden->get_sparse_weights()->nnz(), 200 - 160);
+}
+
+Test(test_model, deep_model_plan)
+{
+    // Passes are loops over the plan, whatever the depth
+    Model<float> model;
+    model.add(new InputLayer<float>(3));
+    for (int l = 0; l < 300; l++)
+        model.add(new DenseLayer<float, Tanh<float>>(4));
+    cr_assert_throw(model.predict(Matrix<float>(3, 1)), std::invalid_argument);
+
+    model.compile(0.01, 2);
+    training_set x;
+    training_set y;
+    for (int s = 0; s < 2; s++)
+    {
+        x.emplace_back(3, 1);
+        y.emplace_back(4, 1);
+        x.back().fill(fill_type::RANDOM_FLOAT);
+        y.back().fill(fill_type::ZERO);
+    }
+    model.train(x, y, 1, 2);
+    Matrix<float> out = model.predict(x[0]);
+    cr_assert_eq(out.get_rows(), 4);
+    cr_assert_eq(out.get_cols(), 1);
+
+    // Adding a layer invalidates the plan
+    model.add(new DenseLayer<float, Tanh<float>>(2));
+    cr_assert_throw(model.predict(x[0]), std::invalid_argument);
+}
@@ -0,0 +1,112 @@
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <criterion/criterion.h>
+
+#include "../src/model/model.hh"
+#include "../src/layer_implem/dense_layer.hh"
+
+static Model<float>* make_trained_model(void)
+{
+    set_random_seed(3);
+    auto model = new Model<float>();
+    model->add(new InputLayer<float>(5));
+    // Math modes are saved too: a layer loaded in another one would not
+    // predict the same
+    model->add(new DenseLayer<float, Tanh<float, math_mode::FAST>>(16));
+    model->add(new DenseLayer<float, LeakyReLU<float>>(8, LeakyReLU<float>(0.2)));
+    model->add(new DenseLayer<float, Sigmoid<float, math_mode::TABLE>>(2));
+    model->compile(0.1, 8);
+
+    std::vector<Matrix<float>> x;
+    std::vector<Matrix<float>> y;
+    for (int i = 0; i < 16; i++)
+    {
+        x.emplace_back(5, 1);
+        y.emplace_back(2, 1);
+        x.back().fill(fill_type::RANDOM_FLOAT);
+        y.back().fill(fill_type::ZERO);
+    }
+    model->train(x, y, 3, 8);
+    return model;
+}
+
+Test(test_model_file, save_load_round_trip)
+{
+    const std::string path = "/tmp/prophecy_test_round_trip.model";
+    std::unique_ptr<Model<float>> saved(make_trained_model());
+    saved->save(path);
+
+    Model<float> loaded;
+    loaded.load(path);
+    std::remove(path.c_str()); // the mapping outlives the file
+
+    Matrix<float> x(5, 9);
+    x.fill(fill_type::RANDOM_FLOAT);
+    cr_assert(saved->predict(x) == loaded.predict(x));
+}
+
+Test(test_model_file, train_after_load)
+{
+    const std::string path = "/tmp/prophecy_test_train.model";
+    std::unique_ptr<Model<float>> saved(make_trained_model());
+    saved->save(path);
+
+    Model<float> loaded;
+    loaded.load(path);
+    std::vector<Matrix<float>> x(4, Matrix<float>(5, 1));
+    std::vector<Matrix<float>> y(4, Matrix<float>(2, 1));
+    for (int i = 0; i < 4; i++)
+    {
+        x[i].fill(fill_type::RANDOM_FLOAT);
+        y[i].fill(fill_type::ZERO);
+    }
+    loaded.train(x, y, 2, 4);
+
+    // Writes go to private pages, never to the file
+    Model<float> again;
+    again.load(path);
+    Matrix<float> probe(5, 3);
+    probe.fill(fill_type::RANDOM_FLOAT);
+    cr_assert(again.predict(probe) == saved->predict(probe));
+    cr_assert_not(again.predict(probe) == loaded.predict(probe));
+
+    // Loaded layers are float ones, whatever ran before
+    loaded.quantize(probe);
+    loaded.load(path);
+    cr_assert_eq(loaded.get_inference_mode(), inference_mode::FLOAT);
+    cr_assert(loaded.predict(probe) == again.predict(probe));
+    std::remove(path.c_str());
+}
+
+Test(test_model_file, reject_bad_files)
+{
+    const std::string path = "/tmp/prophecy_test_bad.model";
+    {
+        std::ofstream out(path, std::ios::binary);
+        out << "definitely not a model, but long enough to hold a header";
+    }
+
+    Model<float> model;
+    cr_assert_throw(model.load(path), std::runtime_error);
+    cr_assert_throw(model.load("/tmp/prophecy_test_missing.model"), std::runtime_error);
+
+    std::unique_ptr<Model<float>> saved(make_trained_model());
+    saved->save(path);
+    Model<double> other;
+    cr_assert_throw(other.load(path), std::runtime_error);
+    std::remove(path.c_str());
+}
+
+Test(test_model_file, reject_custom_activation)
+{
+    ActivationFunction<float> custom;
+    custom.f_ = [](float z) { return z; };
+    custom.fd_ = [](float) { return 1.0f; };
+
+    Model<float> model;
+    model.add(new InputLayer<float>(2));
+    model.add(new DenseLayer<float>(1, custom));
+    model.compile(0.1);
+    cr_assert_throw(model.save("/tmp/prophecy_test_custom.model"), std::invalid_argument);
+}
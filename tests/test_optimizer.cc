@@ -0,0 +1,185 @@
+#include <cmath>
+#include <vector>
+#include <criterion/criterion.h>
+
+#include "../src/model/model.hh"
+#include "../src/layer_implem/dense_layer.hh"
+#include "../src/optimizer/optimizer.hh"
+
+// One step of every rule, written out plainly
+static void reference_step(const Optimizer<double>& o, long t, std::vector<double>& w,
+                           const std::vector<double>& g, std::vector<double>& m,
+                           std::vector<double>& v)
+{
+    for (size_t i = 0; i < w.size(); i++)
+    {
+        switch (o.id)
+        {
+            case optimizer_id::SGD:
+                w[i] -= o.learning_rate * g[i];
+                break;
+            case optimizer_id::MOMENTUM:
+                m[i] = o.decay1 * m[i] + g[i];
+                w[i] -= o.learning_rate * m[i];
+                break;
+            case optimizer_id::NESTEROV:
+                m[i] = o.decay1 * m[i] + g[i];
+                w[i] -= o.learning_rate * (g[i] + o.decay1 * m[i]);
+                break;
+            case optimizer_id::RMSPROP:
+                m[i] = o.decay2 * m[i] + (1 - o.decay2) * g[i] * g[i];
+                w[i] -= o.learning_rate * g[i] / (std::sqrt(m[i]) + o.epsilon);
+                break;
+            case optimizer_id::ADAM:
+            {
+                m[i] = o.decay1 * m[i] + (1 - o.decay1) * g[i];
+                v[i] = o.decay2 * v[i] + (1 - o.decay2) * g[i] * g[i];
+                const double m_hat = m[i] / (1 - std::pow(o.decay1, t));
+                const double v_hat = v[i] / (1 - std::pow(o.decay2, t));
+                w[i] -= o.learning_rate * m_hat / (std::sqrt(v_hat) + o.epsilon);
+                break;
+            }
+        }
+    }
+}
+
+Test(test_optimizer, rules_match_reference)
+{
+    const Optimizer<double> optimizers[] = {
+        Optimizer<double>::sgd(0.1), Optimizer<double>::momentum(0.1),
+        Optimizer<double>::momentum(0.1, 0.8, true), Optimizer<double>::rmsprop(0.01),
+        Optimizer<double>::adam(0.01)
+    };
+    const int n = 37; // a vector tail at every width
+    for (const Optimizer<double>& o : optimizers)
+    {
+        std::vector<double> w(n);
+        std::vector<double> expected(n);
+        for (int i = 0; i < n; i++)
+            w[i] = expected[i] = std::sin(i);
+        std::vector<double> m(n, 0);
+        std::vector<double> v(n, 0);
+        OptimizerState<double> state;
+
+        for (long t = 1; t <= 3; t++)
+        {
+            std::vector<double> g(n);
+            for (int i = 0; i < n; i++)
+                g[i] = std::cos(i * t);
+            reference_step(o, t, expected, g, m, v);
+            state.step(o, w.data(), g.data(), n);
+            for (int i = 0; i < n; i++)
+            {
+                cr_assert_float_eq(w[i], expected[i], 1e-12, "%s", optimizer_name(o.id));
+                cr_assert_eq(g[i], 0);
+            }
+        }
+    }
+}
+
+Test(test_optimizer, kernels_all_levels)
+{
+    const simd_level levels[] = { simd_level::SCALAR, simd_level::SSE2,
+                                  simd_level::AVX2, simd_level::AVX512 };
+    const OptimizerStep<float> s = { 0.01f, 0.9f, 0.999f, 1e-7f };
+    const int n = 45;
+    for (int rule = 0; rule < 5; rule++)
+    {
+        std::vector<float> expected;
+        for (simd_level level : levels)
+        {
+            if (level > detect_simd_level())
+                continue;
+            std::vector<float> w(n, 1);
+            std::vector<float> g(n);
+            std::vector<float> m(n, 0.5f);
+            std::vector<float> v(n, 0.25f);
+            for (int i = 0; i < n; i++)
+                g[i] = i - 20;
+            OptimizerKernels<float>::for_level(level).rules[rule](w.data(), g.data(), m.data(),
+                                                                  v.data(), n, s);
+            if (expected.empty())
+                expected = w;
+            for (int i = 0; i < n; i++)
+            {
+                cr_assert_float_eq(w[i], expected[i], 1e-6);
+                cr_assert_eq(g[i], 0);
+            }
+        }
+    }
+}
+
+Test(test_optimizer, adam_first_step)
+{
+    // Bias-corrected, the first step is about the learning rate along the
+    // sign of the gradient, whatever its scale
+    float w[] = { 0, 0, 0 };
+    float g[] = { 1e-3f, -5, 200 };
+    OptimizerState<float> state;
+    state.step(Optimizer<float>::adam(0.01f), w, g, 3);
+    cr_assert_float_eq(w[0], -0.01f, 1e-5);
+    cr_assert_float_eq(w[1], 0.01f, 1e-5);
+    cr_assert_float_eq(w[2], -0.01f, 1e-5);
+}
+
+Test(test_optimizer, bad_parameters)
+{
+    cr_assert_throw(Optimizer<float>::sgd(0), std::invalid_argument);
+    cr_assert_throw(Optimizer<float>::momentum(0.1f, 1), std::invalid_argument);
+    cr_assert_throw(Optimizer<float>::adam(0.1f, 0.9f, -0.5f), std::invalid_argument);
+}
+
+Test(test_optimizer, restore_checks_sizes)
+{
+    float w[] = { 0, 0, 0 };
+    float g[] = { 1, 2, 3 };
+    OptimizerState<float> state;
+    state.step(Optimizer<float>::adam(0.01f), w, g, 3);
+    TrainingState<float> saved;
+    state.save(saved);
+
+    OptimizerState<float> restored;
+    restored.restore(saved, 3);
+    saved.rewind();
+    cr_assert_throw(restored.restore(saved, 4), std::runtime_error);
+
+    // Adam without its second moment
+    TrainingState<float> truncated;
+    truncated.put_counter(static_cast<int64_t>(optimizer_id::ADAM));
+    truncated.put_counter(3);
+    truncated.put_counter(1);
+    truncated.put_array(w, 3);
+    truncated.put_array(w, 0);
+    cr_assert_throw(restored.restore(truncated, 3), std::runtime_error);
+}
+
+Test(test_optimizer, train_xor_adam)
+{
+    set_random_seed(0);
+    Model<float> model;
+    model.add(new InputLayer<float>(2));
+    model.add(new DenseLayer<float, Tanh<float>>(8));
+    model.add(new DenseLayer<float, Sigmoid<float>>(1));
+    model.compile(Optimizer<float>::adam(0.05f), 4);
+
+    std::vector<Matrix<float>> x;
+    std::vector<Matrix<float>> y;
+    for (unsigned a = 0; a < 2; a++)
+    {
+        for (unsigned b = 0; b < 2; b++)
+        {
+            Matrix<float> mx(2, 1);
+            mx(0, 0) = a;
+            mx(1, 0) = b;
+            Matrix<float> my(1, 1);
+            my(0, 0) = a ^ b;
+            x.emplace_back(mx);
+            y.emplace_back(my);
+        }
+    }
+
+    // A tenth of the epochs plain SGD needs in train_xor_batched
+    model.train(x, y, 1000, 4);
+    for (size_t i = 0; i < x.size(); i++)
+        cr_assert_float_eq(model.predict(x[i])(0, 0), y[i](0, 0), 0.2);
+}
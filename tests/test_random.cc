@@ -0,0 +1,140 @@
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <thread>
+#include <criterion/criterion.h>
+
+#include "../src/model/model.hh"
+#include "../src/layer_implem/dense_layer.hh"
+
+// Mean and standard deviation of the values of m
+static void moments(const Matrix<float>& m, double& mean, double& deviation)
+{
+    const long size = static_cast<long>(m.get_rows()) * m.get_cols();
+    double sum = 0;
+    double squares = 0;
+    for (long i = 0; i < size; i++)
+    {
+        sum += m.get_data()[i];
+        squares += static_cast<double>(m.get_data()[i]) * m.get_data()[i];
+    }
+    mean = sum / size;
+    deviation = std::sqrt(squares / size - mean * mean);
+}
+
+static float max_abs(const Matrix<float>& m)
+{
+    float max = 0;
+    for (long i = 0; i < static_cast<long>(m.get_rows()) * m.get_cols(); i++)
+        max = std::max(max, std::abs(m.get_data()[i]));
+    return max;
+}
+
+Test(test_random, reproducible_seeds)
+{
+    Matrix<float> a(30, 40);
+    Matrix<float> b(30, 40);
+    set_random_seed(5);
+    a.fill(fill_type::RANDOM_FLOAT);
+    set_random_seed(5);
+    b.fill(fill_type::RANDOM_FLOAT);
+    cr_assert(a == b);
+    b.fill(fill_type::RANDOM_FLOAT);
+    cr_assert_not(a == b);
+    cr_assert_leq(max_abs(a), 1.0f);
+
+    // Every thread has its own stream
+    uint64_t main_draw = random_engine()();
+    uint64_t other_draw = main_draw;
+    std::thread other([&other_draw]() { other_draw = random_engine()(); });
+    other.join();
+    cr_assert_neq(main_draw, other_draw);
+
+    // Streams of a seed are independent of each other
+    Random first(9, 0);
+    Random second(9, 1);
+    cr_assert_neq(first(), second());
+}
+
+Test(test_random, parallel_fill_ignores_threads)
+{
+    // Many blocks, so that the pool takes part
+    Matrix<float> serial(300, 1000);
+    Matrix<float> parallel(300, 1000);
+    ThreadPool::set_global_threads(1);
+    serial.fill(fill_type::HE_NORMAL, 9);
+    ThreadPool::set_global_threads(4);
+    parallel.fill(fill_type::HE_NORMAL, 9);
+    cr_assert(serial == parallel);
+}
+
+Test(test_random, initializers)
+{
+    // 256 neurons, 1024 inputs
+    Matrix<float> m(256, 1024);
+    double mean;
+    double deviation;
+
+    m.fill(fill_type::NORMAL, 1);
+    moments(m, mean, deviation);
+    cr_assert_float_eq(mean, 0, 0.01);
+    cr_assert_float_eq(deviation, 1, 0.01);
+
+    // N(0, 1) within 2 has a standard deviation of 0.880
+    m.fill(fill_type::TRUNCATED_NORMAL, 2);
+    moments(m, mean, deviation);
+    cr_assert_leq(max_abs(m), 2.0f);
+    cr_assert_float_eq(deviation, 0.880, 0.01);
+
+    m.fill(fill_type::XAVIER_UNIFORM, 3);
+    cr_assert_leq(max_abs(m), std::sqrt(6.0f / (1024 + 256)));
+    cr_assert_geq(max_abs(m), 0.99f * std::sqrt(6.0f / (1024 + 256)));
+
+    m.fill(fill_type::XAVIER_NORMAL, 4);
+    moments(m, mean, deviation);
+    cr_assert_float_eq(deviation, std::sqrt(2.0 / (1024 + 256)), 1e-3);
+
+    m.fill(fill_type::HE_UNIFORM, 5);
+    moments(m, mean, deviation);
+    cr_assert_leq(max_abs(m), std::sqrt(6.0f / 1024));
+    cr_assert_float_eq(deviation, std::sqrt(2.0 / 1024), 1e-3);
+
+    m.fill(fill_type::HE_NORMAL, 6);
+    moments(m, mean, deviation);
+    cr_assert_float_eq(mean, 0, 1e-3);
+    cr_assert_float_eq(deviation, std::sqrt(2.0 / 1024), 1e-3);
+}
+
+Test(test_random, model_seed)
+{
+    HiddenLayer<float>* hidden = nullptr;
+    auto make = [&hidden](uint64_t seed) {
+        auto model = new Model<float>(seed);
+        hidden = new DenseLayer<float, ReLU<float>>(64);
+        hidden->set_initializer(fill_type::HE_NORMAL);
+        model->add(new InputLayer<float>(32));
+        model->add(hidden);
+        model->add(new DenseLayer<float, Sigmoid<float>>(4));
+        model->compile(0.1);
+        return model;
+    };
+
+    // Whatever the global seed
+    set_random_seed(1);
+    std::unique_ptr<Model<float>> a(make(12));
+    const HiddenLayer<float>* first = hidden;
+    set_random_seed(2);
+    std::unique_ptr<Model<float>> b(make(12));
+    std::unique_ptr<Model<float>> c(make(13));
+    cr_assert_eq(a->get_seed(), 12u);
+
+    Matrix<float> x(32, 5);
+    x.fill(fill_type::RANDOM_FLOAT);
+    cr_assert(a->predict(x) == b->predict(x));
+    cr_assert_not(a->predict(x) == c->predict(x));
+
+    // Biases start at 0 with an initializer
+    cr_assert(first->get_initializer() == fill_type::HE_NORMAL);
+    cr_assert_eq(max_abs(first->get_biases()), 0.0f);
+    cr_assert_gt(max_abs(first->get_weights()), 0.0f);
+}
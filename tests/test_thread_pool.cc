@@ -0,0 +1,115 @@
+#include <atomic>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+#include <criterion/criterion.h>
+
+#include "../src/matrix/thread_pool.hh"
+#include "../src/matrix/matrix.hh"
+
+Test(test_thread_pool, every_index_once)
+{
+    ThreadPool pool(4);
+    for (int n : { 1, 3, 4, 1000 })
+    {
+        std::vector<std::atomic<int>> hits(n);
+        pool.parallel_for(n, [&hits](int i) { hits[i]++; });
+        for (int i = 0; i < n; ++i)
+            cr_assert_eq(hits[i].load(), 1);
+    }
+}
+
+Test(test_thread_pool, nested)
+{
+    ThreadPool pool(3);
+    std::atomic<int> total(0);
+    pool.parallel_for(8, [&pool, &total](int) {
+        pool.parallel_for(50, [&total](int j) { total += j; });
+    });
+    cr_assert_eq(total.load(), 8 * (49 * 50 / 2));
+}
+
+Test(test_thread_pool, task_exception_reaches_caller)
+{
+    ThreadPool pool(4);
+    std::atomic<int> ran(0);
+    cr_assert_throw(pool.parallel_for(100, [&ran](int i) {
+        ran++;
+        if (i % 10 == 3)
+            throw std::invalid_argument("bad index");
+    }), std::invalid_argument);
+    cr_assert_eq(ran.load(), 100);
+
+    // The pool is still usable afterwards, nested calls included
+    std::atomic<int> total(0);
+    pool.parallel_for(8, [&pool, &total](int) {
+        pool.parallel_for(50, [&total](int j) { total += j; });
+    });
+    cr_assert_eq(total.load(), 8 * (49 * 50 / 2));
+}
+
+Test(test_thread_pool, uneven_tasks)
+{
+    // Long tasks at the front of the range have to be stolen around
+    ThreadPool pool(4);
+    std::atomic<long> sum(0);
+    pool.parallel_for(64, [&sum](int i) {
+        long local = 0;
+        for (long k = 0; k < (i < 4 ? 2000000 : 1000); ++k)
+            local += k % 7;
+        sum += local + i;
+    });
+    cr_assert_gt(sum.load(), 0);
+}
+
+Test(test_thread_pool, parallel_gemm_matches_serial)
+{
+    Matrix<float> a(300, 500);
+    Matrix<float> b(500, 200);
+    a.fill(fill_type::RANDOM_FLOAT);
+    b.fill(fill_type::RANDOM_FLOAT);
+    Matrix<float> at = a.transpose();
+    Matrix<float> bt = b.transpose();
+
+    ThreadPool::set_global_threads(1);
+    Matrix<float> serial = Matrix<float>::dot(a, b);
+    Matrix<float> serial_left = Matrix<float>::dot(at, b, transpose::LEFT);
+    Matrix<float> serial_right = Matrix<float>::dot(a, bt, transpose::RIGHT);
+
+    ThreadPool::set_global_threads(5);
+    cr_assert(Matrix<float>::dot(a, b) == serial);
+    cr_assert(Matrix<float>::dot(at, b, transpose::LEFT) == serial_left);
+    cr_assert(Matrix<float>::dot(a, bt, transpose::RIGHT) == serial_right);
+    cr_assert(serial_left == serial);
+}
+
+Test(test_thread_pool, resize_while_running)
+{
+    // Callers keep using the pool while it is resized under them
+    ThreadPool pool(2);
+    std::atomic<bool> stop(false);
+    std::vector<long> errors(3, 0);
+    std::vector<std::thread> callers;
+    for (int t = 0; t < 3; ++t)
+    {
+        callers.emplace_back([&, t]() {
+            while (!stop.load())
+            {
+                std::atomic<int> total(0);
+                pool.parallel_for(100, [&total](int i) { total += i; });
+                if (total.load() != 99 * 100 / 2)
+                    errors[t]++;
+            }
+        });
+    }
+    for (int nb_threads : { 4, 1, 3, 2, 5 })
+    {
+        pool.resize(nb_threads);
+        cr_assert_eq(pool.get_nb_threads(), nb_threads);
+    }
+    stop = true;
+    for (auto& caller : callers)
+        caller.join();
+    for (int t = 0; t < 3; ++t)
+        cr_assert_eq(errors[t], 0);
+}
@@ -0,0 +1,137 @@
+#include <atomic>
+#include <cstdlib>
+#include <new>
+#include <thread>
+#include <criterion/criterion.h>
+
+#include "../src/matrix/workspace.hh"
+#include "../src/model/model.hh"
+#include "../src/layer_implem/dense_layer.hh"
+#include "../src/layer_implem/conv2d_layer.hh"
+#include "../src/layer_implem/max_pool2d_layer.hh"
+
+// Counts every heap allocation made by the test binary. Kept out of line so
+// that GCC does not pair inlined new/delete calls with malloc/free.
+static std::atomic<long> heap_allocations(0);
+
+__attribute__((noinline)) void* operator new(std::size_t size)
+{
+    heap_allocations++;
+    void* p = std::malloc(size ? size : 1);
+    if (p == nullptr)
+        throw std::bad_alloc();
+    return p;
+}
+
+__attribute__((noinline)) void operator delete(void* p) noexcept
+{
+    std::free(p);
+}
+
+__attribute__((noinline)) void operator delete(void* p, std::size_t) noexcept
+{
+    std::free(p);
+}
+
+Test(test_workspace, aligned_slots)
+{
+    Workspace<float> ws;
+    int a = ws.reserve(3, 5);
+    int b = ws.reserve(7, 1);
+    ws.allocate();
+
+    Matrix<float> ma = ws.slot(a);
+    Matrix<float> mb = ws.slot(b);
+
+    cr_assert_eq(ma.get_rows(), 3);
+    cr_assert_eq(mb.get_rows(), 7);
+    cr_assert_eq(reinterpret_cast<uintptr_t>(ma.get_data()) % Workspace<float>::alignment, 0u);
+    cr_assert_eq(reinterpret_cast<uintptr_t>(mb.get_data()) % Workspace<float>::alignment, 0u);
+    cr_assert(mb.get_data() >= ma.get_data() + 15);
+}
+
+Test(test_workspace, slots_outlive_workspace)
+{
+    Matrix<float> m;
+    {
+        Workspace<float> ws;
+        int id = ws.reserve(4, 4);
+        ws.allocate();
+        m = ws.slot(id);
+    }
+    m.fill(1.0f);
+    cr_assert_eq(m(3, 3), 1.0f);
+}
+
+// Runs a product on every thread of the shared pool, which allocates its
+// per-thread GEMM buffers: training alone may leave a worker idle
+static void warm_up_pool(int nb_threads)
+{
+    std::atomic<int> arrived(0);
+    ThreadPool::global().parallel_for(nb_threads, [&arrived, nb_threads](int) {
+        // One index per thread: none returns before all have started
+        arrived++;
+        while (arrived.load() < nb_threads)
+            std::this_thread::yield();
+        Matrix<float> a(32, 32);
+        a.fill(1.0f);
+        Matrix<float>::dot(a, a);
+    });
+}
+
+static void check_training_does_not_allocate(int nb_threads, bool convolutional = false)
+{
+    ThreadPool::set_global_threads(nb_threads);
+    Model<float> model;
+    model.add(new InputLayer<float>(20));
+    if (convolutional)
+    {
+        // 20 inputs as a 1 x 4 x 5 image, padded so that the 3 feature maps stay 4 x 5
+        auto conv = new Conv2DLayer<float, ReLU<float>>({ 1, 4, 5 }, 3, 3, 1, 1);
+        model.add(conv);
+        model.add(new MaxPool2DLayer<float>(conv->get_output_shape(), 2, 2, 1));
+    }
+    else
+        model.add(new DenseLayer<float, Sigmoid<float>>(300));
+    model.add(new DenseLayer<float, Sigmoid<float>>(4));
+    model.compile(0.1, 16, nb_threads);
+
+    // 40 samples: two full batches and a partial one
+    std::vector<Matrix<float>> x;
+    std::vector<Matrix<float>> y;
+    for (int i = 0; i < 40; ++i)
+    {
+        Matrix<float> mx(20, 1);
+        Matrix<float> my(4, 1);
+        mx.fill(fill_type::RANDOM_FLOAT);
+        my.fill(0.5f);
+        x.push_back(mx);
+        y.push_back(my);
+    }
+
+    // Warm-up: first use of the per-thread GEMM buffers and kernel tables
+    warm_up_pool(nb_threads);
+    model.train(x, y, 5, 16);
+
+    long before = heap_allocations.load();
+    model.train(x, y, 3, 16);
+    long after = heap_allocations.load();
+
+    cr_assert_eq(after - before, 0);
+}
+
+Test(test_workspace, training_step_does_not_allocate)
+{
+    check_training_does_not_allocate(1);
+}
+
+Test(test_workspace, data_parallel_step_does_not_allocate)
+{
+    check_training_does_not_allocate(3);
+}
+
+Test(test_workspace, conv_step_does_not_allocate)
+{
+    check_training_does_not_allocate(1, true);
+    check_training_does_not_allocate(3, true);
+}